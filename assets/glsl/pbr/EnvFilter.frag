@@ -0,0 +1,87 @@
+#version 410
+
+// Prefilters one mip of a radiance cubemap, one fragment per texel. Same filter as EnvFilter.comp.
+// With uFilteredSampling, uCubeMapTex is the input and each sample reads the level whose texels match the solid angle it covers
+// ( Colbert and Krivanek, GPU-Based Importance Sampling, GPU Gems 3 ), otherwise it is the previous mip read at uSourceLod.
+// EdgeFixup::STRETCH is applied by the projection, EdgeFixup::WARP isn't projective and is applied here through uWarpFactor.
+
+#define PI 3.14159265359
+
+uniform samplerCube	uCubeMapTex;
+
+uniform float	uMip;
+uniform float	uMaxMip;
+uniform float	uSourceLod;
+uniform int		uNumSamples;
+uniform int		uFilteredSampling;
+uniform float	uSourceSize;
+// cubic coefficient of EdgeFixup::WARP for the current mip, 0 otherwise
+uniform float	uWarpFactor;
+
+in vec3			vDirection;
+
+out vec4		oColor;
+
+vec2 hammersley( uint i, uint n )
+{
+	uint bits = i;
+	bits = ( bits << 16u ) | ( bits >> 16u );
+	bits = ( ( bits & 0x55555555u ) << 1u ) | ( ( bits & 0xAAAAAAAAu ) >> 1u );
+	bits = ( ( bits & 0x33333333u ) << 2u ) | ( ( bits & 0xCCCCCCCCu ) >> 2u );
+	bits = ( ( bits & 0x0F0F0F0Fu ) << 4u ) | ( ( bits & 0xF0F0F0F0u ) >> 4u );
+	bits = ( ( bits & 0x00FF00FFu ) << 8u ) | ( ( bits & 0xFF00FF00u ) >> 8u );
+	return vec2( float( i ) / float( n ), float( bits ) * 2.3283064365386963e-10 );
+}
+
+vec3 importanceSampleGGX( vec2 xi, float roughness )
+{
+	float a			= roughness * roughness;
+	float phi		= 2.0 * PI * xi.x;
+	float cosTheta	= sqrt( ( 1.0 - xi.y ) / ( 1.0 + ( a * a - 1.0 ) * xi.y ) );
+	float sinTheta	= sqrt( 1.0 - cosTheta * cosTheta );
+	return vec3( sinTheta * cos( phi ), sinTheta * sin( phi ), cosTheta );
+}
+
+// the face coordinates are the two minor components of the direction projected on the cube, the warp is odd so the orientation of the face doesn't matter
+vec3 warp( vec3 direction )
+{
+	vec3 a		= abs( direction );
+	float m		= max( a.x, max( a.y, a.z ) );
+	vec3 p		= direction / m;
+	vec3 minor	= vec3( 1.0 ) - step( vec3( m ), a );
+	return normalize( p + uWarpFactor * p * p * p * minor );
+}
+
+void main()
+{
+	vec3 N			= uWarpFactor > 0.0 ? warp( vDirection ) : normalize( vDirection );
+	vec3 up			= abs( N.z ) < 0.999 ? vec3( 0.0, 0.0, 1.0 ) : vec3( 1.0, 0.0, 0.0 );
+	vec3 tangentX	= normalize( cross( up, N ) );
+	vec3 tangentY	= cross( N, tangentX );
+	float roughness	= uMaxMip > 0.0 ? uMip / uMaxMip : 0.0;
+
+	vec3 color		= vec3( 0.0 );
+	float weight	= 0.0;
+	for( int i = 0; i < uNumSamples; ++i ) {
+		vec3 H = importanceSampleGGX( hammersley( uint( i ), uint( uNumSamples ) ), roughness );
+		vec3 L = 2.0 * H.z * H - vec3( 0.0, 0.0, 1.0 );
+		if( L.z <= 0.0 ) {
+			continue;
+		}
+
+		float lod = uSourceLod;
+		if( uFilteredSampling != 0 && roughness > 0.0 ) {
+			// pdf of L is D * NdotH / ( 4 * VdotH ) with V = N, compared to the solid angle of a texel of the first level
+			float a2		= roughness * roughness * roughness * roughness;
+			float d			= H.z * H.z * ( a2 - 1.0 ) + 1.0;
+			float pdf		= a2 / ( PI * d * d ) * 0.25;
+			float omegaS	= 1.0 / ( float( uNumSamples ) * pdf );
+			float omegaP	= 4.0 * PI / ( 6.0 * uSourceSize * uSourceSize );
+			lod				= max( 0.5 * log2( omegaS / omegaP ) + 1.0, 0.0 );
+		}
+		color	+= textureLod( uCubeMapTex, tangentX * L.x + tangentY * L.y + N * L.z, lod ).rgb * L.z;
+		weight	+= L.z;
+	}
+
+	oColor = vec4( color / max( weight, 0.001 ), 1.0 );
+}
@@ -0,0 +1,15 @@
+#version 410
+
+// Renders a face of the cube around the origin, the interpolated position is the lookup direction of each texel.
+
+uniform mat4	ciModelViewProjection;
+
+in vec4			ciPosition;
+
+out vec3		vDirection;
+
+void main()
+{
+	vDirection	= ciPosition.xyz;
+	gl_Position	= ciModelViewProjection * ciPosition;
+}
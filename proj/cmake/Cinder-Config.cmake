@@ -11,10 +11,30 @@ if( NOT TARGET Cinder- )
 		${Cinder-_SOURCE_PATH}/CameraFollow.cpp
 		${Cinder-_SOURCE_PATH}/Compute.h
 		${Cinder-_SOURCE_PATH}/Compute.cpp
+		${Cinder-_SOURCE_PATH}/ComputePrimitives.h
+		${Cinder-_SOURCE_PATH}/ComputePrimitives.cpp
+		${Cinder-_SOURCE_PATH}/ComputeKernel.h
+		${Cinder-_SOURCE_PATH}/ComputeKernel.cpp
 		${Cinder-_SOURCE_PATH}/Environment.h
 		${Cinder-_SOURCE_PATH}/Environment.cpp
 		${Cinder-_SOURCE_PATH}/EnvironmentFilter.h
 		${Cinder-_SOURCE_PATH}/EnvironmentFilter.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentBrdf.h
+		${Cinder-_SOURCE_PATH}/EnvironmentBrdf.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentConvert.h
+		${Cinder-_SOURCE_PATH}/EnvironmentConvert.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentManager.h
+		${Cinder-_SOURCE_PATH}/EnvironmentManager.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentClusters.h
+		${Cinder-_SOURCE_PATH}/EnvironmentClusters.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentReadback.h
+		${Cinder-_SOURCE_PATH}/EnvironmentReadback.cpp
+		${Cinder-_SOURCE_PATH}/EnvironmentSky.h
+		${Cinder-_SOURCE_PATH}/EnvironmentSky.cpp
+		${Cinder-_SOURCE_PATH}/Profiler.h
+		${Cinder-_SOURCE_PATH}/Profiler.cpp
+		${Cinder-_SOURCE_PATH}/WorkStealingPool.h
+		${Cinder-_SOURCE_PATH}/WorkStealingPool.cpp
 	)
 	
 	add_library( Cinder- ${Cinder-_SOURCES} )
@@ -0,0 +1,55 @@
+// Runs ComputePrimitives::benchmark() for a range of work group sizes and logs the reports, which are also drawn in the window.
+// The number of elements can be passed as first argument, 4M by default.
+
+#include "cinder/app/App.h"
+#include "cinder/app/RendererGl.h"
+#include "cinder/gl/gl.h"
+#include "cinder/Log.h"
+
+#include "ComputePrimitives.h"
+
+#include <sstream>
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+class ComputePrimitivesBenchmarkApp : public App {
+public:
+	void setup() override;
+	void draw() override;
+
+	vector<string> mReport;
+};
+
+void ComputePrimitivesBenchmarkApp::setup()
+{
+	const auto &args		= getCommandLineArgs();
+	uint32_t numElements	= args.size() > 1 ? (uint32_t) stoul( args[1] ) : 1u << 22;
+
+	for( int workGroupSize : { 64, 128, 256, 512, 1024 } ) {
+		string report = ComputePrimitives::benchmark( numElements, 10, workGroupSize );
+		CI_LOG_I( endl << report );
+
+		istringstream lines( report );
+		for( string line; getline( lines, line ); ) {
+			mReport.push_back( line );
+		}
+		mReport.push_back( "" );
+	}
+}
+
+void ComputePrimitivesBenchmarkApp::draw()
+{
+	gl::clear( Color::gray( 0.1f ) );
+	vec2 position( 20.0f );
+	for( const auto &line : mReport ) {
+		gl::drawString( line, position, Color::white(), Font( "Courier New", 14.0f ) );
+		position.y += 16.0f;
+	}
+}
+
+CINDER_APP( ComputePrimitivesBenchmarkApp, RendererGl( RendererGl::Options().version( 4, 3 ) ), []( App::Settings *settings ) {
+	settings->setWindowSize( 900, 960 );
+	settings->setTitle( "ComputePrimitivesBenchmark" );
+} )
@@ -0,0 +1,151 @@
+// Measures the cost and the error of the sample settings of rk::EnvironmentFilterCompute.
+// Every setting filters the same input, the GPU time and the number of texel fetches are compared to a uniform 1024 samples filter
+// and the RMSE of each mip is measured against a 4096 samples reference. The report is logged and drawn in the window.
+// Pass the path of an equirectangular .hdr / .exr as first argument, a procedural environment is used otherwise.
+
+#include "cinder/app/App.h"
+#include "cinder/app/RendererGl.h"
+#include "cinder/gl/gl.h"
+#include "cinder/Log.h"
+
+#include "EnvironmentFilter.h"
+#include "EnvironmentConvert.h"
+
+#include <iomanip>
+#include <sstream>
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+using namespace renderkit;
+
+class EnvironmentFilterBenchmarkApp : public App {
+public:
+	void setup() override;
+	void draw() override;
+
+	gl::TextureCubeMapRef createEnvironment( uint16_t faceSize ) const;
+	double measureFilter( const EnvironmentFilterComputeRef &filter, int numRuns ) const;
+
+	vector<string> mReport;
+};
+
+void EnvironmentFilterBenchmarkApp::setup()
+{
+	const uint16_t faceSize		= 256;
+	const uint16_t maxSamples	= 1024;
+	const float maxRmse			= 0.01f;
+	const int numRuns			= 8;
+
+	const auto &args	= getCommandLineArgs();
+	auto envMap			= args.size() > 1 ? EquirectangularConverter::convert( loadFile( args[1] ), EquirectangularConverter::Format().faceSize( faceSize ) ) : createEnvironment( faceSize );
+
+	auto baseFormat		= EnvironmentFilterCompute::Format().faceSize( faceSize ).samples( maxSamples );
+	auto reference		= EnvironmentFilterCompute::create( envMap, EnvironmentFilterCompute::Format( baseFormat ).samples( 4096 ) );
+	auto calibrated		= EnvironmentFilterCompute::calibrateSamples( envMap, maxRmse, baseFormat );
+
+	vector<pair<string, EnvironmentFilterCompute::Format>> settings = {
+		{ "uniform", baseFormat },
+		{ "autoSamples", EnvironmentFilterCompute::Format( baseFormat ).autoSamples() },
+		{ "autoSamples + filtered", EnvironmentFilterCompute::Format( baseFormat ).autoSamples().filteredSampling() },
+		{ "calibrated", EnvironmentFilterCompute::Format( baseFormat ).samples( calibrated ) },
+		{ "calibrated + filtered", EnvironmentFilterCompute::Format( baseFormat ).samples( calibrated ).filteredSampling() }
+	};
+
+	ostringstream header;
+	header << setw( 24 ) << left << "setting" << right << setw( 12 ) << "fetches" << setw( 10 ) << "ms" << setw( 10 ) << "time" << setw( 10 ) << "max rmse";
+	mReport.push_back( header.str() );
+
+	uint64_t uniformCost	= 0;
+	double uniformTime		= 0.0;
+	for( const auto &setting : settings ) {
+		auto filter		= EnvironmentFilterCompute::create( envMap, setting.second );
+		double time		= measureFilter( filter, numRuns );
+		uint64_t cost	= filter->calcFilterCost();
+		auto rmse		= EnvironmentFilterBase::calcRmse( filter->getPmRadianceEnvMap(), reference->getPmRadianceEnvMap(), filter->getNumMips() );
+		if( ! uniformCost ) {
+			uniformCost = cost;
+			uniformTime = time;
+		}
+
+		ostringstream row;
+		row << fixed << setprecision( 3 );
+		row << setw( 24 ) << left << setting.first << right << setw( 12 ) << cost << setw( 10 ) << time;
+		row << setw( 9 ) << setprecision( 0 ) << 100.0 * time / std::max( uniformTime, 1e-6 ) << "%";
+		row << setw( 10 ) << setprecision( 4 ) << ( rmse.empty() ? 0.0f : *max_element( rmse.begin(), rmse.end() ) );
+		mReport.push_back( row.str() );
+	}
+
+	ostringstream schedule;
+	schedule << "calibrated schedule ( rmse < " << maxRmse << " ):";
+	for( auto count : calibrated ) {
+		schedule << " " << count;
+	}
+	mReport.push_back( schedule.str() );
+
+	for( const auto &line : mReport ) {
+		CI_LOG_I( line );
+	}
+}
+
+double EnvironmentFilterBenchmarkApp::measureFilter( const EnvironmentFilterComputeRef &filter, int numRuns ) const
+{
+	// the first run happened in the constructor, every run refilters the whole chain
+	GLuint query;
+	glGenQueries( 1, &query );
+	double total = 0.0;
+	for( int run = 0; run < numRuns; ++run ) {
+		glBeginQuery( GL_TIME_ELAPSED, query );
+		filter->filter();
+		glEndQuery( GL_TIME_ELAPSED );
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v( query, GL_QUERY_RESULT, &elapsed );
+		total += double( elapsed ) * 1e-6;
+	}
+	glDeleteQueries( 1, &query );
+	return total / double( numRuns );
+}
+
+gl::TextureCubeMapRef EnvironmentFilterBenchmarkApp::createEnvironment( uint16_t faceSize ) const
+{
+	// sky gradient, a small and very bright sun and a few saturated patches, enough high frequencies for the rough mips to be noisy
+	auto textureFormat = gl::TextureCubeMap::Format().internalFormat( GL_RGB16F ).mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE );
+	auto cubeMap = gl::TextureCubeMap::create( faceSize, faceSize, textureFormat );
+	const vec3 sunDirection = normalize( vec3( 0.4f, 0.6f, -0.7f ) );
+
+	vector<vec3> pixels( faceSize * faceSize );
+	gl::ScopedTextureBind scopedTex( cubeMap );
+	for( uint8_t face = 0; face < 6; ++face ) {
+		for( uint16_t y = 0; y < faceSize; ++y ) {
+			for( uint16_t x = 0; x < faceSize; ++x ) {
+				vec3 dir	= EnvironmentFilterBase::texelToDirection( face, float( x ), float( y ), faceSize );
+				vec3 color	= mix( vec3( 0.25f, 0.2f, 0.15f ), vec3( 0.3f, 0.5f, 0.9f ), glm::clamp( dir.y * 0.5f + 0.5f, 0.0f, 1.0f ) );
+				if( dot( dir, sunDirection ) > 0.999f ) {
+					color += vec3( 200.0f, 180.0f, 150.0f );
+				}
+				if( sin( dir.x * 20.0f ) * sin( dir.z * 20.0f ) > 0.9f && dir.y < 0.2f ) {
+					color = vec3( 4.0f, 0.2f, 0.1f );
+				}
+				pixels[y * faceSize + x] = color;
+			}
+		}
+		glTexSubImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, faceSize, faceSize, GL_RGB, GL_FLOAT, pixels.data() );
+	}
+	glGenerateMipmap( GL_TEXTURE_CUBE_MAP );
+	return cubeMap;
+}
+
+void EnvironmentFilterBenchmarkApp::draw()
+{
+	gl::clear( Color::gray( 0.1f ) );
+	vec2 position( 20.0f );
+	for( const auto &line : mReport ) {
+		gl::drawString( line, position, Color::white(), Font( "Courier New", 14.0f ) );
+		position.y += 18.0f;
+	}
+}
+
+CINDER_APP( EnvironmentFilterBenchmarkApp, RendererGl( RendererGl::Options().version( 4, 3 ) ), []( App::Settings *settings ) {
+	settings->setWindowSize( 760, 200 );
+	settings->setTitle( "EnvironmentFilterBenchmark" );
+} )
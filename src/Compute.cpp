@@ -1,64 +1,1030 @@
 #include "Compute.h"
 
 #include "cinder/Log.h"
+#include "cinder/app/App.h"
+#include "cinder/gl/scoped.h"
 #include "Assets.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+ComputeShaderRef ComputeShader::create( const ci::fs::path &path, ivec3 workGroupSize )
+{
+	return ComputeShaderRef( new ComputeShader( path, workGroupSize ) );
+}
 
 ComputeShaderRef ComputeShader::create( const ci::DataSourceRef & dataSource, ivec3 workGroupSize )
 {
 	return ComputeShaderRef( new ComputeShader( dataSource, workGroupSize ) );
 }
 
+namespace {
+	// Work group sizes picked by ComputeShader::createTuned, one line per device and shader: device \t path \t x y z
+	class TuningCache {
+	public:
+		static TuningCache* instance()
+		{
+			static TuningCache sInstance;
+			return &sInstance;
+		}
+
+		void setPath( const fs::path &path )
+		{
+			mPath		= path;
+			mIsLoaded	= false;
+		}
+		bool find( const std::string &shader, ivec3 *size )
+		{
+			load();
+			auto it = mSizes.find( make_pair( getDevice(), shader ) );
+			if( it == mSizes.end() ) {
+				return false;
+			}
+			*size = it->second;
+			return true;
+		}
+		void insert( const std::string &shader, const ivec3 &size )
+		{
+			load();
+			mSizes[make_pair( getDevice(), shader )] = size;
+			std::ofstream file( getPath().string() );
+			if( ! file ) {
+				CI_LOG_W( "ComputeShader: Can't write the tuning cache " << getPath() );
+				return;
+			}
+			for( const auto &entry : mSizes ) {
+				file << entry.first.first << "\t" << entry.first.second << "\t" << entry.second.x << " " << entry.second.y << " " << entry.second.z << std::endl;
+			}
+		}
+
+	protected:
+		TuningCache() : mIsLoaded( false ) {}
+
+		fs::path getPath() const { return mPath.empty() ? app::getAppPath() / "compute_tuning.txt" : mPath; }
+		static std::string getDevice()
+		{
+			auto toString = []( GLenum name ) { auto value = glGetString( name ); return value ? std::string( reinterpret_cast<const char*>( value ) ) : std::string(); };
+			return toString( GL_VENDOR ) + " " + toString( GL_RENDERER ) + " " + toString( GL_VERSION );
+		}
+		void load()
+		{
+			if( mIsLoaded ) {
+				return;
+			}
+			mIsLoaded = true;
+			std::ifstream file( getPath().string() );
+			std::string line;
+			while( std::getline( file, line ) ) {
+				size_t first = line.find( '\t' ), second = line.find( '\t', first + 1 );
+				if( first == std::string::npos || second == std::string::npos ) {
+					continue;
+				}
+				ivec3 size;
+				std::istringstream values( line.substr( second + 1 ) );
+				if( values >> size.x >> size.y >> size.z ) {
+					mSizes[make_pair( line.substr( 0, first ), line.substr( first + 1, second - first - 1 ) )] = size;
+				}
+			}
+		}
+
+		fs::path										mPath;
+		bool											mIsLoaded;
+		std::map<std::pair<std::string, std::string>, ivec3>	mSizes;
+	};
+}
+
+ComputeShaderRef ComputeShader::createTuned( const ci::fs::path &path, const TuneFn &tuneFn, const std::vector<ivec3> &candidates, int numIterations )
+{
+	auto cache = TuningCache::instance();
+	ivec3 size;
+	if( cache->find( path.generic_string(), &size ) ) {
+		return create( path, size );
+	}
+
+	std::vector<ivec3> sizes = candidates;
+	if( sizes.empty() ) {
+		for( int x = 32; x <= 1024; x *= 2 ) {
+			sizes.push_back( ivec3( x, 1, 1 ) );
+		}
+	}
+
+	// the candidates over the device limits are skipped
+	GLint maxInvocations = 0;
+	ivec3 maxSize;
+	glGetIntegerv( GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations );
+	for( int i = 0; i < 3; ++i ) {
+		glGetIntegeri_v( GL_MAX_COMPUTE_WORK_GROUP_SIZE, i, &maxSize[i] );
+	}
+
+	GLuint query;
+	glGenQueries( 1, &query );
+	ComputeShaderRef best;
+	double bestTime = 0.0;
+	for( const auto &candidate : sizes ) {
+		if( candidate.x * candidate.y * candidate.z > maxInvocations || glm::any( glm::greaterThan( candidate, maxSize ) ) ) {
+			continue;
+		}
+		auto shader = create( path, candidate );
+		if( ! shader->getGlsl() ) {
+			continue;
+		}
+
+		// the first run warms up the driver caches
+		tuneFn( shader );
+		glBeginQuery( GL_TIME_ELAPSED, query );
+		for( int i = 0; i < std::max( 1, numIterations ); ++i ) {
+			tuneFn( shader );
+		}
+		glEndQuery( GL_TIME_ELAPSED );
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v( query, GL_QUERY_RESULT, &nanoseconds );
+		if( ! best || nanoseconds < bestTime ) {
+			best		= shader;
+			bestTime	= (double) nanoseconds;
+		}
+	}
+	glDeleteQueries( 1, &query );
+
+	if( ! best ) {
+		CI_LOG_W( "ComputeShader: No work group size candidate compiled for " << path );
+		return create( path );
+	}
+	cache->insert( path.generic_string(), best->getWorkGroupSize() );
+	return best;
+}
+
+void ComputeShader::setTuningCachePath( const ci::fs::path &path )
+{
+	TuningCache::instance()->setPath( path );
+}
+
+ComputeShader::ComputeShader( const ci::fs::path &path, ivec3 workGroupSize )
+	: mWorkGroupSize{ workGroupSize }
+{
+	// the asset manager recompiles on its file watcher callbacks, never from dispatch(). It logs the failed compiles and doesn't
+	// call back, so the last good program stays in use until the source is fixed.
+	mConnGlsl = assets()->getShader( path, getFormat(), [this]( gl::GlslProgRef glsl ) {
+		if( glsl ) {
+			mUpdateProg = glsl;
+		}
+	} );
+}
+
 ComputeShader::ComputeShader( const ci::DataSourceRef& dataSource, ivec3 workGroupSize )
 	: mWorkGroupSize{ workGroupSize }
 {
 	mConnGlsl = assets()->getFile( dataSource->getFilePath(),
 		[this]( const ci::DataSourceRef& dataSource ) {
-		try {
-			mUpdateProg = gl::GlslProg::
-				create( gl::GlslProg::Format().compute( dataSource )
-					.define( "WG_SIZE_X", std::to_string( mWorkGroupSize.x ) )
-					.define( "WG_SIZE_Y", std::to_string( mWorkGroupSize.y ) )
-					.define( "WG_SIZE_Z", std::to_string( mWorkGroupSize.z ) )
-				);
+			try {
+				mUpdateProg = gl::GlslProg::create( getFormat().compute( dataSource ) );
 			}
 			catch( const gl::GlslProgCompileExc& exc ) {
-				CI_LOG_EXCEPTION( "", exc );
+				CI_LOG_EXCEPTION( "Keeping the previous program", exc );
 			}
 		}
 	);
 }
 
+gl::GlslProg::Format ComputeShader::getFormat() const
+{
+	return gl::GlslProg::Format()
+		.define( "WG_SIZE_X", std::to_string( mWorkGroupSize.x ) )
+		.define( "WG_SIZE_Y", std::to_string( mWorkGroupSize.y ) )
+		.define( "WG_SIZE_Z", std::to_string( mWorkGroupSize.z ) );
+}
+
 void ComputeShader::dispatch( int threadGroupsX, int threadGroupsY, int threadGroupsZ )
 {
+	if( ! mUpdateProg ) {
+		return;
+	}
+	renderkit::ScopedGpuTimer scopedTimer( "ComputeShader::dispatch" );
 	gl::ScopedGlslProg prog( mUpdateProg );
 	gl::dispatchCompute( threadGroupsX, threadGroupsY, threadGroupsZ );
 	gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
 }
 
+void ComputeShader::dispatchElements( int numElementsX, int numElementsY, int numElementsZ )
+{
+	ivec3 numGroups = calcNumGroups( ivec3( numElementsX, numElementsY, numElementsZ ) );
+	dispatch( numGroups.x, numGroups.y, numGroups.z );
+}
+
+ivec3 ComputeShader::calcNumGroups( const ivec3 &numElements ) const
+{
+	return ( glm::max( numElements, ivec3( 0 ) ) + mWorkGroupSize - ivec3( 1 ) ) / mWorkGroupSize;
+}
+
+void ComputeShader::dispatchIndirect( const ComputeBufferRef &args, GLintptr offset )
+{
+	if( ! mUpdateProg ) {
+		return;
+	}
+	renderkit::ScopedGpuTimer scopedTimer( "ComputeShader::dispatchIndirect" );
+	gl::ScopedGlslProg prog( mUpdateProg );
+	gl::ScopedBuffer scopedArgs( GL_DISPATCH_INDIRECT_BUFFER, args->getSsbo()->getId() );
+	glDispatchComputeIndirect( args->getRegionOffset() + offset );
+	gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+}
+
+void ComputeShader::dispatchIndirect( const DispatchArgsRef &args, int index )
+{
+	dispatchIndirect( args->getBuffer(), DispatchArgs::getOffset( index ) );
+}
+
 ///////////////////////////////
 // ----------------
 ///////////////////////////////
 
-ComputeBufferRef ComputeBuffer::create( const void * data, int size, int blockSize )
+ComputeBufferRef ComputeBuffer::create( const void * data, int size, int blockSize, GLenum usage )
+{
+	return ComputeBufferRef( new ComputeBuffer{ data, size, blockSize, usage } );
+}
+
+ComputeBufferRef ComputeBuffer::createStreaming( int size, int blockSize, int numRegions )
+{
+	return ComputeBufferRef( new ComputeBuffer{ size, blockSize, numRegions } );
+}
+
+ComputeBuffer::ComputeBuffer( const void * data, int size, int blockSize, GLenum usage )
+	: mSize{ size }, mBlockSize{ blockSize }, mRegion{ 0 }, mRegionBytes{ 0 }, mMapped{ nullptr }, mIsPersistent{ false }
+{
+	mSsbo = gl::Ssbo::create( mSize * blockSize, data, usage );
+}
+
+ComputeBuffer::ComputeBuffer( int size, int blockSize, int numRegions )
+	: mSize{ size }, mBlockSize{ blockSize }, mFences( std::max( 1, numRegions ), nullptr ), mRegion{ 0 }, mMapped{ nullptr }, mIsPersistent{ false }
+{
+	// regions are bound with glBindBufferRange and have to start at a multiple of the offset alignment
+	GLint alignment = 1;
+	glGetIntegerv( GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment );
+	alignment		= std::max( 1, alignment );
+	mRegionBytes	= ( (GLsizeiptr) size * blockSize + alignment - 1 ) / alignment * alignment;
+	GLsizeiptr bytes = mRegionBytes * (GLsizeiptr) mFences.size();
+
+	mSsbo = gl::Ssbo::create( bytes, nullptr, GL_STREAM_DRAW );
+	if( gl::isExtensionAvailable( "GL_ARB_buffer_storage" ) ) {
+		// respecifies the mutable store allocated by gl::Ssbo as an immutable one that stays mapped for the lifetime of the buffer
+		gl::ScopedBuffer scopedBuffer( mSsbo );
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage( GL_SHADER_STORAGE_BUFFER, bytes, nullptr, flags );
+		mMapped = static_cast<uint8_t*>( glMapBufferRange( GL_SHADER_STORAGE_BUFFER, 0, bytes, flags ) );
+		mIsPersistent = mMapped != nullptr;
+	}
+	if( ! mIsPersistent ) {
+		CI_LOG_W( "ComputeBuffer: Persistent mapping isn't supported, regions are mapped every frame" );
+	}
+	// the first map() moves to the first region
+	mRegion = (int) mFences.size() - 1;
+}
+
+ComputeBuffer::~ComputeBuffer()
+{
+	for( auto &fence : mFences ) {
+		if( fence ) {
+			glDeleteSync( fence );
+		}
+	}
+}
+
+void* ComputeBuffer::map()
+{
+	if( ! isStreaming() ) {
+		CI_LOG_W( "ComputeBuffer: Only streaming buffers can be mapped" );
+		return nullptr;
+	}
+
+	// every command reading the current region has been issued, the region is released once they complete
+	if( mFences[mRegion] ) {
+		glDeleteSync( mFences[mRegion] );
+	}
+	mFences[mRegion] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+
+	// only stalls when the GPU is more than numRegions - 1 frames behind
+	mRegion = ( mRegion + 1 ) % (int) mFences.size();
+	if( auto fence = mFences[mRegion] ) {
+		GLenum status = glClientWaitSync( fence, 0, 0 );
+		if( status == GL_TIMEOUT_EXPIRED ) {
+			renderkit::ScopedCpuTimer scopedTimer( "ComputeBuffer::map stall" );
+			status = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED );
+		}
+		if( status == GL_WAIT_FAILED ) {
+			CI_LOG_W( "ComputeBuffer: Waiting on the region fence failed" );
+		}
+		glDeleteSync( fence );
+		mFences[mRegion] = nullptr;
+	}
+
+	if( mIsPersistent ) {
+		return mMapped + getRegionOffset();
+	}
+	gl::ScopedBuffer scopedBuffer( mSsbo );
+	return glMapBufferRange( GL_SHADER_STORAGE_BUFFER, getRegionOffset(), mRegionBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
+}
+
+void ComputeBuffer::unmap()
 {
-	return ComputeBufferRef( new ComputeBuffer{ data, size, blockSize } );
+	if( isStreaming() && ! mIsPersistent ) {
+		gl::ScopedBuffer scopedBuffer( mSsbo );
+		glUnmapBuffer( GL_SHADER_STORAGE_BUFFER );
+	}
 }
 
-ComputeBuffer::ComputeBuffer( const void * data, int size, int blockSize )
-	: mSize{ size }
+void ComputeBuffer::update( const void * data, int size )
 {
-	mSsbo = gl::Ssbo::create( mSize * blockSize, data, GL_STATIC_DRAW );
+	if( ! isStreaming() ) {
+		mSsbo->bufferSubData( 0, (GLsizeiptr) std::min( size, mSize ) * mBlockSize, data );
+		return;
+	}
+	if( auto mapped = map() ) {
+		memcpy( mapped, data, (size_t) std::min( size, mSize ) * mBlockSize );
+		unmap();
+	}
+}
+
+void ComputeBuffer::bindBase( GLuint bufferUnit )
+{
+	if( isStreaming() ) {
+		mSsbo->bindRange( bufferUnit, getRegionOffset(), mRegionBytes );
+	}
+	else {
+		mSsbo->bindBase( bufferUnit );
+	}
 }
 /*void ComputeBuffer::clear( const void * data, int size, int blockSize)
 {
 	mSsbo = gl::Ssbo::create( size * blockSize, data, GL_DYNAMIC_DRAW );
 }*/
 
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+namespace {
+	// A member of a shader storage block, as reported by the program interface
+	struct BlockVariable {
+		std::string	mName;
+		GLint		mOffset, mTopLevelArrayStride;
+	};
+
+	// Returns the members of the shader storage block of \a program bound to \a binding
+	bool findBlockVariables( GLuint program, GLuint binding, std::string *blockName, std::vector<BlockVariable> *variables )
+	{
+		GLint numBlocks = 0;
+		glGetProgramInterfaceiv( program, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &numBlocks );
+		for( GLint block = 0; block < numBlocks; ++block ) {
+			const GLenum blockProps[] = { GL_BUFFER_BINDING, GL_NUM_ACTIVE_VARIABLES, GL_NAME_LENGTH };
+			GLint blockValues[3] = { 0, 0, 0 };
+			glGetProgramResourceiv( program, GL_SHADER_STORAGE_BLOCK, block, 3, blockProps, 3, nullptr, blockValues );
+			if( (GLuint) blockValues[0] != binding ) {
+				continue;
+			}
+
+			std::vector<char> name( std::max( 1, blockValues[2] ), 0 );
+			glGetProgramResourceName( program, GL_SHADER_STORAGE_BLOCK, block, (GLsizei) name.size(), nullptr, name.data() );
+			*blockName = name.data();
+
+			std::vector<GLint> indices( std::max( 1, blockValues[1] ), 0 );
+			const GLenum activeVariables = GL_ACTIVE_VARIABLES;
+			glGetProgramResourceiv( program, GL_SHADER_STORAGE_BLOCK, block, 1, &activeVariables, (GLsizei) indices.size(), nullptr, indices.data() );
+			for( GLint i = 0; i < blockValues[1]; ++i ) {
+				const GLenum variableProps[] = { GL_OFFSET, GL_TOP_LEVEL_ARRAY_STRIDE, GL_NAME_LENGTH };
+				GLint variableValues[3] = { 0, 0, 0 };
+				glGetProgramResourceiv( program, GL_BUFFER_VARIABLE, indices[i], 3, variableProps, 3, nullptr, variableValues );
+				std::vector<char> variableName( std::max( 1, variableValues[2] ), 0 );
+				glGetProgramResourceName( program, GL_BUFFER_VARIABLE, indices[i], (GLsizei) variableName.size(), nullptr, variableName.data() );
+				variables->push_back( { variableName.data(), variableValues[0], variableValues[1] } );
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Returns the name of the structure member of an array variable, ie. "position" for "particles[0].position", empty for arrays of scalars or vectors
+	std::string getMemberName( const std::string &name )
+	{
+		size_t first = name.find( "]." );
+		if( first == std::string::npos ) {
+			return std::string();
+		}
+		std::string member = name.substr( first + 2 );
+		if( member.size() > 3 && member.compare( member.size() - 3, 3, "[0]" ) == 0 ) {
+			member.resize( member.size() - 3 );
+		}
+		return member;
+	}
+}
+
+TypedComputeBufferBase::TypedComputeBufferBase( int size, size_t stride, Layout layout, const std::vector<Field> &fields, const void *data )
+	: mSize{ size }, mStride{ stride }, mLayout{ layout }, mFields( fields )
+{
+	size_t maxAlignment = 4;
+	for( const auto &field : mFields ) {
+		if( field.mOffset % field.mAlignment ) {
+			CI_LOG_W( "TypedComputeBuffer: Field " << field.mName << " at offset " << field.mOffset << " isn't aligned to " << field.mAlignment << " bytes as std430 requires" );
+		}
+		maxAlignment = std::max( maxAlignment, field.mAlignment );
+	}
+	if( mLayout == Layout::AOS && mStride % maxAlignment ) {
+		CI_LOG_W( "TypedComputeBuffer: Element size " << mStride << " differs from the std430 array stride " << ( mStride + maxAlignment - 1 ) / maxAlignment * maxAlignment );
+	}
+	if( mLayout == Layout::SOA && mFields.empty() ) {
+		CI_LOG_W( "TypedComputeBuffer: The SoA layout needs declared fields, using the AoS layout" );
+		mLayout = Layout::AOS;
+	}
+
+	if( mLayout == Layout::AOS ) {
+		mBuffers.push_back( ComputeBuffer::create( nullptr, mSize, (int) mStride ) );
+	}
+	else {
+		for( const auto &field : mFields ) {
+			mBuffers.push_back( ComputeBuffer::create( nullptr, mSize, (int) field.getArrayStride() ) );
+		}
+	}
+	if( data ) {
+		uploadBytes( data, mSize );
+	}
+}
+
+size_t TypedComputeBufferBase::getPadding() const
+{
+	size_t used = 0;
+	for( const auto &field : mFields ) {
+		used += field.mSize;
+	}
+	return mFields.empty() || used > mStride ? 0 : mStride - used;
+}
+
+void TypedComputeBufferBase::bindBase( GLuint unit )
+{
+	for( size_t i = 0; i < mBuffers.size(); ++i ) {
+		mBuffers[i]->bindBase( unit + (GLuint) i );
+	}
+}
+
+void TypedComputeBufferBase::uploadBytes( const void *data, int size )
+{
+	size = std::min( size, mSize );
+	if( mLayout == Layout::AOS ) {
+		mBuffers[0]->getSsbo()->bufferSubData( 0, (GLsizeiptr) size * mStride, data );
+		return;
+	}
+
+	const uint8_t *elements = static_cast<const uint8_t*>( data );
+	std::vector<uint8_t> values;
+	for( size_t i = 0; i < mFields.size(); ++i ) {
+		// the padding of the std430 array stride is zeroed
+		const auto &field	= mFields[i];
+		size_t arrayStride	= field.getArrayStride();
+		values.assign( (size_t) size * arrayStride, 0 );
+		for( int element = 0; element < size; ++element ) {
+			memcpy( &values[element * arrayStride], elements + element * mStride + field.mOffset, field.mSize );
+		}
+		mBuffers[i]->getSsbo()->bufferSubData( 0, (GLsizeiptr) values.size(), values.data() );
+	}
+}
+
+void TypedComputeBufferBase::downloadBytes( void *data ) const
+{
+	// buffers written by a compute shader need to be visible to the read
+	gl::memoryBarrier( GL_BUFFER_UPDATE_BARRIER_BIT );
+	if( mLayout == Layout::AOS ) {
+		gl::ScopedBuffer scopedBuffer( mBuffers[0]->getSsbo() );
+		glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr) mSize * mStride, data );
+		return;
+	}
+
+	uint8_t *elements = static_cast<uint8_t*>( data );
+	std::vector<uint8_t> values;
+	for( size_t i = 0; i < mFields.size(); ++i ) {
+		const auto &field	= mFields[i];
+		size_t arrayStride	= field.getArrayStride();
+		values.resize( (size_t) mSize * arrayStride );
+		{
+			gl::ScopedBuffer scopedBuffer( mBuffers[i]->getSsbo() );
+			glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr) values.size(), values.data() );
+		}
+		for( int element = 0; element < mSize; ++element ) {
+			memcpy( elements + element * mStride + field.mOffset, &values[element * arrayStride], field.mSize );
+		}
+	}
+}
+
+bool TypedComputeBufferBase::validate( const ComputeShaderRef &shader, GLuint unit ) const
+{
+	gl::GlslProgRef glsl = shader ? shader->getGlsl() : gl::GlslProgRef();
+	if( ! glsl ) {
+		CI_LOG_W( "TypedComputeBuffer: No program to validate against" );
+		return false;
+	}
+
+	bool valid = true;
+	for( size_t i = 0; i < mBuffers.size(); ++i ) {
+		GLuint binding = unit + (GLuint) i;
+		std::string blockName;
+		std::vector<BlockVariable> variables;
+		if( ! findBlockVariables( glsl->getHandle(), binding, &blockName, &variables ) ) {
+			CI_LOG_W( "TypedComputeBuffer: No active shader storage block bound to unit " << binding );
+			valid = false;
+			continue;
+		}
+
+		// the elements are the runtime sized array of the block, the members before it have no array stride
+		size_t stride = mLayout == Layout::AOS ? mStride : mFields[i].getArrayStride();
+		bool hasOffset = false;
+		GLint base = 0;
+		for( const auto &variable : variables ) {
+			if( ! variable.mTopLevelArrayStride ) {
+				continue;
+			}
+			if( (size_t) variable.mTopLevelArrayStride != stride ) {
+				CI_LOG_W( "TypedComputeBuffer: Block " << blockName << " has an array stride of " << variable.mTopLevelArrayStride << " bytes for " << variable.mName << ", the buffer " << stride );
+				valid = false;
+			}
+
+			std::string member = getMemberName( variable.mName );
+			if( mLayout == Layout::SOA || mFields.empty() || member.empty() ) {
+				continue;
+			}
+			auto field = std::find_if( mFields.begin(), mFields.end(), [&member]( const Field &candidate ) { return candidate.mName == member; } );
+			if( field == mFields.end() ) {
+				CI_LOG_W( "TypedComputeBuffer: Member " << variable.mName << " of block " << blockName << " has no declared field" );
+				valid = false;
+				continue;
+			}
+			// offsets are relative to the block, the array starts after the members preceding it
+			if( ! hasOffset ) {
+				base		= variable.mOffset - (GLint) field->mOffset;
+				hasOffset	= true;
+			}
+			else if( variable.mOffset - base != (GLint) field->mOffset ) {
+				CI_LOG_W( "TypedComputeBuffer: Member " << variable.mName << " of block " << blockName << " is at offset " << variable.mOffset - base << ", field " << field->mName << " at " << field->mOffset );
+				valid = false;
+			}
+		}
+	}
+	return valid;
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+namespace {
+	std::weak_ptr<ComputeShader> sDispatchArgsShader;
+}
+
+DispatchArgsRef DispatchArgs::create( int numDispatches )
+{
+	return DispatchArgsRef( new DispatchArgs( numDispatches ) );
+}
+
+DispatchArgs::DispatchArgs( int numDispatches )
+	: mWriterShader{ getWriterShader() }
+{
+	std::vector<GLuint> args( std::max( 1, numDispatches ) * 3, 1 );
+	mBuffer = ComputeBuffer::create( args.data(), (int) args.size() / 3, 3 * sizeof( GLuint ) );
+
+	GLint maxGroups = 65535;
+	glGetIntegeri_v( GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &maxGroups );
+	mMaxGroups = (GLuint) maxGroups;
+}
+
+ComputeShaderRef DispatchArgs::getWriterShader()
+{
+	auto shader = sDispatchArgsShader.lock();
+	if( ! shader ) {
+		try {
+			shader = ComputeShader::create( "glsl/compute/DispatchArgs.comp", ivec3( 1, 1, 1 ) );
+			sDispatchArgsShader = shader;
+		}
+		catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+	}
+	return shader;
+}
+
+void DispatchArgs::set( int index, const ivec3 &numGroups )
+{
+	GLuint args[3] = { (GLuint) numGroups.x, (GLuint) numGroups.y, (GLuint) numGroups.z };
+	mBuffer->getSsbo()->bufferSubData( getOffset( index ), sizeof( args ), args );
+}
+
+void DispatchArgs::setWriterUniforms( const gl::GlslProgRef &glsl, int index, GLuint countIndex, int groupSize ) const
+{
+	glsl->uniform( "uArgsIndex", (GLuint) index );
+	glsl->uniform( "uCountIndex", countIndex );
+	glsl->uniform( "uGroupSize", (GLuint) std::max( 1, groupSize ) );
+	glsl->uniform( "uMaxGroups", mMaxGroups );
+}
+
+void DispatchArgs::write( int index, const ComputeBufferRef &counts, GLuint countIndex, int groupSize )
+{
+	if( ! mWriterShader || ! mWriterShader->getGlsl() ) {
+		CI_LOG_W( "DispatchArgs: No writer program" );
+		return;
+	}
+
+	const auto &glsl = mWriterShader->getGlsl();
+	gl::ScopedGlslProg prog( glsl );
+	setWriterUniforms( glsl, index, countIndex, groupSize );
+	ScopedComputeBuffer scopedCounts( counts, 0 );
+	ScopedComputeBuffer scopedArgs( mBuffer, 1 );
+	// the counts are usually written by the previous pass
+	gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+	gl::dispatchCompute( 1, 1, 1 );
+	gl::memoryBarrier( GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT );
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+ComputeCommandListRef ComputeCommandList::create()
+{
+	return ComputeCommandListRef( new ComputeCommandList() );
+}
+
+ComputeCommandList::ComputeCommandList()
+	: mNumBarriers{ 0 }
+{
+}
+
+ComputeCommandList& ComputeCommandList::dispatch( const ComputeShaderRef &shader, const ivec3 &numElements, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn )
+{
+	return dispatchGroups( shader, shader->calcNumGroups( numElements ), reads, writes, uniformsFn );
+}
+
+ComputeCommandList& ComputeCommandList::dispatchGroups( const ComputeShaderRef &shader, const ivec3 &numGroups, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn )
+{
+	mCommands.push_back( { shader, numGroups, reads, writes, uniformsFn, nullptr, 0 } );
+	return *this;
+}
+
+ComputeCommandList& ComputeCommandList::dispatchIndirect( const ComputeShaderRef &shader, const DispatchArgsRef &args, int index, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn )
+{
+	mCommands.push_back( { shader, ivec3( 0 ), reads, writes, uniformsFn, args->getBuffer(), DispatchArgs::getOffset( index ) } );
+	return *this;
+}
+
+ComputeCommandList& ComputeCommandList::writeDispatchArgs( const DispatchArgsRef &args, int index, const ComputeBufferRef &counts, GLuint countIndex, int groupSize )
+{
+	return dispatchGroups( DispatchArgs::getWriterShader(), ivec3( 1 ), { Binding( counts, 0 ) }, { Binding( args->getBuffer(), 1 ) }, [=]( const gl::GlslProgRef &glsl ) {
+		args->setWriterUniforms( glsl, index, countIndex, groupSize );
+	} );
+}
+
+void ComputeCommandList::submit( GLbitfield finalBarriers )
+{
+	renderkit::ScopedGpuTimer scopedTimer( "ComputeCommandList::submit" );
+	mNumBarriers = 0;
+
+	// buffers written and read since the last barrier and the buffers bound to each unit
+	std::set<const ComputeBuffer*> pendingWrites, pendingReads, argsBuffers;
+	for( const auto &command : mCommands ) {
+		if( command.mArgs ) {
+			argsBuffers.insert( command.mArgs.get() );
+		}
+	}
+	std::map<GLuint, const ComputeBuffer*> boundUnits;
+	auto isPending = []( const std::set<const ComputeBuffer*> &pending, const std::vector<Binding> &bindings ) {
+		return std::any_of( bindings.begin(), bindings.end(), [&]( const Binding &binding ) { return pending.count( binding.mBuffer.get() ) > 0; } );
+	};
+	auto bind = [&boundUnits]( const std::vector<Binding> &bindings ) {
+		for( const auto &binding : bindings ) {
+			auto &bound = boundUnits[binding.mUnit];
+			if( bound != binding.mBuffer.get() ) {
+				binding.mBuffer->bindBase( binding.mUnit );
+				bound = binding.mBuffer.get();
+			}
+		}
+	};
+
+	auto ctx = gl::context();
+	ctx->pushGlslProg();
+	for( const auto &command : mCommands ) {
+		const auto &glsl = command.mShader->getGlsl();
+		if( ! glsl ) {
+			CI_LOG_W( "ComputeCommandList: Skipping a dispatch without program" );
+			continue;
+		}
+
+		// read after write and write after write hazards, the command bit is added as soon as pending arguments are consumed by a later indirect dispatch.
+		// Incoherent stores of a dispatch aren't ordered after the loads of the previous ones either, writing a buffer read since the last barrier needs one too
+		bool readAfterWrite		= isPending( pendingWrites, command.mReads ) || ( command.mArgs && pendingWrites.count( command.mArgs.get() ) );
+		bool writeAfterWrite	= isPending( pendingWrites, command.mWrites );
+		bool writeAfterRead		= isPending( pendingReads, command.mWrites );
+		if( readAfterWrite || writeAfterWrite || writeAfterRead ) {
+			bool pendingArgs = std::any_of( pendingWrites.begin(), pendingWrites.end(), [&argsBuffers]( const ComputeBuffer *buffer ) { return argsBuffers.count( buffer ) > 0; } );
+			gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT | ( pendingArgs ? GL_COMMAND_BARRIER_BIT : 0 ) );
+			pendingWrites.clear();
+			pendingReads.clear();
+			++mNumBarriers;
+		}
+
+		ctx->bindGlslProg( glsl );
+		bind( command.mReads );
+		bind( command.mWrites );
+		if( command.mUniformsFn ) {
+			command.mUniformsFn( glsl );
+		}
+		if( command.mArgs ) {
+			gl::ScopedBuffer scopedArgs( GL_DISPATCH_INDIRECT_BUFFER, command.mArgs->getSsbo()->getId() );
+			glDispatchComputeIndirect( command.mArgs->getRegionOffset() + command.mArgsOffset );
+		}
+		else {
+			gl::dispatchCompute( command.mNumGroups.x, command.mNumGroups.y, command.mNumGroups.z );
+		}
+
+		for( const auto &binding : command.mReads ) {
+			pendingReads.insert( binding.mBuffer.get() );
+		}
+		if( command.mArgs ) {
+			pendingReads.insert( command.mArgs.get() );
+		}
+		for( const auto &binding : command.mWrites ) {
+			pendingWrites.insert( binding.mBuffer.get() );
+		}
+	}
+	ctx->popGlslProg();
+
+	if( finalBarriers && ! pendingWrites.empty() ) {
+		gl::memoryBarrier( finalBarriers );
+		++mNumBarriers;
+	}
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+ComputeBufferPairRef ComputeBufferPair::create( const void * data, int size, int blockSize, GLuint readUnit, GLuint writeUnit )
+{
+	return ComputeBufferPairRef( new ComputeBufferPair( data, size, blockSize, readUnit, writeUnit ) );
+}
+
+ComputeBufferPair::ComputeBufferPair( const void * data, int size, int blockSize, GLuint readUnit, GLuint writeUnit )
+	: mFront{ 0 }, mReadUnit{ readUnit }, mWriteUnit{ writeUnit }
+{
+	if( readUnit == writeUnit ) {
+		CI_LOG_W( "ComputeBufferPair: The read and write units are the same, substeps would read the buffer they write" );
+	}
+	mBuffers[0] = ComputeBuffer::create( data, size, blockSize );
+	mBuffers[1] = ComputeBuffer::create( nullptr, size, blockSize );
+}
+
+void ComputeBufferPair::bind()
+{
+	getFront()->bindBase( mReadUnit );
+	getBack()->bindBase( mWriteUnit );
+}
+
+void ComputeBufferPair::step( const ComputeShaderRef &shader, const ivec3 &numGroups, int numSteps, const UniformsFn &uniformsFn, GLbitfield finalBarriers )
+{
+	const auto &glsl = shader->getGlsl();
+	if( ! glsl || numSteps <= 0 ) {
+		return;
+	}
+
+	renderkit::ScopedGpuTimer scopedTimer( "ComputeBufferPair::step" );
+	gl::ScopedGlslProg scopedGlsl( glsl );
+	for( int i = 0; i < numSteps; ++i ) {
+		// each substep reads what the previous one wrote, the only hazard of the batch
+		if( i > 0 ) {
+			gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+		}
+		bind();
+		if( uniformsFn ) {
+			uniformsFn( glsl, i );
+		}
+		gl::dispatchCompute( numGroups.x, numGroups.y, numGroups.z );
+		swap();
+	}
+	if( finalBarriers ) {
+		gl::memoryBarrier( finalBarriers );
+	}
+}
+
+void ComputeBufferPair::stepElements( const ComputeShaderRef &shader, const ivec3 &numElements, int numSteps, const UniformsFn &uniformsFn, GLbitfield finalBarriers )
+{
+	step( shader, shader->calcNumGroups( numElements ), numSteps, uniformsFn, finalBarriers );
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+ComputeReadbackRef ComputeReadback::create( const Format &format )
+{
+	return ComputeReadbackRef( new ComputeReadback( format ) );
+}
+
+ComputeReadback::ComputeReadback( const Format &format )
+	: mLatency{ std::max( 0, format.getLatency() ) }, mFrame{ 0 }, mRingMapped{ nullptr }, mRingSize{ 0 }, mRingHead{ 0 }, mRingUsed{ 0 }
+{
+	if( ! format.getRingSize() ) {
+		return;
+	}
+	if( ! gl::isExtensionAvailable( "GL_ARB_buffer_storage" ) ) {
+		CI_LOG_W( "ComputeReadback: Persistent mapping isn't supported, reads use staging buffers" );
+		return;
+	}
+
+	mRing = gl::BufferObj::create( GL_COPY_WRITE_BUFFER, (GLsizeiptr) format.getRingSize(), nullptr, GL_STREAM_READ );
+	// respecifies the mutable store as an immutable one that stays mapped for the lifetime of the readback
+	gl::ScopedBuffer scopedBuffer( mRing );
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glBufferStorage( GL_COPY_WRITE_BUFFER, (GLsizeiptr) format.getRingSize(), nullptr, flags );
+	mRingMapped = static_cast<const uint8_t*>( glMapBufferRange( GL_COPY_WRITE_BUFFER, 0, (GLsizeiptr) format.getRingSize(), flags ) );
+	if( mRingMapped ) {
+		mRingSize = format.getRingSize();
+	}
+	else {
+		CI_LOG_W( "ComputeReadback: Mapping the ring failed, reads use staging buffers" );
+		mRing.reset();
+	}
+}
+
+ComputeReadback::~ComputeReadback()
+{
+	for( auto &pending : mPending ) {
+		glDeleteSync( pending.mFence );
+		if( pending.mDropFn ) {
+			pending.mDropFn( "the ComputeReadback was destroyed before the read was delivered" );
+		}
+	}
+}
+
+bool ComputeReadback::allocateRing( size_t bytes, Pending *pending )
+{
+	// copies start at 16 bytes boundaries so the data can be read as vectors
+	bytes = ( bytes + 15 ) / 16 * 16;
+	if( ! mRingMapped || bytes > mRingSize ) {
+		return false;
+	}
+	// an empty ring restarts at the beginning, a read that doesn't fit before the end wraps around and wastes the end
+	size_t start = mRingHead, consumed = bytes;
+	if( mRingUsed == 0 ) {
+		start = 0;
+	}
+	else if( mRingHead + bytes > mRingSize ) {
+		start		= 0;
+		consumed	+= mRingSize - mRingHead;
+	}
+	if( mRingUsed + consumed > mRingSize ) {
+		return false;
+	}
+	pending->mRingOffset	= start;
+	pending->mRingBytes		= consumed;
+	mRingHead				= start + bytes;
+	mRingUsed				+= consumed;
+	return true;
+}
+
+void ComputeReadback::read( const ComputeBufferRef &buffer, const ReadbackFn &readbackFn, GLintptr offset, GLsizeiptr bytes )
+{
+	queueRead( buffer, readbackFn, nullptr, offset, bytes );
+}
+
+void ComputeReadback::queueRead( const ComputeBufferRef &buffer, const ReadbackFn &readbackFn, const DropFn &dropFn, GLintptr offset, GLsizeiptr bytes )
+{
+	GLsizeiptr bufferBytes = (GLsizeiptr) buffer->getSize() * buffer->getBlockSize();
+	if( ! bytes ) {
+		bytes = bufferBytes - offset;
+	}
+	if( offset < 0 || bytes <= 0 || offset + bytes > bufferBytes ) {
+		std::ostringstream reason;
+		reason << "range of " << bytes << " bytes at " << offset << " is out of the " << bufferBytes << " bytes buffer";
+		CI_LOG_W( "ComputeReadback: Dropping the read, " << reason.str() );
+		if( dropFn ) {
+			dropFn( reason.str() );
+		}
+		return;
+	}
+
+	Pending pending;
+	pending.mReadbackFn	= readbackFn;
+	pending.mDropFn		= dropFn;
+	pending.mBytes		= (size_t) bytes;
+	pending.mFrame		= mFrame;
+	pending.mRingOffset	= 0;
+	pending.mRingBytes	= 0;
+
+	GLuint destination;
+	if( allocateRing( pending.mBytes, &pending ) ) {
+		destination = mRing->getId();
+	}
+	else {
+		// recycles the first free buffer large enough
+		auto it = std::find_if( mFreeBuffers.begin(), mFreeBuffers.end(), [&]( const gl::BufferObjRef &staging ) { return (size_t) staging->getSize() >= pending.mBytes; } );
+		if( it != mFreeBuffers.end() ) {
+			pending.mBuffer = *it;
+			mFreeBuffers.erase( it );
+		}
+		else {
+			pending.mBuffer = gl::BufferObj::create( GL_COPY_WRITE_BUFFER, bytes, nullptr, GL_STREAM_READ );
+		}
+		destination = pending.mBuffer->getId();
+	}
+
+	// buffers written by a compute shader need to be visible to the copy
+	gl::memoryBarrier( GL_BUFFER_UPDATE_BARRIER_BIT );
+	{
+		gl::ScopedBuffer scopedRead( GL_COPY_READ_BUFFER, buffer->getSsbo()->getId() );
+		gl::ScopedBuffer scopedWrite( GL_COPY_WRITE_BUFFER, destination );
+		glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, buffer->getRegionOffset() + offset, (GLintptr) pending.mRingOffset, bytes );
+	}
+	pending.mFence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	mPending.push_back( pending );
+}
+
+std::future<std::vector<uint8_t>> ComputeReadback::read( const ComputeBufferRef &buffer, GLintptr offset, GLsizeiptr bytes )
+{
+	auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+	auto future = promise->get_future();
+	queueRead( buffer, [promise]( const Data &data ) {
+		auto begin = data.getData<uint8_t>();
+		promise->set_value( std::vector<uint8_t>( begin, begin + data.getBytes() ) );
+	}, [promise]( const std::string &reason ) {
+		promise->set_exception( std::make_exception_ptr( std::runtime_error( "ComputeReadback: " + reason ) ) );
+	}, offset, bytes );
+	return future;
+}
+
+size_t ComputeReadback::update( bool wait )
+{
+	++mFrame;
+	size_t numDelivered = 0;
+	while( ! mPending.empty() ) {
+		auto &pending = mPending.front();
+		if( ! wait && mFrame - pending.mFrame < (uint64_t) mLatency ) {
+			break;
+		}
+
+		// the fences complete in order, the first one still pending blocks the following ones
+		GLenum status = glClientWaitSync( pending.mFence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? GL_TIMEOUT_IGNORED : 0 );
+		if( status == GL_TIMEOUT_EXPIRED ) {
+			break;
+		}
+		glDeleteSync( pending.mFence );
+
+		Data data;
+		data.mBytes		= pending.mBytes;
+		data.mLatency	= (int) ( mFrame - pending.mFrame );
+		if( status == GL_WAIT_FAILED ) {
+			CI_LOG_W( "ComputeReadback: Waiting on the readback fence failed, dropping the read" );
+			if( pending.mDropFn ) {
+				pending.mDropFn( "waiting on the readback fence failed" );
+			}
+		}
+		else if( ! pending.mBuffer ) {
+			// the ring is coherent, the data is visible once the fence is signaled
+			data.mData = mRingMapped + pending.mRingOffset;
+			if( pending.mReadbackFn ) {
+				pending.mReadbackFn( data );
+			}
+			++numDelivered;
+		}
+		else if( auto mapped = pending.mBuffer->mapBufferRange( 0, pending.mBytes, GL_MAP_READ_BIT ) ) {
+			data.mData = mapped;
+			if( pending.mReadbackFn ) {
+				pending.mReadbackFn( data );
+			}
+			pending.mBuffer->unmap();
+			++numDelivered;
+		}
+		else {
+			CI_LOG_W( "ComputeReadback: Mapping the staging buffer failed, dropping the read" );
+			if( pending.mDropFn ) {
+				pending.mDropFn( "mapping the staging buffer failed" );
+			}
+		}
+
+		if( pending.mBuffer ) {
+			mFreeBuffers.push_back( pending.mBuffer );
+		}
+		else {
+			mRingUsed -= pending.mRingBytes;
+		}
+		mPending.pop_front();
+	}
+	return numDelivered;
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
 ScopedComputeBuffer::ScopedComputeBuffer( const ComputeBufferRef &bufferObj, uint8_t bufferUnit )
 	: mCtx( gl::context() )
 	, mSsbo{ bufferObj->getSsbo() }
 {
-	mSsbo->bindBase( static_cast<GLuint>( bufferUnit ) );
+	bufferObj->bindBase( static_cast<GLuint>( bufferUnit ) );
 	mCtx->pushBufferBinding( mSsbo->getTarget(), mSsbo->getId() );
 }
 
@@ -2,46 +2,452 @@
 
 #include "cinder/gl/gl.h"
 
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 using namespace ci;
 
 typedef std::shared_ptr<class ComputeShader> ComputeShaderRef;
+typedef std::shared_ptr<class ComputeBuffer> ComputeBufferRef;
+typedef std::shared_ptr<class DispatchArgs> DispatchArgsRef;
 class ComputeShader {
 public:
+	//! Creates a shader from the asset at \a path through the AssetManager shader pipeline: #include directives are resolved by the shader preprocessor,
+	//! WG_SIZE_X/Y/Z are passed as defines and the program is rebuilt when the source or any of its includes changes.
+	static ComputeShaderRef		create( const ci::fs::path &path, ivec3 workGroupSize = ivec3( 128, 1, 1 ) );
+	//! Creates a shader from \a dataSource. The source is compiled as is, without include support, and only reloaded when the file itself changes.
 	static ComputeShaderRef		create( const ci::DataSourceRef& dataSource, ivec3 workGroupSize = ivec3( 128, 1, 1 ) );
 	virtual						~ComputeShader() {}
 
+	//! Binds the inputs, sets the uniforms and dispatches a representative workload with \a shader, ie. with shader->calcNumGroups().
+	using TuneFn = std::function<void( const ComputeShaderRef &shader )>;
+	//! Returns the variant of the asset at \a path compiled with the fastest of the \a candidates work group sizes on this device, 32 to 1024 x 1 x 1 if empty.
+	//! Each candidate is timed on \a tuneFn with GPU queries, the winner is persisted per device and returned directly by the next calls, even in later runs.
+	static ComputeShaderRef		createTuned( const ci::fs::path &path, const TuneFn &tuneFn, const std::vector<ivec3> &candidates = std::vector<ivec3>(), int numIterations = 5 );
+	//! Sets the file the tuned work group sizes are persisted to. Default to compute_tuning.txt next to the application.
+	static void					setTuningCachePath( const ci::fs::path &path );
+
 	const ivec3&				getWorkGroupSize() const { return mWorkGroupSize; }
+	//! Returns the last program that compiled successfully, null until the first successful compile. A failed reload keeps the previous program.
 	gl::GlslProgRef&			getGlsl() { return mUpdateProg; }
 	const gl::GlslProgRef&		getGlsl() const { return mUpdateProg; }
 
+	//! Dispatches \a threadGroups work groups. Does nothing if the shader never compiled.
 	void dispatch( int threadGroupsX, int threadGroupsY, int threadGroupsZ );
+	//! Dispatches enough work groups to cover \a numElements invocations. Shaders should discard the invocations past the end.
+	void dispatchElements( int numElementsX, int numElementsY = 1, int numElementsZ = 1 );
+	//! Returns the number of work groups covering \a numElements invocations.
+	ivec3 calcNumGroups( const ivec3 &numElements ) const;
+	//! Dispatches the work group counts stored as three uints at \a offset bytes in \a args, ie. written by a previous pass. The counts never come back to the CPU.
+	void dispatchIndirect( const ComputeBufferRef &args, GLintptr offset = 0 );
+	//! Dispatches the work group counts of the dispatch \a index of \a args.
+	void dispatchIndirect( const DispatchArgsRef &args, int index = 0 );
 protected:
+	ComputeShader( const ci::fs::path &path, ivec3 workGroupSize );
 	ComputeShader( const ci::DataSourceRef& dataSource, ivec3 workGroupSize );
 
+	gl::GlslProg::Format		getFormat() const;
+
 	const ivec3					mWorkGroupSize;
 
 	signals::ScopedConnection	mConnGlsl;
 	gl::GlslProgRef				mUpdateProg;
 };
 
-typedef std::shared_ptr<class ComputeBuffer> ComputeBufferRef;
 class ComputeBuffer {
 public:
-	static ComputeBufferRef		create( const void * data, int size, int blockSize );
-	virtual						~ComputeBuffer() {}
+	//! Returns a buffer of \a size blocks initialized with \a data. \a usage is the hint passed to glBufferData, GL_DYNAMIC_COPY suits scratch buffers rewritten by every pass.
+	static ComputeBufferRef		create( const void * data, int size, int blockSize, GLenum usage = GL_STATIC_DRAW );
+	//! Returns a buffer of \a size blocks streamed from the CPU every frame. The storage is allocated once with glBufferStorage and persistently mapped,
+	//! and split in \a numRegions regions so that the CPU writes one while the GPU still reads the previous ones.
+	static ComputeBufferRef		createStreaming( int size, int blockSize, int numRegions = 3 );
+	virtual						~ComputeBuffer();
 	//void clear( const void * data, int size, int blockSize);
 
 	gl::SsboRef&				getSsbo() { return mSsbo; }
 	const gl::SsboRef&			getSsbo() const { return mSsbo; }
 
 	int							getSize() const { return mSize; }
+	int							getBlockSize() const { return mBlockSize; }
+
+	//! Returns whether the buffer was created with createStreaming().
+	bool						isStreaming() const { return ! mFences.empty(); }
+	//! Moves to the next region and returns its memory, waiting for the GPU only if it still reads it. Must be called once per frame before writing, after the commands reading the previous region are issued.
+	void*						map();
+	//! Ends the writes to the current region. Only unmaps when persistent mapping isn't supported.
+	void						unmap();
+	//! Copies \a size blocks of \a data to the next region.
+	void						update( const void * data, int size );
+	//! Returns the offset in bytes of the current region, 0 if the buffer isn't streaming.
+	GLintptr					getRegionOffset() const { return (GLintptr) mRegion * mRegionBytes; }
+	//! Binds the buffer, or the current region of a streaming buffer, to the shader storage binding point \a bufferUnit.
+	void						bindBase( GLuint bufferUnit );
 protected:
-	ComputeBuffer( const void * data, int size, int blockSize );
+	ComputeBuffer( const void * data, int size, int blockSize, GLenum usage = GL_STATIC_DRAW );
+	ComputeBuffer( int size, int blockSize, int numRegions );
 
 	gl::SsboRef					mSsbo;
+	int							mSize, mBlockSize;
+
+	// streaming
+	std::vector<GLsync>			mFences;
+	int							mRegion;
+	GLsizeiptr					mRegionBytes;
+	uint8_t*					mMapped;
+	bool						mIsPersistent;
+};
+
+
+//! Untyped part of TypedComputeBuffer: the declared fields, the GPU buffers and the validation against the program interface.
+class TypedComputeBufferBase {
+public:
+	//! Array of structures in a single buffer, or structure of arrays with one buffer per field so that invocations read contiguous elements.
+	enum class Layout { AOS, SOA };
+	//! A member of the C++ structure, matched by name with the std430 block members.
+	struct Field {
+		std::string	mName;
+		size_t		mOffset, mSize, mAlignment;
+
+		//! Returns the std430 stride of an array of the member, its size rounded up to its alignment. The element stride of the SoA buffers.
+		size_t		getArrayStride() const { return ( mSize + mAlignment - 1 ) / mAlignment * mAlignment; }
+	};
+
+	virtual						~TypedComputeBufferBase() {}
+
+	int							getSize() const { return mSize; }
+	Layout						getLayout() const { return mLayout; }
+	const std::vector<Field>&	getFields() const { return mFields; }
+	//! Returns the size of an element of the C++ structure.
+	size_t						getStride() const { return mStride; }
+	//! Returns the bytes of each element not covered by the declared fields, transferred for nothing in the AoS layout.
+	size_t						getPadding() const;
+
+	//! Returns the number of buffers, 1 for the AoS layout and the number of fields for the SoA layout.
+	size_t						getNumBuffers() const { return mBuffers.size(); }
+	//! Returns the buffer of the whole array, or of the field \a index for the SoA layout.
+	const ComputeBufferRef&		getBuffer( size_t index = 0 ) const { return mBuffers[index]; }
+	//! Binds the buffer to \a unit, or the buffer of each field to consecutive units from \a unit for the SoA layout.
+	void						bindBase( GLuint unit );
+
+	//! Checks the layout against the shader storage blocks of \a shader bound to the same units, ie. declared with layout( std430, binding = unit ).
+	//! The array stride must match the element size, and the offsets of the block members the offsets of the fields with the same name. Logs every mismatch.
+	bool						validate( const ComputeShaderRef &shader, GLuint unit ) const;
+
+protected:
+	TypedComputeBufferBase( int size, size_t stride, Layout layout, const std::vector<Field> &fields, const void *data );
+
+	void						uploadBytes( const void *data, int size );
+	void						downloadBytes( void *data ) const;
+
 	int							mSize;
+	size_t						mStride;
+	Layout						mLayout;
+	std::vector<Field>			mFields;
+	std::vector<ComputeBufferRef>	mBuffers;
+};
+
+//! std430 base alignment of a member of type \a M, derived from the type. Scalars are aligned to their size, vectors of 2 components to twice their scalar
+//! and of 3 or 4 components to four times. Arrays are aligned as their elements and matrices as their columns.
+template<typename M, typename Enable = void>
+struct Std430Alignment {
+	static_assert( std::is_arithmetic<M>::value && sizeof( M ) == 4, "std430 scalars are 4 bytes" );
+	static const size_t value = sizeof( M );
+};
+template<typename M, typename Enable = void>
+struct Std430HasColumns : std::false_type {};
+template<typename M>
+struct Std430HasColumns<M, decltype( void( sizeof( typename M::col_type ) ) )> : std::true_type {};
+template<typename M, size_t N>
+struct Std430Alignment<M[N]> {
+	static const size_t value = Std430Alignment<M>::value;
+	static_assert( sizeof( M ) % value == 0, "std430 arrays are strided by their element size rounded up to its alignment, the elements need padding" );
+};
+// glm vectors, made of value_type scalars
+template<typename M>
+struct Std430Alignment<M, typename std::enable_if<std::is_class<M>::value && ! Std430HasColumns<M>::value>::type> {
+	static const size_t components = sizeof( M ) / sizeof( typename M::value_type );
+	static_assert( components >= 2 && components <= 4, "std430 vectors have 2 to 4 components" );
+	static const size_t value = ( components == 2 ? 2 : 4 ) * Std430Alignment<typename M::value_type>::value;
+};
+// glm matrices, made of col_type columns
+template<typename M>
+struct Std430Alignment<M, typename std::enable_if<Std430HasColumns<M>::value>::type> {
+	static const size_t value = Std430Alignment<typename M::col_type>::value;
+	static_assert( sizeof( typename M::col_type ) % value == 0, "std430 matrix columns of 3 components are padded to 16 bytes, glm 3 rows matrices don't match" );
+};
+
+//! ComputeBuffer of elements of type \a T, laid out to match a std430 block. \a T is checked at compile time, the declared fields at creation
+//! against the std430 alignment rules, and validate() compares them with the program interface of a shader.
+// Members are made of 4 bytes scalars and aligned as Std430Alignment. A glm::vec3 must be followed by a scalar or padding in the AoS layout,
+// and the SoA buffer of a field is strided by its size rounded up to its alignment, 16 bytes for a glm::vec3.
+template<typename T>
+class TypedComputeBuffer : public TypedComputeBufferBase {
+	static_assert( std::is_trivially_copyable<T>::value, "TypedComputeBuffer elements are copied as bytes" );
+	static_assert( sizeof( T ) % 4 == 0, "std430 members are made of 4 bytes scalars" );
+	static_assert( alignof( T ) <= 16, "std430 members are aligned to 16 bytes at most" );
+public:
+	class Format {
+	public:
+		Format() : mLayout( Layout::AOS ) {}
+
+		//! Sets the layout of the GPU buffers. Default to Layout::AOS.
+		Format& layout( Layout layout ) { mLayout = layout; return *this; }
+		//! Declares the member \a member of \a T as the block member \a name. Required for the SoA layout, and to check the offsets of the AoS layout.
+		template<typename M>
+		Format& field( const std::string &name, M T::*member )
+		{
+			static_assert( std::is_trivially_copyable<M>::value, "Fields are copied as bytes" );
+			static_assert( sizeof( M ) % 4 == 0, "std430 members are made of 4 bytes scalars" );
+			typename std::aligned_storage<sizeof( T ), alignof( T )>::type storage;
+			const T *element = reinterpret_cast<const T*>( &storage );
+			size_t offset = (size_t) ( reinterpret_cast<const char*>( &( element->*member ) ) - reinterpret_cast<const char*>( element ) );
+			mFields.push_back( Field{ name, offset, sizeof( M ), Std430Alignment<M>::value } );
+			return *this;
+		}
+
+		Layout						getLayout() const { return mLayout; }
+		const std::vector<Field>&	getFields() const { return mFields; }
+
+	protected:
+		Layout				mLayout;
+		std::vector<Field>	mFields;
+	};
+
+	//! Creates a buffer of \a size elements, initialized from \a data if not null.
+	static std::shared_ptr<TypedComputeBuffer> create( int size, const Format &format = Format(), const T *data = nullptr )
+	{
+		return std::shared_ptr<TypedComputeBuffer>( new TypedComputeBuffer( size, format, data ) );
+	}
+
+	//! Copies \a size elements of \a data to the GPU, scattering the fields to their buffers for the SoA layout.
+	void						upload( const T *data, int size ) { uploadBytes( data, size ); }
+	void						upload( const std::vector<T> &data ) { uploadBytes( data.data(), (int) data.size() ); }
+	//! Copies the GPU data to \a data. Blocks until the GPU is done writing it, see ComputeReadback for reads that don't stall.
+	void						download( std::vector<T> *data ) const { data->resize( mSize ); downloadBytes( data->data() ); }
+
+protected:
+	TypedComputeBuffer( int size, const Format &format, const T *data )
+		: TypedComputeBufferBase( size, sizeof( T ), format.getLayout(), format.getFields(), data )
+	{
+	}
+};
+template<typename T> using TypedComputeBufferRef = std::shared_ptr<TypedComputeBuffer<T>>;
+
+
+//! Arguments of indirect dispatches stored on the GPU, three uints per dispatch.
+// write() converts an element count computed by a previous pass, ie. the counter of a stream compaction, into the number of work groups
+// of the next pass, so variable-sized workloads are chained without any CPU readback.
+class DispatchArgs {
+public:
+	static DispatchArgsRef		create( int numDispatches = 1 );
+
+	const ComputeBufferRef&		getBuffer() const { return mBuffer; }
+	int							getNumDispatches() const { return mBuffer->getSize(); }
+	//! Returns the offset in bytes of the dispatch \a index.
+	static GLintptr				getOffset( int index ) { return (GLintptr) index * 3 * sizeof( GLuint ); }
+
+	//! Sets the work group counts of the dispatch \a index from the CPU.
+	void						set( int index, const ivec3 &numGroups );
+	//! Writes the dispatch \a index covering the element count stored at \a countIndex in \a counts, with \a groupSize invocations per work group. Issues the barrier needed by the indirect dispatch.
+	void						write( int index, const ComputeBufferRef &counts, GLuint countIndex, int groupSize );
+	//! Writes the dispatch \a index covering the element count stored at \a countIndex in \a counts with the work groups of \a shader.
+	void						write( int index, const ComputeBufferRef &counts, GLuint countIndex, const ComputeShaderRef &shader ) { write( index, counts, countIndex, shader->getWorkGroupSize().x ); }
+
+	//! Returns the program converting element counts into work group counts. Counts are bound to unit 0, the arguments to unit 1.
+	static ComputeShaderRef		getWriterShader();
+	//! Sets the writer uniforms of the dispatch \a index.
+	void						setWriterUniforms( const gl::GlslProgRef &glsl, int index, GLuint countIndex, int groupSize ) const;
+protected:
+	DispatchArgs( int numDispatches );
+
+	ComputeBufferRef			mBuffer;
+	ComputeShaderRef			mWriterShader;
+	GLuint						mMaxGroups;
+};
+
+//! Records dispatches with their buffer bindings and submits them with only the barriers they need.
+// Each dispatch declares the buffers it reads and writes. A shader storage barrier is only issued before a dispatch accessing a buffer
+// written since the last barrier, or writing a buffer read since the last barrier. Independent dispatches run back to back.
+typedef std::shared_ptr<class ComputeCommandList> ComputeCommandListRef;
+class ComputeCommandList {
+public:
+	//! A buffer bound to a shader storage binding point.
+	struct Binding {
+		Binding( const ComputeBufferRef &buffer, GLuint unit ) : mBuffer( buffer ), mUnit( unit ) {}
+		ComputeBufferRef	mBuffer;
+		GLuint				mUnit;
+	};
+	using UniformsFn = std::function<void( const gl::GlslProgRef &glsl )>;
+
+	static ComputeCommandListRef	create();
+
+	//! Records a dispatch of \a shader covering \a numElements invocations. \a uniformsFn is called with the bound program when the list is submitted.
+	ComputeCommandList&				dispatch( const ComputeShaderRef &shader, const ivec3 &numElements, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn = nullptr );
+	//! Records a dispatch of \a numGroups work groups.
+	ComputeCommandList&				dispatchGroups( const ComputeShaderRef &shader, const ivec3 &numGroups, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn = nullptr );
+	//! Records an indirect dispatch reading its work group counts from the dispatch \a index of \a args. A command barrier is issued if the arguments were written by a previous dispatch of the list.
+	ComputeCommandList&				dispatchIndirect( const ComputeShaderRef &shader, const DispatchArgsRef &args, int index, const std::vector<Binding> &reads, const std::vector<Binding> &writes, const UniformsFn &uniformsFn = nullptr );
+	//! Records the conversion of the element count stored at \a countIndex in \a counts into the dispatch \a index of \a args, with \a groupSize invocations per work group.
+	ComputeCommandList&				writeDispatchArgs( const DispatchArgsRef &args, int index, const ComputeBufferRef &counts, GLuint countIndex, int groupSize );
+	//! Issues the recorded dispatches. \a finalBarriers are issued after the last one if any buffer was written, 0 leaves the synchronization to the caller. The list can be submitted again.
+	void							submit( GLbitfield finalBarriers = GL_SHADER_STORAGE_BARRIER_BIT );
+	//! Removes the recorded dispatches.
+	void							clear() { mCommands.clear(); }
+
+	//! Returns the number of recorded dispatches.
+	size_t							getNumCommands() const { return mCommands.size(); }
+	//! Returns the number of barriers issued by the last submit.
+	size_t							getNumBarriers() const { return mNumBarriers; }
+protected:
+	ComputeCommandList();
+
+	struct Command {
+		ComputeShaderRef		mShader;
+		ivec3					mNumGroups;
+		std::vector<Binding>	mReads, mWrites;
+		UniformsFn				mUniformsFn;
+		ComputeBufferRef		mArgs; // indirect dispatches only
+		GLintptr				mArgsOffset;
+	};
+
+	std::vector<Command>			mCommands;
+	size_t							mNumBarriers;
+};
+
+//! Pair of buffers for iterative passes reading the previous state and writing the next one.
+// The front buffer holds the latest data and is bound to the read unit, the back buffer to the write unit. swap() only exchanges the roles,
+// no data is copied. step() runs a batch of substeps with a single program bind and one shader storage barrier between substeps.
+typedef std::shared_ptr<class ComputeBufferPair> ComputeBufferPairRef;
+class ComputeBufferPair {
+public:
+	//! Called before each substep with the bound program and the substep index.
+	using UniformsFn = std::function<void( const gl::GlslProgRef &glsl, int step )>;
+
+	//! Creates two buffers of \a size blocks, \a data initializes the front one. Substeps read the front buffer at \a readUnit and write the back one at \a writeUnit.
+	static ComputeBufferPairRef	create( const void * data, int size, int blockSize, GLuint readUnit = 0, GLuint writeUnit = 1 );
+
+	//! Returns the buffer holding the latest data.
+	const ComputeBufferRef&		getFront() const { return mBuffers[mFront]; }
+	//! Returns the buffer written by the next substep.
+	const ComputeBufferRef&		getBack() const { return mBuffers[mFront ^ 1]; }
+	//! Returns the index, 0 or 1, of the buffer holding the latest data.
+	int							getFrontIndex() const { return mFront; }
+	GLuint						getReadUnit() const { return mReadUnit; }
+	GLuint						getWriteUnit() const { return mWriteUnit; }
+	//! Returns the bindings of the front buffer to the read unit and of the back buffer to the write unit, to record a substep in a ComputeCommandList.
+	ComputeCommandList::Binding	getReadBinding() const { return ComputeCommandList::Binding( getFront(), mReadUnit ); }
+	ComputeCommandList::Binding	getWriteBinding() const { return ComputeCommandList::Binding( getBack(), mWriteUnit ); }
+
+	//! Makes the back buffer the front one, once a pass wrote it.
+	void						swap() { mFront ^= 1; }
+	//! Binds the front buffer to the read unit and the back buffer to the write unit.
+	void						bind();
+
+	//! Runs \a numSteps dispatches of \a numGroups work groups of \a shader, swapping the buffers after each one, so the front buffer holds the result of the last substep.
+	//! The buffers bound to other units stay bound for the whole batch. \a finalBarriers are issued after the last substep, 0 leaves the synchronization to the caller.
+	void						step( const ComputeShaderRef &shader, const ivec3 &numGroups, int numSteps = 1, const UniformsFn &uniformsFn = nullptr, GLbitfield finalBarriers = GL_SHADER_STORAGE_BARRIER_BIT );
+	//! Runs \a numSteps dispatches covering \a numElements invocations.
+	void						stepElements( const ComputeShaderRef &shader, const ivec3 &numElements, int numSteps = 1, const UniformsFn &uniformsFn = nullptr, GLbitfield finalBarriers = GL_SHADER_STORAGE_BARRIER_BIT );
+protected:
+	ComputeBufferPair( const void * data, int size, int blockSize, GLuint readUnit, GLuint writeUnit );
+
+	ComputeBufferRef			mBuffers[2];
+	int							mFront;
+	GLuint						mReadUnit, mWriteUnit;
 };
 
+//! Reads ComputeBuffer ranges back to the CPU without stalling the pipeline.
+// Each read queues the copy of the range into a staging buffer followed by a fence. update() is called once per frame, polls the fences
+// and hands the mapped data to the callbacks once the GPU is done. Staging buffers are recycled between reads, or taken from a persistently
+// mapped ring so that nothing is allocated or mapped in steady state.
+typedef std::shared_ptr<class ComputeReadback> ComputeReadbackRef;
+class ComputeReadback {
+public:
+	class Format {
+	public:
+		Format() : mLatency( 0 ), mRingBytes( 0 ) {}
+
+		//! Sets the minimum number of update() calls between a read and its delivery, so that results arrive at a fixed frame. Default to 0, delivered as soon as the GPU is done.
+		Format& latency( int numFrames ) { mLatency = numFrames; return *this; }
+		//! Sets the size in bytes of a persistently mapped ring the reads are copied to. Reads that don't fit use staging buffers. Default to 0, no ring.
+		Format& ringSize( size_t bytes ) { mRingBytes = bytes; return *this; }
+
+		int		getLatency() const { return mLatency; }
+		size_t	getRingSize() const { return mRingBytes; }
+
+	protected:
+		int		mLatency;
+		size_t	mRingBytes;
+	};
+
+	//! Mapped data of a completed read. Only valid during the callback.
+	class Data {
+	public:
+		size_t						getBytes() const { return mBytes; }
+		const void*					getData() const { return mData; }
+		template<typename T> const T* getData() const { return reinterpret_cast<const T*>( mData ); }
+		//! Returns the number of update() calls between the read and its delivery.
+		int							getLatency() const { return mLatency; }
+
+	protected:
+		size_t						mBytes;
+		const void*					mData;
+		int							mLatency;
+		friend class ComputeReadback;
+	};
+
+	//! Called from update() with the data of a completed read.
+	using ReadbackFn = std::function<void( const Data &data )>;
+
+	static ComputeReadbackRef	create( const Format &format = Format() );
+	~ComputeReadback();
+
+	//! Queues the copy of \a bytes bytes at \a offset in \a buffer, up to the end of the buffer if 0. \a readbackFn is called by a later update().
+	//! Reads the current region of streaming buffers. Writes of previous dispatches are made visible to the copy.
+	void						read( const ComputeBufferRef &buffer, const ReadbackFn &readbackFn, GLintptr offset = 0, GLsizeiptr bytes = 0 );
+	//! Queues a read whose copy of the data is returned through a future, ready after the update() delivering it. Waiting on the future never calls update().
+	//! A dropped read, out of range, failed fence or map, or pending when the ComputeReadback is destroyed, stores a std::runtime_error explaining why.
+	std::future<std::vector<uint8_t>>	read( const ComputeBufferRef &buffer, GLintptr offset = 0, GLsizeiptr bytes = 0 );
+
+	//! Delivers the completed reads in the order they were queued. Never blocks unless \a wait is true, in which case every pending read is delivered regardless of the latency. Returns the number of reads delivered.
+	size_t						update( bool wait = false );
+	//! Returns the number of reads still in flight.
+	size_t						getNumPending() const { return mPending.size(); }
+	//! Returns whether the persistently mapped ring is available.
+	bool						hasRing() const { return mRingMapped != nullptr; }
+protected:
+	ComputeReadback( const Format &format );
+
+	//! Called instead of the ReadbackFn when a read is dropped.
+	using DropFn = std::function<void( const std::string &reason )>;
+
+	struct Pending {
+		gl::BufferObjRef		mBuffer;		// staging buffer, null for reads in the ring
+		size_t					mRingOffset, mRingBytes;
+		size_t					mBytes;
+		GLsync					mFence;
+		uint64_t				mFrame;
+		ReadbackFn				mReadbackFn;
+		DropFn					mDropFn;
+	};
+
+	void						queueRead( const ComputeBufferRef &buffer, const ReadbackFn &readbackFn, const DropFn &dropFn, GLintptr offset, GLsizeiptr bytes );
+	bool						allocateRing( size_t bytes, Pending *pending );
+
+	int							mLatency;
+	uint64_t					mFrame;
+	std::deque<Pending>			mPending;
+	std::vector<gl::BufferObjRef>	mFreeBuffers;
+
+	// persistently mapped ring, used as a FIFO since reads complete in order
+	gl::BufferObjRef			mRing;
+	const uint8_t*				mRingMapped;
+	size_t						mRingSize, mRingHead, mRingUsed;
+};
 
 struct ScopedComputeBuffer : public Noncopyable {
 	ScopedComputeBuffer( const ComputeBufferRef &bufferObj, uint8_t bufferUnit = 0 );
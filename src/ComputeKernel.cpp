@@ -0,0 +1,211 @@
+#include "ComputeKernel.h"
+
+#include "cinder/Log.h"
+#include "cinder/app/App.h"
+#include "cinder/gl/scoped.h"
+#include "WorkStealingPool.h"
+
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <map>
+
+using namespace std;
+
+namespace {
+	const size_t sAlignment = 64;
+
+	class GpuExecutor : public ComputeExecutor {
+	public:
+		void dispatch( const ComputeKernel &kernel, const ivec3 &numGroups, const ComputeKernel::Buffers &buffers ) override
+		{
+			auto shader = acquireShader( kernel );
+			if( ! shader || ! shader->getGlsl() ) {
+				CI_LOG_W( "ComputeExecutor: No GLSL program for " << kernel.getShaderPath() );
+				return;
+			}
+
+			const auto &glsl = shader->getGlsl();
+			gl::ScopedGlslProg scopedGlsl( glsl );
+			kernel.setUniforms( glsl );
+			for( size_t unit = 0; unit < buffers.size(); ++unit ) {
+				if( buffers[unit] ) {
+					buffers[unit]->getComputeBuffer()->bindBase( (GLuint) unit );
+				}
+			}
+			gl::dispatchCompute( numGroups.x, numGroups.y, numGroups.z );
+			gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT );
+		}
+		bool isGpu() const override { return true; }
+
+	protected:
+		ComputeShaderRef acquireShader( const ComputeKernel &kernel )
+		{
+			ivec3 size	= kernel.getWorkGroupSize();
+			auto key	= make_tuple( kernel.getShaderPath().string(), size.x, size.y, size.z );
+			auto it		= mShaders.find( key );
+			if( it != mShaders.end() ) {
+				return it->second;
+			}
+
+			ComputeShaderRef shader;
+			if( ! kernel.getShaderPath().empty() ) {
+				try {
+					shader = ComputeShader::create( kernel.getShaderPath(), size );
+				}
+				catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+			}
+			mShaders[key] = shader;
+			return shader;
+		}
+
+		map<tuple<string, int, int, int>, ComputeShaderRef> mShaders;
+	};
+
+	class CpuExecutor : public ComputeExecutor {
+	public:
+		CpuExecutor( int numThreads )
+			: mPool( WorkStealingPool::create( numThreads ) )
+		{
+		}
+
+		void dispatch( const ComputeKernel &kernel, const ivec3 &numGroups, const ComputeKernel::Buffers &buffers ) override
+		{
+			// not profiled, the profiler belongs to the GL thread and dispatch can be called from any thread
+			uvec3 groups = uvec3( glm::max( numGroups, ivec3( 0 ) ) );
+			uint32_t count = groups.x * groups.y * groups.z;
+			// a few ranges per thread leave room for stealing without making the queues contended
+			uint32_t grain = std::max<uint32_t>( 1, count / ( (uint32_t) mPool->getNumThreads() * 8 ) );
+			mPool->run( count, grain, [&]( uint32_t first, uint32_t last ) {
+				for( uint32_t group = first; group < last; ++group ) {
+					kernel.executeWorkGroup( uvec3( group % groups.x, ( group / groups.x ) % groups.y, group / ( groups.x * groups.y ) ), buffers );
+				}
+			} );
+		}
+		bool isGpu() const override { return false; }
+
+	protected:
+		WorkStealingPoolRef mPool;
+	};
+}
+
+void ComputeKernel::executeWorkGroup( const uvec3 &workGroupId, const Buffers &buffers ) const
+{
+	uvec3 size = uvec3( getWorkGroupSize() );
+	Invocation invocation;
+	invocation.mWorkGroupId	= workGroupId;
+	invocation.mLocalIndex	= 0;
+	for( uint32_t z = 0; z < size.z; ++z ) {
+		for( uint32_t y = 0; y < size.y; ++y ) {
+			for( uint32_t x = 0; x < size.x; ++x ) {
+				invocation.mLocalId		= uvec3( x, y, z );
+				invocation.mGlobalId	= workGroupId * size + invocation.mLocalId;
+				execute( invocation, buffers );
+				++invocation.mLocalIndex;
+			}
+		}
+	}
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+KernelBufferRef KernelBuffer::create( size_t size, size_t blockSize, const void *data )
+{
+	return KernelBufferRef( new KernelBuffer( size, blockSize, data ) );
+}
+
+KernelBuffer::KernelBuffer( size_t size, size_t blockSize, const void *data )
+	: mSize{ size }, mBlockSize{ blockSize }, mStorage( size * blockSize + sAlignment, 0 )
+{
+	mData = mStorage.data() + ( sAlignment - reinterpret_cast<uintptr_t>( mStorage.data() ) % sAlignment ) % sAlignment;
+	if( data ) {
+		memcpy( mData, data, getBytes() );
+	}
+}
+
+const ComputeBufferRef& KernelBuffer::getComputeBuffer()
+{
+	if( ! mComputeBuffer ) {
+		mComputeBuffer = ComputeBuffer::create( mData, (int) mSize, (int) mBlockSize );
+	}
+	return mComputeBuffer;
+}
+
+void KernelBuffer::upload()
+{
+	getComputeBuffer()->getSsbo()->bufferSubData( 0, getBytes(), mData );
+}
+
+void KernelBuffer::download()
+{
+	download( mData );
+}
+
+void KernelBuffer::download( void *data ) const
+{
+	if( ! mComputeBuffer ) {
+		CI_LOG_W( "KernelBuffer: Nothing to download, the buffer was never used on the GPU" );
+		return;
+	}
+	gl::ScopedBuffer scopedBuffer( mComputeBuffer->getSsbo() );
+	glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, getBytes(), data );
+}
+
+///////////////////////////////
+// ----------------
+///////////////////////////////
+
+ComputeExecutorRef ComputeExecutor::createGpu()
+{
+	return make_shared<GpuExecutor>();
+}
+
+ComputeExecutorRef ComputeExecutor::createCpu( int numThreads )
+{
+	return make_shared<CpuExecutor>( numThreads );
+}
+
+void ComputeExecutor::dispatchElements( const ComputeKernel &kernel, const ivec3 &numElements, const ComputeKernel::Buffers &buffers )
+{
+	ivec3 size = kernel.getWorkGroupSize();
+	dispatch( kernel, ( glm::max( numElements, ivec3( 0 ) ) + size - ivec3( 1 ) ) / size, buffers );
+}
+
+bool ComputeExecutor::verify( const ComputeKernel &kernel, const ivec3 &numGroups, const ComputeKernel::Buffers &buffers, const std::vector<GLuint> &outputs, float tolerance, int numThreads )
+{
+	// both backends start from the CPU data
+	for( const auto &buffer : buffers ) {
+		if( buffer ) {
+			buffer->upload();
+		}
+	}
+	createGpu()->dispatch( kernel, numGroups, buffers );
+	createCpu( numThreads )->dispatch( kernel, numGroups, buffers );
+
+	for( GLuint unit : outputs ) {
+		if( unit >= buffers.size() || ! buffers[unit] ) {
+			continue;
+		}
+		const auto &buffer = buffers[unit];
+		size_t numWords = buffer->getBytes() / sizeof( uint32_t );
+		vector<uint32_t> gpu( numWords );
+		buffer->download( gpu.data() );
+		const uint32_t *cpu = buffer->getData<uint32_t>();
+		for( size_t i = 0; i < numWords; ++i ) {
+			bool equal = cpu[i] == gpu[i];
+			if( ! equal && tolerance > 0.0f ) {
+				float a, b;
+				memcpy( &a, &cpu[i], sizeof( float ) );
+				memcpy( &b, &gpu[i], sizeof( float ) );
+				equal = std::abs( a - b ) <= tolerance * std::max( 1.0f, std::max( std::abs( a ), std::abs( b ) ) );
+			}
+			if( ! equal ) {
+				CI_LOG_W( "ComputeExecutor: Backends differ in buffer " << unit << " at word " << i << ", cpu " << cpu[i] << " gpu " << gpu[i] );
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Compute.h"
+
+#include <memory>
+#include <vector>
+
+//! Kernel written once against the work group and binding point model of ComputeShader, and run either as a GLSL dispatch or on the CPU.
+// The GLSL source implements the kernel on the GPU with the usual WG_SIZE_X/Y/Z defines and std430 buffers, execute() implements the same
+// invocation in C++, reading and writing the buffers bound to the same units. Kernels using shared memory and barriers override executeWorkGroup()
+// and run their phases one after the other over the whole work group, which is also the place to write loops the compiler can vectorize.
+typedef std::shared_ptr<class ComputeKernel> ComputeKernelRef;
+typedef std::shared_ptr<class KernelBuffer> KernelBufferRef;
+class ComputeKernel {
+public:
+	//! Built-in variables of an invocation, as gl_GlobalInvocationID, gl_LocalInvocationID, gl_WorkGroupID and gl_LocalInvocationIndex.
+	struct Invocation {
+		uvec3		mGlobalId, mLocalId, mWorkGroupId;
+		uint32_t	mLocalIndex;
+	};
+	//! Buffers indexed by binding point.
+	using Buffers = std::vector<KernelBufferRef>;
+
+	virtual						~ComputeKernel() {}
+
+	//! Returns the work group size, passed to the GLSL source as WG_SIZE_X/Y/Z.
+	virtual ivec3				getWorkGroupSize() const = 0;
+	//! Returns the asset path of the GLSL source, empty if the kernel only runs on the CPU.
+	virtual fs::path			getShaderPath() const { return fs::path(); }
+	//! Sets the uniforms of the GLSL program, the CPU implementation reads the same values from the kernel members.
+	virtual void				setUniforms( const gl::GlslProgRef &glsl ) const {}
+
+	//! Runs one invocation on the CPU. Invocations of a dispatch run concurrently and must only share data through the buffers.
+	virtual void				execute( const Invocation &invocation, const Buffers &buffers ) const = 0;
+	//! Runs a whole work group on the CPU. The default runs every invocation with x varying fastest.
+	virtual void				executeWorkGroup( const uvec3 &workGroupId, const Buffers &buffers ) const;
+};
+
+//! Buffer of blocks shared by both backends. The CPU storage is 64 bytes aligned, the GPU copy is created on first use and synchronized with upload() and download().
+// Structure of arrays layouts use one buffer per field, so that CPU kernels stream through contiguous, aligned arrays.
+class KernelBuffer {
+public:
+	static KernelBufferRef		create( size_t size, size_t blockSize, const void *data = nullptr );
+
+	void*						getData() { return mData; }
+	const void*					getData() const { return mData; }
+	template<typename T> T*		getData() { return reinterpret_cast<T*>( mData ); }
+	template<typename T> const T* getData() const { return reinterpret_cast<const T*>( mData ); }
+
+	size_t						getSize() const { return mSize; }
+	size_t						getBlockSize() const { return mBlockSize; }
+	size_t						getBytes() const { return mSize * mBlockSize; }
+
+	//! Returns the GPU copy of the buffer, created from the CPU data on first use.
+	const ComputeBufferRef&		getComputeBuffer();
+	//! Copies the CPU data to the GPU.
+	void						upload();
+	//! Copies the GPU data to the CPU. Blocks until the GPU is done writing it.
+	void						download();
+	//! Copies the GPU data to \a data without touching the CPU data.
+	void						download( void *data ) const;
+
+protected:
+	KernelBuffer( size_t size, size_t blockSize, const void *data );
+
+	size_t						mSize, mBlockSize;
+	std::vector<uint8_t>		mStorage;
+	uint8_t*					mData;
+	ComputeBufferRef			mComputeBuffer;
+};
+
+//! Runs kernels on one of the backends.
+typedef std::shared_ptr<class ComputeExecutor> ComputeExecutorRef;
+class ComputeExecutor {
+public:
+	//! Returns an executor running the GLSL source of the kernels. Requires a GL 4.3 context.
+	static ComputeExecutorRef	createGpu();
+	//! Returns an executor running the C++ implementation of the kernels on a work stealing pool of \a numThreads threads, 0 uses the number of hardware threads.
+	static ComputeExecutorRef	createCpu( int numThreads = 0 );
+	virtual						~ComputeExecutor() {}
+
+	//! Dispatches \a numGroups work groups of \a kernel with \a buffers bound to their index. Results are visible to the following dispatches.
+	virtual void				dispatch( const ComputeKernel &kernel, const ivec3 &numGroups, const ComputeKernel::Buffers &buffers ) = 0;
+	//! Dispatches enough work groups to cover \a numElements invocations.
+	void						dispatchElements( const ComputeKernel &kernel, const ivec3 &numElements, const ComputeKernel::Buffers &buffers );
+	//! Returns whether the executor runs on the GPU.
+	virtual bool				isGpu() const = 0;
+
+	//! Runs \a kernel on both backends from the same inputs and compares the buffers bound to \a outputs. Words are compared bit for bit,
+	//! or as floats within \a tolerance if it isn't 0. The CPU data of every buffer ends up holding the CPU results. Returns false and logs the first mismatch.
+	static bool					verify( const ComputeKernel &kernel, const ivec3 &numGroups, const ComputeKernel::Buffers &buffers, const std::vector<GLuint> &outputs, float tolerance = 0.0f, int numThreads = 0 );
+};
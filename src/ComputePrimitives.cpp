@@ -0,0 +1,367 @@
+#include "ComputePrimitives.h"
+
+#include "cinder/Log.h"
+#include "cinder/app/App.h"
+#include "cinder/gl/scoped.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+	// must match ITEMS_PER_THREAD in the shaders
+	const uint32_t sItemsPerThread	= 4;
+	const uint32_t sRadix			= 256;
+
+	// shared memory used by RadixScatter.comp, a bitmask of the work group per digit and the digit offsets. The largest of the primitives
+	uint32_t calcScatterSharedBytes( int workGroupSize )
+	{
+		return ( sRadix * (uint32_t) workGroupSize / 32 + sRadix ) * sizeof( uint32_t );
+	}
+
+	// programs shared by every instance with the same work group size
+	std::map<std::pair<std::string, int>, std::weak_ptr<ComputeShader>> sShaders;
+
+	ComputeShaderRef acquireShader( const std::string &name, int workGroupSize )
+	{
+		auto &shared = sShaders[make_pair( name, workGroupSize )];
+		auto shader = shared.lock();
+		if( ! shader ) {
+			try {
+				shader = ComputeShader::create( "glsl/compute/" + name + ".comp", ivec3( workGroupSize, 1, 1 ) );
+				shared = shader;
+			}
+			catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+		}
+		return shader;
+	}
+
+	bool isReady( const ComputeShaderRef &shader )
+	{
+		if( ! shader || ! shader->getGlsl() ) {
+			CI_LOG_W( "ComputePrimitives: Missing compute program" );
+			return false;
+		}
+		return true;
+	}
+
+	void dispatchGroups( uint32_t numGroups )
+	{
+		gl::dispatchCompute( std::max<uint32_t>( 1, numGroups ), 1, 1 );
+		gl::memoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+	}
+
+	void clearBuffer( const ComputeBufferRef &buffer, GLsizeiptr bytes )
+	{
+		gl::ScopedBuffer scopedBuffer( buffer->getSsbo() );
+		glClearBufferSubData( GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, bytes, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr );
+	}
+
+	vector<uint32_t> readBuffer( const ComputeBufferRef &buffer, uint32_t count )
+	{
+		vector<uint32_t> data( count );
+		gl::ScopedBuffer scopedBuffer( buffer->getSsbo() );
+		glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, count * sizeof( uint32_t ), data.data() );
+		return data;
+	}
+}
+
+ComputePrimitivesRef ComputePrimitives::create( int workGroupSize )
+{
+	return ComputePrimitivesRef( new ComputePrimitives( workGroupSize ) );
+}
+
+ComputePrimitives::ComputePrimitives( int workGroupSize )
+	: mWorkGroupSize{ workGroupSize }
+{
+	if( workGroupSize < 32 || ( workGroupSize & ( workGroupSize - 1 ) ) ) {
+		CI_LOG_W( "ComputePrimitives: The work group size must be a power of two of at least 32, using 256" );
+		mWorkGroupSize = 256;
+	}
+
+	// the minimum guaranteed 32KB of shared memory is exceeded by RadixScatter with 1024 invocations
+	GLint maxSharedBytes = 0, maxInvocations = 0;
+	glGetIntegerv( GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxSharedBytes );
+	glGetIntegerv( GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations );
+	int workGroupSizeLimit = mWorkGroupSize;
+	while( workGroupSizeLimit > 32 && ( workGroupSizeLimit > maxInvocations || calcScatterSharedBytes( workGroupSizeLimit ) > (uint32_t) maxSharedBytes ) ) {
+		workGroupSizeLimit /= 2;
+	}
+	if( workGroupSizeLimit != mWorkGroupSize ) {
+		CI_LOG_W( "ComputePrimitives: A work group size of " << mWorkGroupSize << " exceeds the compute limits, using " << workGroupSizeLimit );
+		mWorkGroupSize = workGroupSizeLimit;
+	}
+
+	mScanShader			= acquireShader( "Scan", mWorkGroupSize );
+	mReduceShader		= acquireShader( "Reduce", mWorkGroupSize );
+	mCompactShader		= acquireShader( "Compact", mWorkGroupSize );
+	mHistogramShader	= acquireShader( "RadixHistogram", mWorkGroupSize );
+	mScatterShader		= acquireShader( "RadixScatter", mWorkGroupSize );
+}
+
+uint32_t ComputePrimitives::getTileSize() const
+{
+	return (uint32_t) mWorkGroupSize * sItemsPerThread;
+}
+
+void ComputePrimitives::ensureBuffer( ComputeBufferRef &buffer, uint32_t size )
+{
+	if( ! buffer || (uint32_t) buffer->getSize() < size ) {
+		buffer = ComputeBuffer::create( nullptr, (int) std::max<uint32_t>( 1, size ), sizeof( uint32_t ), GL_DYNAMIC_COPY );
+	}
+}
+
+void ComputePrimitives::exclusiveScan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count )
+{
+	scan( input, output, count, false, false );
+}
+
+void ComputePrimitives::inclusiveScan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count )
+{
+	scan( input, output, count, true, false );
+}
+
+void ComputePrimitives::scan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count, bool inclusive, bool binarize )
+{
+	if( ! count || ! isReady( mScanShader ) ) {
+		return;
+	}
+
+	renderkit::ScopedGpuTimer scopedTimer( "ComputePrimitives::scan" );
+	uint32_t numTiles = ( count + getTileSize() - 1 ) / getTileSize();
+	ensureBuffer( mScanState, 1 + numTiles * 3 );
+	clearBuffer( mScanState, ( 1 + numTiles * 3 ) * sizeof( uint32_t ) );
+
+	const auto &glsl = mScanShader->getGlsl();
+	gl::ScopedGlslProg scopedGlsl( glsl );
+	glsl->uniform( "uCount", count );
+	glsl->uniform( "uInclusive", (int) inclusive );
+	glsl->uniform( "uBinarize", (int) binarize );
+	ScopedComputeBuffer scopedInput( input, 0 );
+	ScopedComputeBuffer scopedOutput( output, 1 );
+	ScopedComputeBuffer scopedState( mScanState, 2 );
+	dispatchGroups( numTiles );
+}
+
+void ComputePrimitives::reduce( const ComputeBufferRef &input, uint32_t count, ReduceOp op, ValueType type, const ComputeBufferRef &result, GLuint resultIndex )
+{
+	if( ! count || ! isReady( mReduceShader ) ) {
+		return;
+	}
+
+	renderkit::ScopedGpuTimer scopedTimer( "ComputePrimitives::reduce" );
+	const auto &glsl = mReduceShader->getGlsl();
+	gl::ScopedGlslProg scopedGlsl( glsl );
+	glsl->uniform( "uOp", (int) op );
+	glsl->uniform( "uType", (int) type );
+
+	// every pass reduces each tile to one value until a single tile remains, the partial results ping-pong between two buffers
+	ComputeBufferRef source = input;
+	for( int pass = 0; ; ++pass ) {
+		uint32_t numTiles	= ( count + getTileSize() - 1 ) / getTileSize();
+		bool isLast			= numTiles == 1;
+		ComputeBufferRef destination = result;
+		if( ! isLast ) {
+			ensureBuffer( mReduceBuffers[pass % 2], numTiles );
+			destination = mReduceBuffers[pass % 2];
+		}
+
+		glsl->uniform( "uCount", count );
+		glsl->uniform( "uOutputOffset", isLast ? resultIndex : 0u );
+		ScopedComputeBuffer scopedInput( source, 0 );
+		ScopedComputeBuffer scopedOutput( destination, 1 );
+		dispatchGroups( numTiles );
+
+		if( isLast ) {
+			break;
+		}
+		source	= destination;
+		count	= numTiles;
+	}
+}
+
+void ComputePrimitives::compact( const ComputeBufferRef &input, const ComputeBufferRef &flags, uint32_t count, const ComputeBufferRef &output, const ComputeBufferRef &counter, GLuint counterIndex )
+{
+	if( ! count || ! isReady( mCompactShader ) ) {
+		return;
+	}
+
+	renderkit::ScopedGpuTimer scopedTimer( "ComputePrimitives::compact" );
+	ensureBuffer( mOffsets, count );
+	scan( flags, mOffsets, count, false, true );
+
+	const auto &glsl = mCompactShader->getGlsl();
+	gl::ScopedGlslProg scopedGlsl( glsl );
+	glsl->uniform( "uCount", count );
+	glsl->uniform( "uCounterIndex", counterIndex );
+	ScopedComputeBuffer scopedInput( input, 0 );
+	ScopedComputeBuffer scopedFlags( flags, 1 );
+	ScopedComputeBuffer scopedOffsets( mOffsets, 2 );
+	ScopedComputeBuffer scopedOutput( output, 3 );
+	ScopedComputeBuffer scopedCounter( counter, 4 );
+	dispatchGroups( ( count + mWorkGroupSize - 1 ) / mWorkGroupSize );
+}
+
+void ComputePrimitives::sort( const ComputeBufferRef &keys, uint32_t count, const ComputeBufferRef &payload )
+{
+	if( count < 2 || ! isReady( mHistogramShader ) || ! isReady( mScatterShader ) ) {
+		return;
+	}
+
+	renderkit::ScopedGpuTimer scopedTimer( "ComputePrimitives::sort" );
+	uint32_t numTiles		= ( count + getTileSize() - 1 ) / getTileSize();
+	uint32_t histogramSize	= numTiles * sRadix;
+	ensureBuffer( mHistogram, histogramSize );
+	ensureBuffer( mSortKeys, count );
+	if( payload ) {
+		ensureBuffer( mSortPayload, count );
+	}
+
+	// four passes ping-pong between the input and the scratch buffers and end in the input
+	for( uint32_t pass = 0; pass < 4; ++pass ) {
+		const auto &keysIn		= pass % 2 ? mSortKeys : keys;
+		const auto &keysOut		= pass % 2 ? keys : mSortKeys;
+		const auto &payloadIn	= payload ? ( pass % 2 ? mSortPayload : payload ) : keysIn;
+		const auto &payloadOut	= payload ? ( pass % 2 ? payload : mSortPayload ) : keysOut;
+		uint32_t shift			= pass * 8;
+
+		{
+			const auto &glsl = mHistogramShader->getGlsl();
+			gl::ScopedGlslProg scopedGlsl( glsl );
+			glsl->uniform( "uCount", count );
+			glsl->uniform( "uShift", shift );
+			glsl->uniform( "uNumTiles", numTiles );
+			ScopedComputeBuffer scopedKeys( keysIn, 0 );
+			ScopedComputeBuffer scopedHistogram( mHistogram, 1 );
+			dispatchGroups( numTiles );
+		}
+
+		ensureBuffer( mOffsets, histogramSize );
+		scan( mHistogram, mOffsets, histogramSize, false, false );
+
+		{
+			const auto &glsl = mScatterShader->getGlsl();
+			gl::ScopedGlslProg scopedGlsl( glsl );
+			glsl->uniform( "uCount", count );
+			glsl->uniform( "uShift", shift );
+			glsl->uniform( "uNumTiles", numTiles );
+			glsl->uniform( "uHasPayload", (int) ( payload != nullptr ) );
+			ScopedComputeBuffer scopedKeys( keysIn, 0 );
+			ScopedComputeBuffer scopedPayload( payloadIn, 1 );
+			ScopedComputeBuffer scopedOffsets( mOffsets, 2 );
+			ScopedComputeBuffer scopedKeysOut( keysOut, 3 );
+			ScopedComputeBuffer scopedPayloadOut( payloadOut, 4 );
+			dispatchGroups( numTiles );
+		}
+	}
+}
+
+std::string ComputePrimitives::benchmark( uint32_t numElements, int numIterations, int workGroupSize )
+{
+	auto primitives	= create( workGroupSize );
+	numElements		= std::max<uint32_t>( 1, numElements );
+	numIterations	= std::max( 1, numIterations );
+
+	mt19937 rng( 1 );
+	vector<uint32_t> values( numElements ), flags( numElements ), indices( numElements );
+	for( uint32_t i = 0; i < numElements; ++i ) {
+		values[i]	= rng();
+		flags[i]	= rng() & 1;
+	}
+	iota( indices.begin(), indices.end(), 0u );
+
+	auto input		= ComputeBuffer::create( values.data(), (int) numElements, sizeof( uint32_t ) );
+	auto flagBuffer	= ComputeBuffer::create( flags.data(), (int) numElements, sizeof( uint32_t ) );
+	auto output		= ComputeBuffer::create( nullptr, (int) numElements, sizeof( uint32_t ), GL_DYNAMIC_COPY );
+	auto payload	= ComputeBuffer::create( nullptr, (int) numElements, sizeof( uint32_t ), GL_DYNAMIC_COPY );
+	auto result		= ComputeBuffer::create( nullptr, 1, sizeof( uint32_t ), GL_DYNAMIC_COPY );
+
+	// every iteration is timed on its own so that the inputs can be restored in between
+	GLuint query;
+	glGenQueries( 1, &query );
+	auto time = [&]( const std::function<void()> &setupFn, const std::function<void()> &runFn ) {
+		double milliseconds = 0.0;
+		for( int i = 0; i < numIterations; ++i ) {
+			if( setupFn ) {
+				setupFn();
+			}
+			glBeginQuery( GL_TIME_ELAPSED, query );
+			runFn();
+			glEndQuery( GL_TIME_ELAPSED );
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v( query, GL_QUERY_RESULT, &nanoseconds );
+			milliseconds += nanoseconds * 1e-6;
+		}
+		return milliseconds / numIterations;
+	};
+
+	ostringstream report;
+	report << "ComputePrimitives benchmark, " << numElements << " elements, work group size " << primitives->getWorkGroupSize() << ", " << glGetString( GL_RENDERER ) << endl;
+	report << left << setw( 16 ) << "primitive" << right << setw( 12 ) << "ms" << setw( 16 ) << "elements/s" << "  check" << endl;
+	report << fixed;
+	auto addRow = [&]( const char *name, double milliseconds, bool valid ) {
+		report << left << setw( 16 ) << name << right << setw( 12 ) << setprecision( 3 ) << milliseconds
+			<< setw( 16 ) << setprecision( 0 ) << ( milliseconds > 0.0 ? numElements / ( milliseconds * 1e-3 ) : 0.0 ) << "  " << ( valid ? "ok" : "FAILED" ) << endl;
+	};
+
+	// scan, the sums wrap around like the CPU ones
+	{
+		double milliseconds = time( nullptr, [&] { primitives->exclusiveScan( input, output, numElements ); } );
+		vector<uint32_t> expected( numElements );
+		uint32_t sum = 0;
+		for( uint32_t i = 0; i < numElements; ++i ) {
+			expected[i] = sum;
+			sum += values[i];
+		}
+		addRow( "exclusiveScan", milliseconds, readBuffer( output, numElements ) == expected );
+	}
+
+	// reductions
+	{
+		double milliseconds = time( nullptr, [&] { primitives->reduce( input, numElements, ReduceOp::SUM, ValueType::UINT, result ); } );
+		addRow( "reduce sum", milliseconds, readBuffer( result, 1 )[0] == accumulate( values.begin(), values.end(), 0u ) );
+		milliseconds = time( nullptr, [&] { primitives->reduce( input, numElements, ReduceOp::MIN, ValueType::UINT, result ); } );
+		addRow( "reduce min", milliseconds, readBuffer( result, 1 )[0] == *min_element( values.begin(), values.end() ) );
+		milliseconds = time( nullptr, [&] { primitives->reduce( input, numElements, ReduceOp::MAX, ValueType::UINT, result ); } );
+		addRow( "reduce max", milliseconds, readBuffer( result, 1 )[0] == *max_element( values.begin(), values.end() ) );
+	}
+
+	// compaction
+	{
+		double milliseconds = time( nullptr, [&] { primitives->compact( input, flagBuffer, numElements, output, result ); } );
+		vector<uint32_t> expected;
+		for( uint32_t i = 0; i < numElements; ++i ) {
+			if( flags[i] ) {
+				expected.push_back( values[i] );
+			}
+		}
+		uint32_t count = readBuffer( result, 1 )[0];
+		addRow( "compact", milliseconds, count == expected.size() && readBuffer( output, count ) == expected );
+	}
+
+	// sort with payload, the keys and the payload are restored before every iteration
+	{
+		double milliseconds = time( [&] {
+			input->getSsbo()->bufferSubData( 0, numElements * sizeof( uint32_t ), values.data() );
+			payload->getSsbo()->bufferSubData( 0, numElements * sizeof( uint32_t ), indices.data() );
+		}, [&] { primitives->sort( input, numElements, payload ); } );
+
+		vector<uint32_t> order( indices );
+		stable_sort( order.begin(), order.end(), [&values]( uint32_t a, uint32_t b ) { return values[a] < values[b]; } );
+		vector<uint32_t> expected( numElements );
+		for( uint32_t i = 0; i < numElements; ++i ) {
+			expected[i] = values[order[i]];
+		}
+		addRow( "sort", milliseconds, readBuffer( input, numElements ) == expected && readBuffer( payload, numElements ) == order );
+	}
+
+	glDeleteQueries( 1, &query );
+	return report.str();
+}
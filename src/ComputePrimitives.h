@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Compute.h"
+
+#include <string>
+
+//! Parallel primitives on ComputeBuffer of 32-bit elements: prefix sum, reduction, stream compaction and radix sort.
+// Every primitive is specialised for the work group size given at creation through the WG_SIZE_X define, which must be a power of two
+// and at least 32, and is halved until the radix sort fits in the shared memory of the device. Each work group processes tiles of 4 elements per invocation.
+// The scratch buffers are kept between calls and only grow.
+// The dispatches are issued back to back with shader storage barriers, results are visible to the following dispatches.
+typedef std::shared_ptr<class ComputePrimitives> ComputePrimitivesRef;
+class ComputePrimitives {
+public:
+	enum class ReduceOp { SUM, MIN, MAX };
+	enum class ValueType { UINT, INT, FLOAT };
+
+	static ComputePrimitivesRef	create( int workGroupSize = 256 );
+
+	//! Exclusive prefix sum of the first \a count uints of \a input, written to \a output. Single pass with decoupled look-back, \a input and \a output can be the same buffer.
+	void						exclusiveScan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count );
+	//! Inclusive prefix sum of the first \a count uints of \a input, written to \a output.
+	void						inclusiveScan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count );
+	//! Reduces the first \a count elements of \a input with \a op and writes the result at \a resultIndex of \a result.
+	void						reduce( const ComputeBufferRef &input, uint32_t count, ReduceOp op, ValueType type, const ComputeBufferRef &result, GLuint resultIndex = 0 );
+	//! Copies the elements of \a input whose flag in \a flags isn't zero to \a output, preserving their order. The number of elements kept is written at \a counterIndex of \a counter and can feed DispatchArgs::write().
+	void						compact( const ComputeBufferRef &input, const ComputeBufferRef &flags, uint32_t count, const ComputeBufferRef &output, const ComputeBufferRef &counter, GLuint counterIndex = 0 );
+	//! Sorts the first \a count uint keys of \a keys in ascending order with a stable LSD radix sort of four 8-bit passes. \a payload, if any, is reordered with the keys.
+	void						sort( const ComputeBufferRef &keys, uint32_t count, const ComputeBufferRef &payload = nullptr );
+
+	//! Returns the work group size of the primitives.
+	int							getWorkGroupSize() const { return mWorkGroupSize; }
+	//! Returns the number of elements processed by a work group.
+	uint32_t					getTileSize() const;
+
+	//! Runs every primitive \a numIterations times on \a numElements random elements, checks the results against the CPU and returns a table of the GPU times and throughputs in elements per second. Run by samples/ComputePrimitivesBenchmark.
+	static std::string			benchmark( uint32_t numElements = 1 << 22, int numIterations = 10, int workGroupSize = 256 );
+
+protected:
+	ComputePrimitives( int workGroupSize );
+
+	void						scan( const ComputeBufferRef &input, const ComputeBufferRef &output, uint32_t count, bool inclusive, bool binarize );
+	void						ensureBuffer( ComputeBufferRef &buffer, uint32_t size );
+
+	int							mWorkGroupSize;
+	ComputeShaderRef			mScanShader, mReduceShader, mCompactShader, mHistogramShader, mScatterShader;
+	ComputeBufferRef			mScanState, mReduceBuffers[2], mOffsets, mHistogram, mSortKeys, mSortPayload;
+};
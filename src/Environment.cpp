@@ -35,14 +35,23 @@
 // https://github.com/dariomanesku/cmftStudio
 
 #include "Environment.h"
+#include "EnvironmentConvert.h"
+#include "Profiler.h"
 
 #include <random>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include "cinder/gl/Context.h"
 #include "cinder/gl/Fbo.h"
 #include "cinder/gl/Texture.h"
 #include "cinder/gl/Batch.h"
+#include "cinder/gl/Ubo.h"
 #include "cinder/gl/GlslProg.h"
 #include "cinder/gl/scoped.h"
 #include "cinder/gl/draw.h"
@@ -53,6 +62,98 @@ using namespace std;
 
 namespace renderkit {
 
+namespace {
+	const vec3 sFaceTargets[6]	= { vec3( 1, 0, 0 ), vec3( -1, 0, 0 ), vec3( 0, 1, 0 ), vec3( 0, -1, 0 ), vec3( 0, 0, 1 ), vec3( 0, 0, -1 ) };
+	const vec3 sFaceUps[6]		= { vec3( 0, 1, 0 ), vec3( 0, 1, 0 ), vec3( 0, 0, -1 ), vec3( 0, 0, 1 ), vec3( 0, 1, 0 ), vec3( 0, 1, 0 ) };
+
+	// header of the radiance caches written by Environment::write, followed by the RGBA float mip chain
+	struct CacheHeader {
+		char		mMagic[4];
+		uint32_t	mVersion;
+		uint32_t	mFaceSize;
+		uint32_t	mNumMips;
+	};
+	const char		sCacheMagic[4]	= { 'R', 'K', 'E', 'N' };
+	const uint32_t	sCacheVersion	= 1;
+
+	// writes the caches on a background thread so the render thread never waits on the disk. The thread
+	// starts with the first write and the pending files are flushed before it is joined at exit
+	class CacheWriter {
+	public:
+		static CacheWriter& get()
+		{
+			static CacheWriter sWriter;
+			return sWriter;
+		}
+		~CacheWriter()
+		{
+			{
+				lock_guard<mutex> lock( mMutex );
+				mIsDone = true;
+			}
+			mCondition.notify_one();
+			if( mThread.joinable() ) {
+				mThread.join();
+			}
+		}
+
+		void write( const fs::path &path, vector<char> &&bytes )
+		{
+			{
+				lock_guard<mutex> lock( mMutex );
+				mJobs.emplace_back( path, std::move( bytes ) );
+				if( ! mThread.joinable() ) {
+					mThread = thread( &CacheWriter::run, this );
+				}
+			}
+			mCondition.notify_one();
+		}
+
+	protected:
+		CacheWriter() : mIsDone( false ) {}
+
+		void run()
+		{
+			unique_lock<mutex> lock( mMutex );
+			while( true ) {
+				mCondition.wait( lock, [this] { return mIsDone || ! mJobs.empty(); } );
+				if( mJobs.empty() ) {
+					return;
+				}
+				auto job = std::move( mJobs.front() );
+				mJobs.pop_front();
+				lock.unlock();
+
+				ofstream file( job.first.string(), ios::binary );
+				if( file ) {
+					file.write( job.second.data(), job.second.size() );
+				}
+				if( ! file ) {
+					CI_LOG_W( "Environment: Can't write " << job.first );
+				}
+
+				lock.lock();
+			}
+		}
+
+		thread								mThread;
+		mutex								mMutex;
+		condition_variable					mCondition;
+		deque<pair<fs::path, vector<char>>>	mJobs;
+		bool								mIsDone;
+	};
+
+	// probes are rendered to, shared exponent formats are only usable for the read-only filtered maps
+	GLenum getCaptureFormat( GLenum internalFormat )
+	{
+		if( internalFormat == GL_RGB9_E5 ) {
+			CI_LOG_W( "Environment: GL_RGB9_E5 isn't color renderable, the probe is captured in GL_RGBA16F" );
+			return GL_RGBA16F;
+		}
+		return internalFormat;
+	}
+}
+
 EnvironmentRef Environment::create( int16_t width, int16_t height, const Format &format )
 {
 	return make_shared<Environment>( width, height, format );
@@ -65,11 +166,16 @@ EnvironmentRef Environment::create( const ci::gl::TextureCubeMapRef &skybox, con
 {
 	return make_shared<Environment>( skybox, radianceMap, irradianceMap, format );
 }
+EnvironmentRef Environment::createFromEquirectangular( const ci::DataSourceRef &source, uint16_t faceSize, const Format &format )
+{
+	auto cubeMap = EquirectangularConverter::convert( source, EquirectangularConverter::Format().faceSize( faceSize ) );
+	return make_shared<Environment>( cubeMap, format );
+}
 
 Environment::Environment( int16_t width, int16_t height, const Format &format ) 
 : Environment( 
 	gl::TextureCubeMap::create( width, height, gl::TextureCubeMap::Format()
-								.internalFormat( GL_RGBA32F )
+								.internalFormat( getCaptureFormat( format.mInternalFormat ) )
 								.mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR )
 								.wrap( GL_CLAMP_TO_EDGE ) ), 
 	nullptr, nullptr, Format( format ).probe() ) 
@@ -80,11 +186,22 @@ Environment::Environment( const ci::gl::TextureCubeMapRef &envMap, const Format
 {
 }
 Environment::Environment( const ci::gl::TextureCubeMapRef &skybox, const ci::gl::TextureCubeMapRef &radianceMap, const ci::gl::TextureCubeMapRef &irradianceMap, const Format &format )
-: mEnvironmentMap( skybox ), mRadianceMap( radianceMap ), mIrradianceMap( irradianceMap ),
-mPosition( format.mPosition ), mSize( format.mSize ), mHasRadiance( format.mRadiance ), mHasIrradiance( format.mIrradiance )
+: mHasRadiance( format.mRadiance ), mHasIrradiance( format.mIrradiance ), mIsSeamless( format.mIsSeamless ), mDirtyFaces( 0 ),
+mPosition( format.mPosition ), mSize( format.mSize ), mEnvironmentMap( skybox ), mRadianceMap( radianceMap ), mIrradianceMap( irradianceMap )
 {
+	if( format.mHasBrdfLut ) {
+		mBrdfLut = BrdfLut::getDefault();
+	}
+
 	if( format.mIsProbe ) {
 		auto fboFormat = gl::Fbo::Format().attachment( GL_COLOR_ATTACHMENT0, mEnvironmentMap );
+		// layered rendering requires every attachment to be layered, the depth cubemap replaces the default depth renderbuffer
+		if( format.mIsLayered ) {
+			mDepthMap = gl::TextureCubeMap::create( mEnvironmentMap->getWidth(), mEnvironmentMap->getHeight(), gl::TextureCubeMap::Format()
+													.internalFormat( GL_DEPTH_COMPONENT24 ).immutableStorage()
+													.minFilter( GL_NEAREST ).magFilter( GL_NEAREST ).wrap( GL_CLAMP_TO_EDGE ) );
+			fboFormat.disableDepth();
+		}
 		mFbo = gl::Fbo::create( mEnvironmentMap->getWidth(), mEnvironmentMap->getHeight(), fboFormat );
 
 		//mTexture->setLabel( "EnvMap" );
@@ -93,11 +210,13 @@ mPosition( format.mPosition ), mSize( format.mSize ), mHasRadiance( format.mRadi
 	}
 
 	if( ( ! mIrradianceMap && mHasIrradiance ) || ( ! mRadianceMap && mHasRadiance ) ) {
-		if( mEnvironmentMap ) {
-			mFilter = EnvironmentFilter::create( mEnvironmentMap );
+		if( format.mIsComputeFilter ) {
+			auto filterFormat = EnvironmentFilterCompute::Format().edgeFixup( format.mEdgeFixup ).internalFormat( format.mRadianceFormat );
+			mFilter = mEnvironmentMap ? EnvironmentFilterCompute::create( mEnvironmentMap, filterFormat ) : EnvironmentFilterCompute::create( filterFormat );
 		}
 		else {
-			mFilter = EnvironmentFilter::create();
+			auto filterFormat = EnvironmentFilter::Format().edgeFixup( format.mEdgeFixup ).internalFormat( format.mRadianceFormat );
+			mFilter = mEnvironmentMap ? EnvironmentFilter::create( mEnvironmentMap, filterFormat ) : EnvironmentFilter::create( filterFormat );
 		}
 		
 		mRadianceMap = mFilter->getPmRadianceEnvMap();
@@ -135,6 +254,41 @@ Environment::Format& Environment::Format::probe( bool enabled )
 	mIsProbe = enabled;
 	return *this;
 }
+Environment::Format& Environment::Format::layered( bool enabled )
+{
+	mIsLayered = enabled;
+	return *this;
+}
+Environment::Format& Environment::Format::computeFilter( bool enabled )
+{
+	mIsComputeFilter = enabled;
+	return *this;
+}
+Environment::Format& Environment::Format::brdfLut( bool enabled )
+{
+	mHasBrdfLut = enabled;
+	return *this;
+}
+Environment::Format& Environment::Format::seamless( bool enabled )
+{
+	mIsSeamless = enabled;
+	return *this;
+}
+Environment::Format& Environment::Format::edgeFixup( EdgeFixup fixup )
+{
+	mEdgeFixup = fixup;
+	return *this;
+}
+Environment::Format& Environment::Format::internalFormat( GLenum internalFormat )
+{
+	mInternalFormat = internalFormat;
+	return *this;
+}
+Environment::Format& Environment::Format::radianceFormat( GLenum internalFormat )
+{
+	mRadianceFormat = internalFormat;
+	return *this;
+}
 		
 ci::gl::TextureCubeMapRef Environment::getEnvironmentMap() const
 {
@@ -145,6 +299,9 @@ void Environment::setGlslUniforms( const ci::gl::GlslProg *glsl ) const
 	glsl->uniform( "uEnvironmentMap", 0 );
 	int numMipMaps = floor( std::log2( mRadianceMap->getWidth() ) ) - 1;
 	glsl->uniform( "uEnvMapMaxMip", (float) ( numMipMaps - 1 ) );
+	if( mBrdfLut ) {
+		glsl->uniform( "uBrdfLut", 1 );
+	}
 }
 void Environment::setGlslUniforms( const ci::gl::GlslProgRef &glsl ) const
 {
@@ -158,21 +315,76 @@ ci::gl::TextureCubeMapRef Environment::getIrradianceMap() const
 {
 	return mIrradianceMap;
 }
-void Environment::write()
+void Environment::write( const ci::fs::path &path, const EnvironmentReadbackRef &readback ) const
 {
+	readback->read( mRadianceMap, [path]( const EnvironmentReadback::Data &data ) {
+		// the mapped data is only valid during the callback, it is copied and the file is written by the CacheWriter thread
+		CacheHeader header;
+		memcpy( header.mMagic, sCacheMagic, sizeof( header.mMagic ) );
+		header.mVersion		= sCacheVersion;
+		header.mFaceSize	= data.getFaceSize();
+		header.mNumMips		= data.getNumMips();
+		vector<char> bytes( sizeof( header ) + data.getBytes() );
+		memcpy( bytes.data(), &header, sizeof( header ) );
+		memcpy( bytes.data() + sizeof( header ), data.getData(), data.getBytes() );
+		CacheWriter::get().write( path, std::move( bytes ) );
+	}, mFilter ? mFilter->getNumMips() : 0 );
 }
-void Environment::read()
+EnvironmentRef Environment::read( const ci::DataSourceRef &source, const Format &format )
 {
+	auto buffer = source->getBuffer();
+	CacheHeader header;
+	if( buffer->getSize() < sizeof( header ) ) {
+		CI_LOG_W( "Environment: Invalid environment cache" );
+		return nullptr;
+	}
+	memcpy( &header, buffer->getData(), sizeof( header ) );
+	if( memcmp( header.mMagic, sCacheMagic, sizeof( header.mMagic ) ) != 0 || header.mVersion != sCacheVersion ) {
+		CI_LOG_W( "Environment: Invalid environment cache" );
+		return nullptr;
+	}
+
+	// the header fields are checked against what a cubemap can hold before sizing anything with them
+	GLint maxFaceSize = 0;
+	glGetIntegerv( GL_MAX_CUBE_MAP_TEXTURE_SIZE, &maxFaceSize );
+	if( ! header.mFaceSize || header.mFaceSize > (uint32_t) std::min<GLint>( maxFaceSize, 0xFFFF ) || ! header.mNumMips || header.mNumMips > (uint32_t) floor( std::log2( header.mFaceSize ) ) + 1 ) {
+		CI_LOG_W( "Environment: Invalid environment cache size" );
+		return nullptr;
+	}
+	size_t bytes = EnvironmentFilterBase::calcCubeMapBytes( (uint16_t) header.mFaceSize, (uint8_t) header.mNumMips, GL_RGBA32F );
+	if( buffer->getSize() < sizeof( header ) + bytes ) {
+		CI_LOG_W( "Environment: Truncated environment cache" );
+		return nullptr;
+	}
+
+	GLenum internalFormat = format.mRadianceFormat ? format.mRadianceFormat : GL_RGBA16F;
+	auto textureFormat = gl::TextureCubeMap::Format().internalFormat( internalFormat ).mipmap( header.mNumMips > 1 ).minFilter( header.mNumMips > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE ).immutableStorage();
+	textureFormat.setMaxMipmapLevel( header.mNumMips - 1 );
+	auto radianceMap = gl::TextureCubeMap::create( header.mFaceSize, header.mFaceSize, textureFormat );
+
+	gl::ScopedTextureBind scopedTex( radianceMap );
+	const uint8_t *data = static_cast<const uint8_t*>( buffer->getData() ) + sizeof( header );
+	for( uint32_t level = 0; level < header.mNumMips; level++ ) {
+		GLint levelSize = std::max( 1, (GLint) header.mFaceSize >> level );
+		for( GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X; face < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++face ) {
+			glTexSubImage2D( face, level, 0, 0, levelSize, levelSize, GL_RGBA, GL_FLOAT, data );
+			data += (size_t) levelSize * levelSize * 4 * sizeof( float );
+		}
+	}
+
+	// the first level of the radiance map is the unfiltered environment and doubles as the skybox
+	return Environment::create( radianceMap, radianceMap, radianceMap, format );
 }
 void Environment::update()
 {
-	if( mHasIrradiance || mHasRadiance ) {
-		mFilter->filter();
+	if( ( mHasIrradiance || mHasRadiance ) && mFilter ) {
+		mFilter->filterFaces( mDirtyFaces ? mDirtyFaces : 0x3F );
 	}
+	mDirtyFaces = 0;
 }
 
 ScopedEnvironmentWrite::ScopedEnvironmentWrite( const EnvironmentRef &envMap )
-: mGlContext( gl::Context::getCurrent() ), mEnvironment( envMap )
+: mGlContext( gl::Context::getCurrent() ), mEnvironment( envMap ), mIsTiming( false )
 {
 	mGlContext->pushFramebuffer( mEnvironment->mFbo );
 	//CI_LOG_W( mEnvironment->mFbo->getWidth() );
@@ -180,6 +392,7 @@ ScopedEnvironmentWrite::ScopedEnvironmentWrite( const EnvironmentRef &envMap )
 }
 ScopedEnvironmentWrite::~ScopedEnvironmentWrite()
 {
+	endCaptureTimer();
 	gl::popMatrices();
 	mGlContext->popFramebuffer();
 	//mEnvironment->mFbo->resolveTextures();
@@ -187,15 +400,64 @@ ScopedEnvironmentWrite::~ScopedEnvironmentWrite()
 }
 void ScopedEnvironmentWrite::bindFace( uint8_t dir )
 {
+	beginCaptureTimer( dir );
+	mEnvironment->mDirtyFaces |= 1 << dir;
 	glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + dir, mEnvironment->getEnvironmentMap()->getId(), 0 );
+	if( mEnvironment->mDepthMap ) {
+		glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + dir, mEnvironment->mDepthMap->getId(), 0 );
+	}
 }
 
 void ScopedEnvironmentWrite::setViewMatrix( uint8_t dir, const ci::vec3 & eye )
 {
-	static const vec3 target[6] = { vec3( 1, 0, 0 ), vec3( -1, 0, 0 ), vec3( 0, 1, 0 ), vec3( 0, -1, 0 ), vec3( 0, 0, 1 ), vec3( 0, 0, -1 ) };
-	static const vec3 up[6] = { vec3( 0, 1, 0 ), vec3( 0, 1, 0 ), vec3( 0, 0, -1 ), vec3( 0, 0, 1 ), vec3( 0, 1, 0 ), vec3( 0, 1, 0 ) };
-		
-	gl::setViewMatrix( glm::lookAt( eye, eye + target[dir], up[dir] ) );
+	gl::setViewMatrix( glm::lookAt( eye, eye + sFaceTargets[dir], sFaceUps[dir] ) );
+}
+
+void ScopedEnvironmentWrite::bindLayered()
+{
+	if( ! mEnvironment->mDepthMap ) {
+		CI_LOG_W( "ScopedEnvironmentWrite: Layered capture requires an Environment created with Format::layered()" );
+		return;
+	}
+	beginCaptureTimer( -1 );
+	mEnvironment->mDirtyFaces = 0x3F;
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mEnvironment->getEnvironmentMap()->getId(), 0 );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mEnvironment->mDepthMap->getId(), 0 );
+}
+
+void ScopedEnvironmentWrite::beginCaptureTimer( int face )
+{
+	endCaptureTimer();
+	if( profiler()->isEnabled() ) {
+		profiler()->beginGpu( face < 0 ? "Environment capture layered" : "Environment capture face " + to_string( face ) );
+		mIsTiming = true;
+	}
+}
+
+void ScopedEnvironmentWrite::endCaptureTimer()
+{
+	if( mIsTiming ) {
+		profiler()->endGpu();
+		mIsTiming = false;
+	}
+}
+
+void ScopedEnvironmentWrite::setViewProjectionMatrices( const ci::vec3 &eye, float nearClip, float farClip, uint8_t bindingPoint )
+{
+	mat4 viewProjections[6];
+	mat4 projection = glm::perspective( glm::radians( 90.0f ), 1.0f, nearClip, farClip );
+	for( uint8_t dir = 0; dir < 6; ++dir ) {
+		viewProjections[dir] = projection * glm::lookAt( eye, eye + sFaceTargets[dir], sFaceUps[dir] );
+	}
+
+	auto &ubo = mEnvironment->mCaptureUbo;
+	if( ! ubo ) {
+		ubo = gl::Ubo::create( sizeof( viewProjections ), viewProjections, GL_DYNAMIC_DRAW );
+	}
+	else {
+		ubo->bufferSubData( 0, sizeof( viewProjections ), viewProjections );
+	}
+	ubo->bindBufferBase( bindingPoint );
 }
 
 ScopedEnvironmentRead::ScopedEnvironmentRead( const EnvironmentRef &envMap, uint8_t textureUnit )
@@ -203,16 +465,26 @@ ScopedEnvironmentRead::ScopedEnvironmentRead( const EnvironmentRef &envMap, uint
 , mEnvironment( envMap )
 , mTextureUnit{ textureUnit }
 {
-	//mGlContext->pushBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS, true );
+	if( mEnvironment->isSeamless() ) {
+		mGlContext->pushBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS, true );
+	}
 	mGlContext->pushTextureBinding( mEnvironment->getRadianceMap()->getTarget(), mEnvironment->getRadianceMap()->getId(), mTextureUnit );
+	if( const auto &brdfLut = mEnvironment->getBrdfLut() ) {
+		mGlContext->pushTextureBinding( GL_TEXTURE_2D, brdfLut->getTexture()->getId(), mTextureUnit + 1 );
+	}
 	//if( auto glsl = mGlContext->getGlslProg() ) {
 	//	mEnvironment->setGlslUniforms( glsl );
 	//}
 }
 ScopedEnvironmentRead::~ScopedEnvironmentRead()
 {
-	//mGlContext->popBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS );
+	if( mEnvironment->isSeamless() ) {
+		mGlContext->popBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS );
+	}
 	mGlContext->popTextureBinding( mEnvironment->getRadianceMap()->getTarget(), mTextureUnit );
+	if( mEnvironment->getBrdfLut() ) {
+		mGlContext->popTextureBinding( GL_TEXTURE_2D, mTextureUnit + 1 );
+	}
 }
 
 } // namespace renderkit
\ No newline at end of file
@@ -28,7 +28,10 @@
 #include <deque>
 
 #include "EnvironmentFilter.h"
+#include "EnvironmentBrdf.h"
+#include "EnvironmentReadback.h"
 
+#include "cinder/Filesystem.h"
 #include "cinder/Noncopyable.h"
 #include "cinder/gl/platform.h"
 #include "cinder/gl/Fbo.h"
@@ -36,10 +39,13 @@
 #include "cinder/Vector.h"
 
 // Cinder's forward declarations
-namespace cinder { namespace gl { 
+namespace cinder {
+typedef std::shared_ptr<class DataSource>		DataSourceRef;
+namespace gl { 
 typedef std::shared_ptr<class TextureCubeMap>	TextureCubeMapRef;
 typedef std::shared_ptr<class Fbo>				FboRef;
 typedef std::shared_ptr<class GlslProg>			GlslProgRef;
+typedef std::shared_ptr<class Ubo>				UboRef;
 class Context;
 } } // namespace cinder::gl
 
@@ -61,6 +67,8 @@ public:
 	static EnvironmentRef create( const ci::gl::TextureCubeMapRef& skybox, const Format &format = Format() );
 	//! Returns a new refcounted Environment object from a skybox, radiance and irradiance cubemaps. (Those textures can be generated in cmft studio https://github.com/dariomanesku/cmftStudio )
 	static EnvironmentRef create( const ci::gl::TextureCubeMapRef& skybox, const ci::gl::TextureCubeMapRef& radianceMap, const ci::gl::TextureCubeMapRef& irradianceMap, const Format &format = Format() );
+	//! Returns a new refcounted Environment object from an equirectangular .hdr / .exr panorama. The panorama is converted to a cubemap with rk::EquirectangularConverter and then filtered.
+	static EnvironmentRef createFromEquirectangular( const ci::DataSourceRef &source, uint16_t faceSize = 512, const Format &format = Format() );
 	//! Returns a new empty Environment object. This is usually used as a probe and should be initialized at least once with rk::ScopedEnvironmentWrite
 	Environment( int16_t width, int16_t height, const Format &format = Format() );
 	//! Constructs a new Environment object from a single cubemap texture.
@@ -71,7 +79,7 @@ public:
 	class Format {
 	public:
 		//! Constructs a new default Environment Format object
-		Format() : mRadiance( true ), mIrradiance( true ), mIsProgressive( true ), mIsProbe( false ), mPosition( 0.0f ), mSize( 0.0f ) {}
+		Format() : mRadiance( true ), mIrradiance( true ), mIsProgressive( true ), mIsProbe( false ), mIsLayered( false ), mIsComputeFilter( false ), mHasBrdfLut( false ), mIsSeamless( false ), mEdgeFixup( EdgeFixup::NONE ), mInternalFormat( GL_RGBA32F ), mRadianceFormat( 0 ), mPosition( 0.0f ), mSize( 0.0f ) {}
 
 		//! Specifies whether a prefiltered environment map has to be computed. Enabled by default.
 		Format& radiance( bool enabled = true );
@@ -85,9 +93,25 @@ public:
 		Format& probe( bool enabled = true );
 		//! Specifies whether the generation of the underlying maps should happen accross several frames instead of being calculated at initialization.
 		Format& progressive( bool enabled = true );
+		//! Specifies whether the probe can be captured in a single pass with rk::ScopedEnvironmentWrite::bindLayered. Allocates a depth cubemap instead of a depth renderbuffer. Default to false.
+		Format& layered( bool enabled = true );
+		//! Specifies whether the maps are filtered with compute shaders ( rk::EnvironmentFilterCompute ) instead of rasterization. Default to false.
+		Format& computeFilter( bool enabled = true );
+		//! Specifies whether the shared rk::BrdfLut is bound next to the radiance map by rk::ScopedEnvironmentRead. Default to false.
+		Format& brdfLut( bool enabled = true );
+		//! Specifies whether rk::ScopedEnvironmentRead enables GL_TEXTURE_CUBE_MAP_SEAMLESS so that lookups filter across the faces. Disabled by default, the edge fixups are the alternative on hardware without seamless filtering.
+		Format& seamless( bool enabled = true );
+		//! Sets the edge fixup method used by the filter. Default to EdgeFixup::NONE.
+		Format& edgeFixup( EdgeFixup fixup );
+		//! Sets the internal format of the probe capture cubemap. Must be color renderable, GL_RGB9_E5 falls back to GL_RGBA16F. Default to GL_RGBA32F.
+		Format& internalFormat( GLenum internalFormat );
+		//! Sets the internal format of the filtered radiance map. GL_RGB9_E5 halves the size of GL_RGBA16F for read-only maps. Default to 0, which uses the format of the environment map.
+		Format& radianceFormat( GLenum internalFormat );
 
 	protected:
-		bool mRadiance, mIrradiance, mIsProgressive, mIsProbe;
+		bool mRadiance, mIrradiance, mIsProgressive, mIsProbe, mIsLayered, mIsComputeFilter, mHasBrdfLut, mIsSeamless;
+		EdgeFixup mEdgeFixup;
+		GLenum mInternalFormat, mRadianceFormat;
 		ci::vec3 mPosition, mSize;
 		friend class Environment;
 	};
@@ -98,25 +122,48 @@ public:
 	ci::gl::TextureCubeMapRef getIrradianceMap() const;
 	//! Returns the non-filtered texture. Can be used as a skybox.
 	ci::gl::TextureCubeMapRef getEnvironmentMap() const;
+	//! Returns the depth cubemap of a layered probe.
+	ci::gl::TextureCubeMapRef getDepthMap() const { return mDepthMap; }
+	//! Returns whether the probe can be captured in a single pass.
+	bool isLayered() const { return mDepthMap != nullptr; }
+	//! Returns whether rk::ScopedEnvironmentRead enables seamless cubemap filtering.
+	bool isSeamless() const { return mIsSeamless; }
+	//! Returns the split-sum BRDF lookup table or nullptr if disabled.
+	const BrdfLutRef& getBrdfLut() const { return mBrdfLut; }
+	//! Sets the split-sum BRDF lookup table bound by rk::ScopedEnvironmentRead.
+	void setBrdfLut( const BrdfLutRef &brdfLut ) { mBrdfLut = brdfLut; }
 	
-	//! Sets the GlslProg's EnvironmentMapping related uniforms
+	//! Sets the GlslProg's EnvironmentMapping related uniforms. uBrdfLut uses the texture unit following uEnvironmentMap.
 	void setGlslUniforms( const ci::gl::GlslProg *glsl ) const;	
 	//! Sets the GlslProg's EnvironmentMapping related uniforms
 	void setGlslUniforms( const ci::gl::GlslProgRef &glsl ) const;
 
+	//! Refilters the maps. Only the parts depending on the faces rebound by rk::ScopedEnvironmentWrite since the last update are refiltered, or everything if none were.
 	void update();
+	//! Flags the faces in the \a faces bitmask ( 1 << face ) as modified, for content that isn't written through rk::ScopedEnvironmentWrite.
+	void markDirty( uint8_t faces = 0x3F ) { mDirtyFaces |= faces; }
+	//! Returns the bitmask of the faces modified since the last update.
+	uint8_t getDirtyFaces() const { return mDirtyFaces; }
 
-	// TODO:
-	void write();
-	void read();
+	//! Queues an asynchronous readback of the radiance map on \a readback and writes it to \a path once delivered by rk::EnvironmentReadback::update(). Nothing stalls waiting for the GPU, and the file is written on a background thread.
+	void write( const ci::fs::path &path, const EnvironmentReadbackRef &readback ) const;
+	//! Returns a new refcounted Environment object whose radiance map is loaded from a cache written by write(). The maps are used as is and aren't filtered again. Returns nullptr if \a source isn't a valid cache.
+	static EnvironmentRef read( const ci::DataSourceRef &source, const Format &format = Format() );
 
 	const ci::gl::FboRef& getFbo() const { return mFbo; }
 	const EnvironmentFilterBaseRef& getFilter() const { return mFilter; }
 
+	//! Returns the box position of a local cubemap.
+	const ci::vec3& getPosition() const { return mPosition; }
+	//! Returns the box size of a local cubemap. A zero size means the cubemap is infinite.
+	const ci::vec3& getSize() const { return mSize; }
+
 protected:
 	
 	bool						mHasRadiance;
 	bool						mHasIrradiance;
+	bool						mIsSeamless;
+	uint8_t						mDirtyFaces;
 
 	ci::vec3					mPosition;
 	ci::vec3					mSize;
@@ -124,29 +171,47 @@ protected:
 	ci::gl::TextureCubeMapRef	mEnvironmentMap;
 	ci::gl::TextureCubeMapRef	mRadianceMap;
 	ci::gl::TextureCubeMapRef	mIrradianceMap;
+	ci::gl::TextureCubeMapRef	mDepthMap;
 
 	ci::gl::FboRef				mFbo;	
+	ci::gl::UboRef				mCaptureUbo;
 
 	EnvironmentFilterBaseRef	mFilter;
+	BrdfLutRef					mBrdfLut;
 
 	friend class ScopedEnvironmentWrite;
 };
 
 //! Similar to gl::ScopedFramebuffer, this is used to capture an Environment surroundings. Takes care of settings the states and binding the framebuffer
+// A probe created with Format::layered() can also be captured in a single pass: bindLayered() attaches the whole cubemap and
+// setViewProjectionMatrices() uploads the six face matrices to a uniform block that a geometry shader ( or instanced gl_Layer output ) can index:
+//   layout (std140) uniform EnvironmentCapture { mat4 uCaptureViewProjection[6]; };
 class ScopedEnvironmentWrite : private ci::Noncopyable {
 public:
 	ScopedEnvironmentWrite( const EnvironmentRef &envMap );
 	~ScopedEnvironmentWrite();
 	
+	//! Attaches a single face of the cubemap to the framebuffer.
 	void bindFace( uint8_t dir );
+	//! Sets the view matrix for the face \a dir.
 	void setViewMatrix( uint8_t dir, const ci::vec3 &eye );
 
+	//! Attaches the whole cubemap to the framebuffer for layered rendering. The probe must have been created with Format::layered().
+	void bindLayered();
+	//! Uploads the six face view-projection matrices to the EnvironmentCapture uniform block and binds it to \a bindingPoint.
+	void setViewProjectionMatrices( const ci::vec3 &eye, float nearClip, float farClip, uint8_t bindingPoint = 0 );
+
 protected:
+	//! Times the capture until the next bind or the end of the scope when rk::Profiler is enabled.
+	void beginCaptureTimer( int face );
+	void endCaptureTimer();
+
 	ci::gl::Context*		mGlContext;
 	EnvironmentRef			mEnvironment;
+	bool					mIsTiming;
 };
 
-//! Similar to gl::ScopedTextureBind. Takes care of settings the states and binding the framebuffer
+//! Similar to gl::ScopedTextureBind. Takes care of settings the states and binding the framebuffer. The BRDF lookup table, if any, is bound to \a textureUnit + 1.
 class ScopedEnvironmentRead : private ci::Noncopyable {
 public:
 	ScopedEnvironmentRead( const EnvironmentRef &envMap, uint8_t textureUnit = 0 );
@@ -0,0 +1,263 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// http://blog.selfshadow.com/publications/s2013-shading-course/karis/s2013_pbs_epic_slides.pdf
+// https://cdn2.unrealengine.com/Resources/files/2013SiggraphPresentationsNotes-26915738.pdf
+
+#include "EnvironmentBrdf.h"
+#include "Compute.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#include "cinder/app/App.h"
+#include "cinder/gl/Texture.h"
+#include "cinder/gl/GlslProg.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/gl/wrapper.h"
+#include "cinder/Log.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+namespace {
+	const char		sCacheMagic[4]	= { 'B', 'L', 'U', 'T' };
+	const uint32_t	sCacheVersion	= 1;
+
+	// weak so that the texture is released with the last Environment using it, while its GL context is still alive
+	std::weak_ptr<BrdfLut>	sDefaultLut;
+
+	float radicalInverse( uint32_t bits )
+	{
+		bits = ( bits << 16u ) | ( bits >> 16u );
+		bits = ( ( bits & 0x55555555u ) << 1u ) | ( ( bits & 0xAAAAAAAAu ) >> 1u );
+		bits = ( ( bits & 0x33333333u ) << 2u ) | ( ( bits & 0xCCCCCCCCu ) >> 2u );
+		bits = ( ( bits & 0x0F0F0F0Fu ) << 4u ) | ( ( bits & 0xF0F0F0F0u ) >> 4u );
+		bits = ( ( bits & 0x00FF00FFu ) << 8u ) | ( ( bits & 0xFF00FF00u ) >> 8u );
+		return float( bits ) * 2.3283064365386963e-10f;
+	}
+
+	// Integrates a row of constant roughness. The half vectors only depend on the roughness so they are generated once, in
+	// structure-of-arrays form, and the inner loop over the samples is branchless so that the compiler can vectorize it.
+	// V lies in the xz plane which means that the y component of the half vectors is never needed.
+	void integrateRow( uint16_t row, uint16_t size, uint16_t numSamples, float *hx, float *hz, float *output )
+	{
+		const float roughness	= ( float( row ) + 0.5f ) / float( size );
+		const float a			= roughness * roughness;
+		const float k			= a * 0.5f;
+		for( uint16_t i = 0; i < numSamples; ++i ) {
+			float phi		= 2.0f * float( M_PI ) * float( i ) / float( numSamples );
+			float xi		= radicalInverse( i );
+			float cosTheta	= sqrt( ( 1.0f - xi ) / ( 1.0f + ( a * a - 1.0f ) * xi ) );
+			float sinTheta	= sqrt( 1.0f - cosTheta * cosTheta );
+			hx[i]			= sinTheta * cos( phi );
+			hz[i]			= cosTheta;
+		}
+
+		for( uint16_t x = 0; x < size; ++x ) {
+			const float NdotV	= ( float( x ) + 0.5f ) / float( size );
+			const float vx		= sqrt( 1.0f - NdotV * NdotV );
+			const float vz		= NdotV;
+			const float gNdotV	= NdotV / ( NdotV * ( 1.0f - k ) + k );
+
+			float scale = 0.0f, bias = 0.0f;
+			for( uint16_t i = 0; i < numSamples; ++i ) {
+				float VdotH	= vx * hx[i] + vz * hz[i];
+				float NdotL	= 2.0f * VdotH * hz[i] - vz;
+				float mask	= NdotL > 0.0f ? 1.0f : 0.0f;
+				NdotL		= max( NdotL, 1e-6f );
+				VdotH		= max( VdotH, 0.0f );
+				float gNdotL	= NdotL / ( NdotL * ( 1.0f - k ) + k );
+				float Gvis	= mask * gNdotV * gNdotL * VdotH / ( hz[i] * NdotV );
+				float t		= 1.0f - VdotH;
+				float Fc	= t * t * t * t * t;
+				scale		+= ( 1.0f - Fc ) * Gvis;
+				bias		+= Fc * Gvis;
+			}
+
+			output[x * 2 + 0] = scale / float( numSamples );
+			output[x * 2 + 1] = bias / float( numSamples );
+		}
+	}
+} // anonymous namespace
+
+BrdfLutRef BrdfLut::create( const Format &format )
+{
+	return make_shared<BrdfLut>( format );
+}
+
+BrdfLutRef BrdfLut::getDefault()
+{
+	auto lut = sDefaultLut.lock();
+	if( ! lut ) {
+		lut = BrdfLut::create( Format().cache( getDefaultCachePath() ) );
+		sDefaultLut = lut;
+	}
+	return lut;
+}
+
+ci::fs::path BrdfLut::getDefaultCachePath()
+{
+	// a table shipped with the assets is used as is, otherwise the one generated on the first launch is kept next to the application
+	auto assetPath = app::getAssetPath( "brdf_lut.bin" );
+	if( ! assetPath.empty() && fs::exists( assetPath ) ) {
+		return assetPath;
+	}
+	return app::getAppPath() / "brdf_lut.bin";
+}
+
+BrdfLut::BrdfLut( const Format &format )
+{
+	const uint16_t size			= format.getSize();
+	const uint16_t numSamples	= format.getNumSamples();
+	const auto &cachePath		= format.getCachePath();
+
+	vector<float> data;
+	if( cachePath.empty() || ! readCache( cachePath, size, numSamples, &data ) ) {
+		if( format.isGpu() ) {
+			data = computeGpu( size, numSamples );
+		}
+		// the gpu path falls back to the cpu if the compute shader is not available
+		if( data.empty() ) {
+			data = compute( size, numSamples, format.getNumThreads() );
+		}
+		if( ! cachePath.empty() ) {
+			writeCache( cachePath, size, numSamples, data );
+		}
+	}
+
+	if( ! mTexture ) {
+		auto textureFormat = gl::Texture2d::Format().internalFormat( GL_RG16F ).dataType( GL_FLOAT ).minFilter( GL_LINEAR ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE );
+		mTexture = gl::Texture2d::create( data.data(), GL_RG, size, size, textureFormat );
+	}
+}
+
+std::vector<float> BrdfLut::compute( uint16_t size, uint16_t numSamples, uint8_t numThreads )
+{
+	vector<float> data( (size_t) size * size * 2 );
+	if( ! size || ! numSamples ) {
+		return data;
+	}
+
+	uint32_t threadCount = numThreads ? numThreads : std::max( 1u, thread::hardware_concurrency() );
+	threadCount = std::min<uint32_t>( threadCount, size );
+
+	// rows are handed out dynamically, low roughness rows are not cheaper but this keeps every thread busy regardless of the row count
+	atomic<uint32_t> nextRow( 0 );
+	auto worker = [&]() {
+		vector<float> hx( numSamples ), hz( numSamples );
+		for( uint32_t row = nextRow++; row < size; row = nextRow++ ) {
+			integrateRow( (uint16_t) row, size, numSamples, hx.data(), hz.data(), &data[(size_t) row * size * 2] );
+		}
+	};
+
+	vector<thread> threads;
+	for( uint32_t i = 1; i < threadCount; ++i ) {
+		threads.emplace_back( worker );
+	}
+	worker();
+	for( auto &t : threads ) {
+		t.join();
+	}
+
+	return data;
+}
+
+std::vector<float> BrdfLut::computeGpu( uint16_t size, uint16_t numSamples )
+{
+	ComputeShaderRef computeShader;
+	try {
+		computeShader = ComputeShader::create( "glsl/pbr/BrdfLut.comp", ivec3( 8, 8, 1 ) );
+	}
+	catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+	if( ! computeShader || ! computeShader->getGlsl() ) {
+		return {};
+	}
+
+	auto textureFormat = gl::Texture2d::Format().internalFormat( GL_RG16F ).immutableStorage().minFilter( GL_LINEAR ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE );
+	mTexture = gl::Texture2d::create( size, size, textureFormat );
+
+	const auto &glsl = computeShader->getGlsl();
+	glsl->uniform( "uSize", (int) size );
+	glsl->uniform( "uNumSamples", (int) numSamples );
+	glBindImageTexture( 0, mTexture->getId(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG16F );
+	computeShader->dispatch( ( size + 7 ) / 8, ( size + 7 ) / 8, 1 );
+	glBindImageTexture( 0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG16F );
+	gl::memoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT );
+
+	// read the result back so that it can be cached
+	vector<float> data( (size_t) size * size * 2 );
+	gl::ScopedTextureBind scopedTex( mTexture );
+	glGetTexImage( GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, data.data() );
+	return data;
+}
+
+bool BrdfLut::readCache( const ci::fs::path &path, uint16_t size, uint16_t numSamples, std::vector<float> *data ) const
+{
+	ifstream file( path.string(), ios::binary );
+	if( ! file ) {
+		return false;
+	}
+
+	char magic[4];
+	uint32_t version = 0;
+	uint16_t fileSize = 0, fileSamples = 0;
+	file.read( magic, sizeof( magic ) );
+	file.read( reinterpret_cast<char*>( &version ), sizeof( version ) );
+	file.read( reinterpret_cast<char*>( &fileSize ), sizeof( fileSize ) );
+	file.read( reinterpret_cast<char*>( &fileSamples ), sizeof( fileSamples ) );
+	if( ! file || memcmp( magic, sCacheMagic, sizeof( magic ) ) != 0 || version != sCacheVersion || fileSize != size || fileSamples != numSamples ) {
+		return false;
+	}
+
+	data->resize( (size_t) size * size * 2 );
+	file.read( reinterpret_cast<char*>( data->data() ), data->size() * sizeof( float ) );
+	if( ! file ) {
+		data->clear();
+		return false;
+	}
+	return true;
+}
+
+void BrdfLut::writeCache( const ci::fs::path &path, uint16_t size, uint16_t numSamples, const std::vector<float> &data ) const
+{
+	ofstream file( path.string(), ios::binary | ios::trunc );
+	if( ! file ) {
+		CI_LOG_W( "BrdfLut: Unable to write cache file " << path );
+		return;
+	}
+
+	file.write( sCacheMagic, sizeof( sCacheMagic ) );
+	file.write( reinterpret_cast<const char*>( &sCacheVersion ), sizeof( sCacheVersion ) );
+	file.write( reinterpret_cast<const char*>( &size ), sizeof( size ) );
+	file.write( reinterpret_cast<const char*>( &numSamples ), sizeof( numSamples ) );
+	file.write( reinterpret_cast<const char*>( data.data() ), data.size() * sizeof( float ) );
+}
+
+} // namespace renderkit
@@ -0,0 +1,107 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "cinder/Filesystem.h"
+
+// Cinder's forward declarations
+namespace cinder { namespace gl {
+typedef std::shared_ptr<class Texture2d>		Texture2dRef;
+} } // namespace cinder::gl
+
+namespace renderkit {
+
+// type aliases
+using BrdfLutRef = std::shared_ptr<class BrdfLut>;
+
+//! Second split of the split-sum approximation used with Environment's prefiltered radiance maps.
+// Stores the scale ( red ) and bias ( green ) applied to F0, indexed by NdotV ( u ) and roughness ( v ).
+class BrdfLut {
+public:
+	// forward declaration
+	class Format;
+
+	//! Returns a new refcounted BrdfLut object. Loads the table from the cache file if it exists, otherwise generates it and writes the cache.
+	static BrdfLutRef create( const Format &format = Format() );
+	//! Returns the default BrdfLut shared by every Environment created with Environment::Format::brdfLut(). The table is read from getDefaultCachePath(), and only
+	//! generated and written there when the file is missing. The BrdfLut is released with the last Environment using it.
+	static BrdfLutRef getDefault();
+	//! Returns the cache file of the default BrdfLut: "brdf_lut.bin" in the assets if shipped with the application, otherwise next to the application.
+	static ci::fs::path getDefaultCachePath();
+	//! Constructs a new BrdfLut object.
+	BrdfLut( const Format &format = Format() );
+
+	class Format {
+	public:
+		//! Constructs a new default BrdfLut Format object
+		Format() : mSize( 128 ), mNumSamples( 1024 ), mNumThreads( 0 ), mGpu( false ) {}
+
+		//! Sets the width and height of the table. Default to 128.
+		Format& size( uint16_t size ) { mSize = size; return *this; }
+		//! Sets the number of GGX samples per texel. Default to 1024.
+		Format& samples( uint16_t numSamples ) { mNumSamples = numSamples; return *this; }
+		//! Sets the number of threads used by the CPU generator. Default to 0, which uses the number of hardware threads.
+		Format& threads( uint8_t numThreads ) { mNumThreads = numThreads; return *this; }
+		//! Specifies whether the table is generated with a compute shader instead of the CPU. Default to false.
+		Format& gpu( bool enabled = true ) { mGpu = enabled; return *this; }
+		//! Sets the path of the cache file. The table is read from it when valid and written to it after generation. Disabled if empty.
+		Format& cache( const ci::fs::path &path ) { mCachePath = path; return *this; }
+
+		//! Returns the width and height of the table.
+		uint16_t				getSize() const { return mSize; }
+		//! Returns the number of GGX samples per texel.
+		uint16_t				getNumSamples() const { return mNumSamples; }
+		//! Returns the number of threads used by the CPU generator.
+		uint8_t					getNumThreads() const { return mNumThreads; }
+		//! Returns whether the table is generated with a compute shader.
+		bool					isGpu() const { return mGpu; }
+		//! Returns the path of the cache file.
+		const ci::fs::path&		getCachePath() const { return mCachePath; }
+
+	protected:
+		uint16_t		mSize, mNumSamples;
+		uint8_t			mNumThreads;
+		bool			mGpu;
+		ci::fs::path	mCachePath;
+	};
+
+	//! Returns the RG16F lookup table texture.
+	const ci::gl::Texture2dRef& getTexture() const { return mTexture; }
+
+	//! Computes the table on the CPU and returns \a size * \a size interleaved scale / bias pairs. Doesn't require a GL context.
+	static std::vector<float> compute( uint16_t size, uint16_t numSamples, uint8_t numThreads = 0 );
+
+protected:
+	bool readCache( const ci::fs::path &path, uint16_t size, uint16_t numSamples, std::vector<float> *data ) const;
+	void writeCache( const ci::fs::path &path, uint16_t size, uint16_t numSamples, const std::vector<float> &data ) const;
+	std::vector<float> computeGpu( uint16_t size, uint16_t numSamples );
+
+	ci::gl::Texture2dRef	mTexture;
+};
+
+} // namespace renderkit
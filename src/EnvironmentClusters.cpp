@@ -0,0 +1,251 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EnvironmentClusters.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "cinder/Camera.h"
+#include "cinder/gl/GlslProg.h"
+#include "cinder/gl/Ssbo.h"
+#include "cinder/Log.h"
+
+#include "EnvironmentManager.h"
+#include "Profiler.h"
+#include "WorkStealingPool.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+EnvironmentClustersRef EnvironmentClusters::create( const Format &format )
+{
+	return make_shared<EnvironmentClusters>( format );
+}
+
+EnvironmentClusters::EnvironmentClusters( const Format &format )
+: mFormat( format ), mNumOverflows( 0 ), mNearClip( 0.1f ), mFarClip( 1000.0f ), mProjection( 1.0f, 1.0f, 0.0f, 0.0f )
+{
+	mFormat.mGridSize				= glm::max( mFormat.mGridSize, ivec3( 1 ) );
+	mFormat.mMaxProbesPerCluster	= std::max<uint8_t>( mFormat.mMaxProbesPerCluster, 1 );
+	if( ! mFormat.mNumThreads ) {
+		mFormat.mNumThreads = (uint8_t) glm::clamp<unsigned>( thread::hardware_concurrency(), 1, 255 );
+	}
+
+	const ivec3 &grid = mFormat.mGridSize;
+	if( std::min<int>( mFormat.mNumThreads, grid.z ) > 1 ) {
+		mPool = WorkStealingPool::create( std::min<int>( mFormat.mNumThreads, grid.z ) );
+	}
+	mClusters.assign( (size_t) grid.x * grid.y * grid.z * ( mFormat.mMaxProbesPerCluster + 1 ), 0 );
+	mSliceDepths.resize( grid.z + 1 );
+}
+
+void EnvironmentClusters::update( const ci::CameraPersp &camera, const EnvironmentManagerRef &manager )
+{
+	update( camera, manager->getProbes() );
+}
+
+void EnvironmentClusters::update( const ci::CameraPersp &camera, const std::vector<EnvironmentRef> &probes )
+{
+	ScopedCpuTimer scopedTimer( "EnvironmentClusters::update" );
+	const ivec3 &grid		= mFormat.mGridSize;
+	const mat4 &view		= camera.getViewMatrix();
+	const mat4 &projection	= camera.getProjectionMatrix();
+	mNearClip				= camera.getNearClip();
+	mFarClip				= camera.getFarClip();
+	mProjection				= vec4( projection[0][0], projection[1][1], projection[2][0], projection[2][1] );
+
+	// exponential slices keep the clusters roughly cubic along the depth
+	float logRange = log( mFarClip / mNearClip );
+	for( int slice = 0; slice <= grid.z; ++slice ) {
+		mSliceDepths[slice] = mNearClip * exp( logRange * float( slice ) / float( grid.z ) );
+	}
+	auto depthToSlice = [&]( float depth ) {
+		return glm::clamp( (int) floor( log( depth / mNearClip ) / logRange * grid.z ), 0, grid.z - 1 );
+	};
+	auto ndcToTile = [&]( float ndc, int numTiles ) {
+		return glm::clamp( (int) floor( ( ndc * 0.5f + 0.5f ) * numTiles ), 0, numTiles - 1 );
+	};
+
+	// the view space bounds and cluster ranges are found once per probe, the slices are then binned in parallel
+	vector<ProbeBounds> bounds;
+	bounds.reserve( probes.size() );
+	for( size_t i = 0; i < probes.size(); ++i ) {
+		const auto &probe = probes[i];
+		if( ! probe || probe->getSize() == vec3( 0.0f ) ) {
+			continue;
+		}
+
+		ProbeBounds probeBounds;
+		probeBounds.mIndex	= (uint32_t) i;
+		probeBounds.mVolume	= probe->getSize().x * probe->getSize().y * probe->getSize().z;
+		probeBounds.mMin	= vec3( numeric_limits<float>::max() );
+		probeBounds.mMax	= vec3( -numeric_limits<float>::max() );
+		vec3 corners[8];
+		for( int c = 0; c < 8; ++c ) {
+			vec3 corner		= probe->getPosition() + probe->getSize() * ( vec3( c & 1, ( c >> 1 ) & 1, ( c >> 2 ) & 1 ) - vec3( 0.5f ) );
+			corners[c]		= vec3( view * vec4( corner, 1.0f ) );
+			probeBounds.mMin = glm::min( probeBounds.mMin, corners[c] );
+			probeBounds.mMax = glm::max( probeBounds.mMax, corners[c] );
+		}
+
+		float nearDepth = -probeBounds.mMax.z, farDepth = -probeBounds.mMin.z;
+		if( farDepth < mNearClip || nearDepth > mFarClip ) {
+			continue;
+		}
+		probeBounds.mFirst.z	= depthToSlice( std::max( nearDepth, mNearClip ) );
+		probeBounds.mLast.z		= depthToSlice( std::min( farDepth, mFarClip ) );
+
+		// the projected corners bound the box only when it is entirely in front of the camera
+		if( nearDepth > mNearClip ) {
+			vec2 ndcMin( numeric_limits<float>::max() ), ndcMax( -numeric_limits<float>::max() );
+			for( const auto &corner : corners ) {
+				vec2 ndc = vec2( mProjection.x * corner.x, mProjection.y * corner.y ) / -corner.z - vec2( mProjection.z, mProjection.w );
+				ndcMin = glm::min( ndcMin, ndc );
+				ndcMax = glm::max( ndcMax, ndc );
+			}
+			if( ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f ) {
+				continue;
+			}
+			probeBounds.mFirst.x	= ndcToTile( ndcMin.x, grid.x );
+			probeBounds.mLast.x		= ndcToTile( ndcMax.x, grid.x );
+			probeBounds.mFirst.y	= ndcToTile( ndcMin.y, grid.y );
+			probeBounds.mLast.y		= ndcToTile( ndcMax.y, grid.y );
+		}
+		else {
+			probeBounds.mFirst.x	= probeBounds.mFirst.y = 0;
+			probeBounds.mLast.x		= grid.x - 1;
+			probeBounds.mLast.y		= grid.y - 1;
+		}
+		bounds.push_back( probeBounds );
+	}
+
+	// smaller boxes are more local, binning them first gives them priority when a cluster overflows
+	sort( bounds.begin(), bounds.end(), []( const ProbeBounds &a, const ProbeBounds &b ) { return a.mVolume < b.mVolume; } );
+
+	fill( mClusters.begin(), mClusters.end(), 0 );
+	mNumOverflows = 0;
+	if( ! bounds.empty() ) {
+		if( ! mPool ) {
+			binSlices( bounds, 0, grid.z - 1, &mNumOverflows );
+		}
+		else {
+			// each range owns a set of depth slices, so no cluster is ever written by two threads
+			uint32_t grain = (uint32_t) ( grid.z + mPool->getNumThreads() - 1 ) / mPool->getNumThreads();
+			vector<size_t> overflows( ( grid.z + grain - 1 ) / grain, 0 );
+			mPool->run( grid.z, grain, [&]( uint32_t first, uint32_t last ) {
+				binSlices( bounds, first, last - 1, &overflows[first / grain] );
+			} );
+			for( auto overflow : overflows ) {
+				mNumOverflows += overflow;
+			}
+		}
+	}
+
+	upload();
+}
+
+void EnvironmentClusters::binSlices( const std::vector<ProbeBounds> &bounds, int firstSlice, int lastSlice, size_t *numOverflows )
+{
+	const ivec3 &grid	= mFormat.mGridSize;
+	uint32_t stride		= mFormat.mMaxProbesPerCluster + 1;
+
+	for( const auto &probe : bounds ) {
+		int first	= std::max( probe.mFirst.z, firstSlice );
+		int last	= std::min( probe.mLast.z, lastSlice );
+		for( int z = first; z <= last; ++z ) {
+			float depths[2] = { mSliceDepths[z], mSliceDepths[z + 1] };
+			if( probe.mMin.z > -depths[0] || probe.mMax.z < -depths[1] ) {
+				continue;
+			}
+			for( int y = probe.mFirst.y; y <= probe.mLast.y; ++y ) {
+				float ndcY[2] = { -1.0f + 2.0f * y / grid.y, -1.0f + 2.0f * ( y + 1 ) / grid.y };
+				for( int x = probe.mFirst.x; x <= probe.mLast.x; ++x ) {
+					float ndcX[2] = { -1.0f + 2.0f * x / grid.x, -1.0f + 2.0f * ( x + 1 ) / grid.x };
+
+					// view space bounds of the froxel, a box crossing the near plane covers every tile but is rejected here where it doesn't reach
+					vec2 froxelMin( numeric_limits<float>::max() ), froxelMax( -numeric_limits<float>::max() );
+					for( float depth : depths ) {
+						for( int i = 0; i < 2; ++i ) {
+							vec2 p = vec2( ( ndcX[i] + mProjection.z ) / mProjection.x, ( ndcY[i] + mProjection.w ) / mProjection.y ) * depth;
+							froxelMin = glm::min( froxelMin, p );
+							froxelMax = glm::max( froxelMax, p );
+						}
+					}
+					if( probe.mMin.x > froxelMax.x || probe.mMax.x < froxelMin.x || probe.mMin.y > froxelMax.y || probe.mMax.y < froxelMin.y ) {
+						continue;
+					}
+
+					uint32_t *cluster = &mClusters[( ( (size_t) z * grid.y + y ) * grid.x + x ) * stride];
+					if( cluster[0] < mFormat.mMaxProbesPerCluster ) {
+						cluster[1 + cluster[0]++] = probe.mIndex;
+					}
+					else {
+						++( *numOverflows );
+					}
+				}
+			}
+		}
+	}
+}
+
+void EnvironmentClusters::upload()
+{
+	GLsizeiptr bytes = (GLsizeiptr) ( mClusters.size() * sizeof( uint32_t ) );
+	if( ! mBuffer ) {
+		mBuffer = gl::Ssbo::create( bytes, mClusters.data(), GL_STREAM_DRAW );
+	}
+	else {
+		// orphans the previous storage so that the upload doesn't wait on the frame still reading it
+		mBuffer->bufferData( bytes, mClusters.data(), GL_STREAM_DRAW );
+	}
+}
+
+void EnvironmentClusters::bind( uint8_t bindingPoint )
+{
+	if( ! mBuffer ) {
+		upload();
+	}
+	mBuffer->bindBase( bindingPoint );
+}
+
+void EnvironmentClusters::setGlslUniforms( const ci::gl::GlslProg *glsl, const ci::ivec2 &viewportSize ) const
+{
+	const ivec3 &grid	= mFormat.mGridSize;
+	float logRange		= log( mFarClip / mNearClip );
+	glsl->uniform( "uClusterGrid", grid );
+	glsl->uniform( "uClusterViewport", vec2( viewportSize ) );
+	glsl->uniform( "uClusterDepthParams", vec2( grid.z / logRange, -grid.z * log( mNearClip ) / logRange ) );
+	glsl->uniform( "uMaxProbesPerCluster", (int) mFormat.mMaxProbesPerCluster );
+}
+
+void EnvironmentClusters::setGlslUniforms( const ci::gl::GlslProgRef &glsl, const ci::ivec2 &viewportSize ) const
+{
+	setGlslUniforms( glsl.get(), viewportSize );
+}
+
+} // namespace renderkit
@@ -0,0 +1,138 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "cinder/Vector.h"
+#include "cinder/gl/platform.h"
+
+#include "Environment.h"
+
+// Cinder's forward declarations
+namespace cinder {
+class CameraPersp;
+namespace gl {
+typedef std::shared_ptr<class Ssbo>				SsboRef;
+} } // namespace cinder::gl
+
+typedef std::shared_ptr<class WorkStealingPool> WorkStealingPoolRef;
+
+namespace renderkit {
+
+// type aliases
+using EnvironmentClustersRef		= std::shared_ptr<class EnvironmentClusters>;
+using EnvironmentManagerRef			= std::shared_ptr<class EnvironmentManager>;
+
+//! Bins local environments into the froxels ( frustum-aligned clusters ) of a camera so that shaders only fetch the few probes affecting a pixel.
+// The grid is made of screen tiles and exponential depth slices. It is rebuilt on the CPU every frame, the depth slices being binned in parallel, and uploaded to a shader storage buffer:
+//   layout (std430) buffer EnvironmentClusters { uint uClusters[]; };
+// Each cluster is a count followed by uMaxProbesPerCluster probe indices. The cluster of a fragment at the view space depth d ( positive ) is found with:
+//   ivec3 c = ivec3( ivec2( gl_FragCoord.xy ) * uClusterGrid.xy / ivec2( uClusterViewport ), int( log( d ) * uClusterDepthParams.x + uClusterDepthParams.y ) );
+//   uint base = uint( ( ( c.z * uClusterGrid.y + c.y ) * uClusterGrid.x + c.x ) * ( uMaxProbesPerCluster + 1 ) );
+// Indices refer to the list of environments passed to update(), which for an rk::EnvironmentManager is the order of getProbes() and of its probe buffer.
+// Environments without a size are infinite and are never binned. When a cluster overflows, the smallest boxes are kept since they are the most local.
+class EnvironmentClusters {
+public:
+	// forward declaration
+	class Format;
+
+	//! Returns a new refcounted EnvironmentClusters object.
+	static EnvironmentClustersRef create( const Format &format = Format() );
+	//! Constructs a new EnvironmentClusters object.
+	EnvironmentClusters( const Format &format = Format() );
+
+	class Format {
+	public:
+		//! Constructs a new default EnvironmentClusters Format object
+		Format() : mGridSize( 16, 9, 24 ), mMaxProbesPerCluster( 4 ), mNumThreads( 0 ) {}
+
+		//! Sets the number of screen tiles and depth slices of the grid. Default to 16x9x24.
+		Format& gridSize( const ci::ivec3 &size ) { mGridSize = size; return *this; }
+		//! Sets the maximum number of probes stored per cluster. Default to 4.
+		Format& maxProbesPerCluster( uint8_t numProbes ) { mMaxProbesPerCluster = numProbes; return *this; }
+		//! Sets the number of threads used to bin the probes. The threads are created with the clusters and kept until they are destroyed. Default to 0, which uses the number of hardware threads.
+		Format& numThreads( uint8_t numThreads ) { mNumThreads = numThreads; return *this; }
+
+		//! Returns the number of screen tiles and depth slices of the grid.
+		const ci::ivec3&	getGridSize() const { return mGridSize; }
+		//! Returns the maximum number of probes stored per cluster.
+		uint8_t				getMaxProbesPerCluster() const { return mMaxProbesPerCluster; }
+		//! Returns the number of threads used to bin the probes.
+		uint8_t				getNumThreads() const { return mNumThreads; }
+
+	protected:
+		ci::ivec3	mGridSize;
+		uint8_t		mMaxProbesPerCluster, mNumThreads;
+		friend class EnvironmentClusters;
+	};
+
+	//! Rebuilds the clusters of \a camera from the boxes of \a probes and uploads them.
+	void update( const ci::CameraPersp &camera, const std::vector<EnvironmentRef> &probes );
+	//! Rebuilds the clusters of \a camera from the probes of \a manager and uploads them.
+	void update( const ci::CameraPersp &camera, const EnvironmentManagerRef &manager );
+
+	//! Binds the cluster buffer to the shader storage \a bindingPoint.
+	void bind( uint8_t bindingPoint = 1 );
+	//! Sets the GlslProg's cluster related uniforms. \a viewportSize is the size of the framebuffer the clusters are looked up from.
+	void setGlslUniforms( const ci::gl::GlslProg *glsl, const ci::ivec2 &viewportSize ) const;
+	//! Sets the GlslProg's cluster related uniforms. \a viewportSize is the size of the framebuffer the clusters are looked up from.
+	void setGlslUniforms( const ci::gl::GlslProgRef &glsl, const ci::ivec2 &viewportSize ) const;
+
+	//! Returns the shader storage buffer holding the clusters.
+	const ci::gl::SsboRef& getBuffer() const { return mBuffer; }
+	//! Returns the CPU copy of the clusters uploaded by the last update.
+	const std::vector<uint32_t>& getClusters() const { return mClusters; }
+	//! Returns the number of probe references dropped by the last update because their cluster was full.
+	size_t getNumOverflows() const { return mNumOverflows; }
+	//! Returns the Format used to create the clusters.
+	const Format& getFormat() const { return mFormat; }
+
+protected:
+	//! View space bounds of a probe and the range of clusters they overlap.
+	struct ProbeBounds {
+		uint32_t	mIndex;
+		float		mVolume;
+		ci::vec3	mMin, mMax;
+		ci::ivec3	mFirst, mLast;
+	};
+
+	void binSlices( const std::vector<ProbeBounds> &bounds, int firstSlice, int lastSlice, size_t *numOverflows );
+	void upload();
+
+	Format					mFormat;
+	std::vector<uint32_t>	mClusters;
+	std::vector<float>		mSliceDepths;
+	size_t					mNumOverflows;
+
+	float					mNearClip, mFarClip;
+	ci::vec4				mProjection; // x and y scales and offsets of the projection matrix
+
+	ci::gl::SsboRef			mBuffer;
+	WorkStealingPoolRef		mPool;
+};
+
+} // namespace renderkit
@@ -0,0 +1,469 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EnvironmentConvert.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cinder/gl/Texture.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/Log.h"
+#include "cinder/Stream.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+namespace {
+
+// Returns the equirectangular coordinates in [0,1] of \a dir. v = 0 is the top row of the panorama.
+vec2 directionToEquirectangular( const vec3 &dir )
+{
+	return vec2( 0.5f + atan2( dir.x, -dir.z ) / float( 2.0 * M_PI ), acos( glm::clamp( dir.y, -1.0f, 1.0f ) ) / float( M_PI ) );
+}
+
+//! ImageTarget receiving the decoded rows one by one and box-filtering them into a panorama no larger than what the faces need.
+// Each destination pixel is the average of a fixed block of source pixels, so the normalization weights are known upfront and the rows can arrive in any order.
+class StreamingPanorama : public ImageTarget {
+public:
+	StreamingPanorama( int32_t sourceWidth, int32_t sourceHeight, uint16_t faceSize )
+	: mSourceWidth( sourceWidth ), mSourceHeight( sourceHeight ), mPendingRow( -1 ), mDone( false )
+	{
+		setSize( sourceWidth, sourceHeight );
+		setColorModel( ImageIo::CM_RGB );
+		setChannelOrder( ImageIo::RGB );
+		setDataType( ImageIo::FLOAT32 );
+
+		// four faces span the width of the panorama
+		mReducedWidth	= std::max( 1, std::min( sourceWidth, 4 * (int32_t) faceSize ) );
+		mReducedHeight	= std::max( 1, (int32_t) ( (int64_t) sourceHeight * mReducedWidth / sourceWidth ) );
+		mRow.resize( (size_t) sourceWidth * 3 );
+		mPixels.assign( (size_t) mReducedWidth * mReducedHeight * 3, 0.0f );
+		mRowContributions.assign( mReducedHeight, 0 );
+
+		mColumnWeights.assign( mReducedWidth, 0.0f );
+		for( int32_t x = 0; x < sourceWidth; ++x ) {
+			mColumnWeights[(int64_t) x * mReducedWidth / sourceWidth] += 1.0f;
+		}
+		mRowCounts.assign( mReducedHeight, 0 );
+		for( int32_t y = 0; y < sourceHeight; ++y ) {
+			mRowCounts[(int64_t) y * mReducedHeight / sourceHeight]++;
+		}
+		for( auto &weight : mColumnWeights ) {
+			weight = 1.0f / weight;
+		}
+	}
+
+	void* getRowPointer( int32_t row ) override
+	{
+		flush();
+		mPendingRow = row;
+		return mRow.data();
+	}
+
+	void finalize() override
+	{
+		flush();
+		setDone();
+	}
+
+	//! Unblocks the face workers, called when decoding is over or has failed.
+	void setDone()
+	{
+		{
+			lock_guard<mutex> lock( mMutex );
+			mDone = true;
+		}
+		mCondition.notify_all();
+	}
+
+	//! Blocks until the destination rows [ first, last ] are complete or decoding is over.
+	void waitForRows( int32_t first, int32_t last )
+	{
+		unique_lock<mutex> lock( mMutex );
+		mCondition.wait( lock, [&] {
+			if( mDone ) {
+				return true;
+			}
+			for( int32_t y = first; y <= last; ++y ) {
+				if( mRowContributions[y] < mRowCounts[y] ) {
+					return false;
+				}
+			}
+			return true;
+		} );
+	}
+
+	//! Returns the bilinearly filtered color at the equirectangular coordinates \a uv. Wraps horizontally and clamps vertically.
+	vec3 sample( const vec2 &uv ) const
+	{
+		float px = uv.x * mReducedWidth - 0.5f;
+		float py = glm::clamp( uv.y * mReducedHeight - 0.5f, 0.0f, float( mReducedHeight - 1 ) );
+		float fx = floor( px ), fy = floor( py );
+		float tx = px - fx, ty = py - fy;
+		int32_t x0 = ( (int32_t) fx % mReducedWidth + mReducedWidth ) % mReducedWidth;
+		int32_t x1 = ( x0 + 1 ) % mReducedWidth;
+		int32_t y0 = (int32_t) fy;
+		int32_t y1 = std::min( y0 + 1, mReducedHeight - 1 );
+
+		const float *p00 = &mPixels[( (size_t) y0 * mReducedWidth + x0 ) * 3];
+		const float *p10 = &mPixels[( (size_t) y0 * mReducedWidth + x1 ) * 3];
+		const float *p01 = &mPixels[( (size_t) y1 * mReducedWidth + x0 ) * 3];
+		const float *p11 = &mPixels[( (size_t) y1 * mReducedWidth + x1 ) * 3];
+		vec3 result;
+		for( int c = 0; c < 3; ++c ) {
+			float top		= p00[c] + ( p10[c] - p00[c] ) * tx;
+			float bottom	= p01[c] + ( p11[c] - p01[c] ) * tx;
+			result[c]		= top + ( bottom - top ) * ty;
+		}
+		return result;
+	}
+
+	int32_t getReducedWidth() const { return mReducedWidth; }
+	int32_t getReducedHeight() const { return mReducedHeight; }
+
+protected:
+	//! Accumulates the last decoded row into the reduced panorama.
+	void flush()
+	{
+		if( mPendingRow < 0 || mPendingRow >= mSourceHeight ) {
+			mPendingRow = -1;
+			return;
+		}
+
+		int32_t y		= (int32_t) ( (int64_t) mPendingRow * mReducedHeight / mSourceHeight );
+		float rowWeight	= 1.0f / float( mRowCounts[y] );
+		float *dst		= &mPixels[(size_t) y * mReducedWidth * 3];
+		for( int32_t x = 0; x < mSourceWidth; ++x ) {
+			int32_t dx		= (int32_t) ( (int64_t) x * mReducedWidth / mSourceWidth );
+			float weight	= rowWeight * mColumnWeights[dx];
+			dst[dx * 3 + 0] += mRow[x * 3 + 0] * weight;
+			dst[dx * 3 + 1] += mRow[x * 3 + 1] * weight;
+			dst[dx * 3 + 2] += mRow[x * 3 + 2] * weight;
+		}
+		mPendingRow = -1;
+
+		bool complete;
+		{
+			lock_guard<mutex> lock( mMutex );
+			complete = ++mRowContributions[y] == mRowCounts[y];
+		}
+		if( complete ) {
+			mCondition.notify_all();
+		}
+	}
+
+	int32_t					mSourceWidth, mSourceHeight;
+	int32_t					mReducedWidth, mReducedHeight;
+	int32_t					mPendingRow;
+	std::vector<float>		mRow;
+	std::vector<float>		mPixels;
+	std::vector<float>		mColumnWeights;
+	std::vector<uint32_t>	mRowCounts;
+	std::vector<uint32_t>	mRowContributions;
+
+	std::mutex				mMutex;
+	std::condition_variable	mCondition;
+	bool					mDone;
+};
+
+//! ImageSource decoding a Radiance .hdr file one scanline at a time, only the current scanline is held in memory.
+// Cinder's own Radiance source decodes the whole float image when it is created, which defeats the streaming of StreamingPanorama.
+class RadianceScanlineSource : public ImageSource {
+public:
+	RadianceScanlineSource( const DataSourceRef &source )
+	: mStream( source->createStream() ), mFlipped( false )
+	{
+		if( readHeaderLine().compare( 0, 2, "#?" ) != 0 ) {
+			throw ImageIoExceptionFailedLoad( "Radiance: missing #? signature" );
+		}
+		for( string line = readHeaderLine(); ! line.empty(); line = readHeaderLine() ) {
+			if( line.compare( 0, 7, "FORMAT=" ) == 0 && line != "FORMAT=32-bit_rle_rgbe" ) {
+				throw ImageIoExceptionFailedLoad( "Radiance: unsupported " + line );
+			}
+		}
+
+		// only the usual top to bottom / left to right orientations
+		char ySign, xSign;
+		int32_t width, height;
+		string resolution = readHeaderLine();
+		if( sscanf( resolution.c_str(), "%cY %d %cX %d", &ySign, &height, &xSign, &width ) != 4 || xSign != '+' || width <= 0 || height <= 0 ) {
+			throw ImageIoExceptionFailedLoad( "Radiance: unsupported resolution " + resolution );
+		}
+		mFlipped = ySign == '+';
+
+		setSize( width, height );
+		setColorModel( ImageIo::CM_RGB );
+		setChannelOrder( ImageIo::RGB );
+		setDataType( ImageIo::FLOAT32 );
+	}
+
+	void load( ImageTargetRef target ) override
+	{
+		ImageSource::RowFunc func = setupRowFunc( target );
+		vector<uint8_t> rgbe( (size_t) mWidth * 4 );
+		vector<float> row( (size_t) mWidth * 3 );
+		for( int32_t y = 0; y < mHeight; ++y ) {
+			readScanline( rgbe.data() );
+			for( int32_t x = 0; x < mWidth; ++x ) {
+				const uint8_t *texel	= &rgbe[x * 4];
+				float scale				= texel[3] ? ldexp( 1.0f, (int) texel[3] - ( 128 + 8 ) ) : 0.0f;
+				row[x * 3 + 0]			= texel[0] * scale;
+				row[x * 3 + 1]			= texel[1] * scale;
+				row[x * 3 + 2]			= texel[2] * scale;
+			}
+			( ( *this ).*func )( target, mFlipped ? mHeight - 1 - y : y, row.data() );
+		}
+	}
+
+protected:
+	string readHeaderLine()
+	{
+		string line = mStream->readLine();
+		if( ! line.empty() && line.back() == '\r' ) {
+			line.pop_back();
+		}
+		return line;
+	}
+
+	//! Reads a scanline of \a mWidth RGBE texels, run length encoded or not.
+	void readScanline( uint8_t *rgbe )
+	{
+		if( mWidth < 8 || mWidth > 0x7fff ) {
+			readFlatScanline( rgbe, 0 );
+			return;
+		}
+
+		// anything but the 2, 2, width header is a flat scanline starting with this texel
+		mStream->readData( rgbe, 4 );
+		if( rgbe[0] != 2 || rgbe[1] != 2 || ( rgbe[2] & 0x80 ) ) {
+			readFlatScanline( rgbe, 1 );
+			return;
+		}
+		if( ( rgbe[2] << 8 | rgbe[3] ) != mWidth ) {
+			throw ImageIoExceptionFailedLoad( "Radiance: scanline width mismatch" );
+		}
+
+		// each channel is stored separately as runs of a single value ( count > 128 ) or literal bytes
+		uint8_t bytes[128];
+		for( int channel = 0; channel < 4; ++channel ) {
+			for( int32_t x = 0; x < mWidth; ) {
+				uint8_t count;
+				mStream->readData( &count, 1 );
+				bool run = count > 128;
+				count = run ? count - 128 : count;
+				if( ! count || x + count > mWidth ) {
+					throw ImageIoExceptionFailedLoad( "Radiance: corrupt scanline" );
+				}
+				mStream->readData( bytes, run ? 1 : count );
+				for( uint8_t i = 0; i < count; ++i, ++x ) {
+					rgbe[x * 4 + channel] = bytes[run ? 0 : i];
+				}
+			}
+		}
+	}
+
+	//! Reads uncompressed texels from \a x to the end of the scanline, expanding the old 1, 1, 1, count repeats.
+	void readFlatScanline( uint8_t *rgbe, int32_t x )
+	{
+		int shift = 0;
+		while( x < mWidth ) {
+			uint8_t *texel = &rgbe[x * 4];
+			mStream->readData( texel, 4 );
+			if( texel[0] == 1 && texel[1] == 1 && texel[2] == 1 ) {
+				int32_t count = (int32_t) texel[3] << shift;
+				if( ! x || x + count > mWidth ) {
+					throw ImageIoExceptionFailedLoad( "Radiance: corrupt scanline" );
+				}
+				for( int32_t i = 0; i < count; ++i, ++x ) {
+					copy( texel - 4, texel, &rgbe[x * 4] );
+				}
+				shift += 8;
+			}
+			else {
+				++x;
+				shift = 0;
+			}
+		}
+	}
+
+	IStreamRef	mStream;
+	bool		mFlipped;
+};
+
+//! Returns whether \a source is a Radiance .hdr file, which can be read one scanline at a time.
+bool isRadiance( const DataSourceRef &source )
+{
+	string extension = source->getFilePathHint().extension().string();
+	transform( extension.begin(), extension.end(), extension.begin(), []( char c ) { return (char) tolower( c ); } );
+	return extension == ".hdr";
+}
+
+// Returns the range of reduced panorama rows covered by \a face. The latitude extrema of a face lie on its border or at its center.
+ivec2 calcFaceRows( uint8_t face, uint16_t faceSize, EdgeFixup fixup, int32_t panoramaHeight )
+{
+	float vMin = 1.0f, vMax = 0.0f;
+	auto expand = [&]( float x, float y ) {
+		float v = directionToEquirectangular( EnvironmentFilterBase::texelToDirection( face, x, y, faceSize, fixup ) ).y;
+		vMin = std::min( vMin, v );
+		vMax = std::max( vMax, v );
+	};
+	float last = float( faceSize - 1 );
+	for( uint16_t i = 0; i < faceSize; ++i ) {
+		expand( i, 0.0f );
+		expand( i, last );
+		expand( 0.0f, i );
+		expand( last, i );
+	}
+	expand( last * 0.5f, last * 0.5f );
+
+	// one extra row on each side for the bilinear taps and the extrema falling between two border texels
+	int32_t first	= glm::clamp( (int32_t) floor( vMin * panoramaHeight - 0.5f ) - 1, 0, panoramaHeight - 1 );
+	int32_t lastRow	= glm::clamp( (int32_t) ceil( vMax * panoramaHeight - 0.5f ) + 1, 0, panoramaHeight - 1 );
+	return ivec2( first, lastRow );
+}
+
+void resampleFace( const StreamingPanorama &panorama, uint8_t face, uint16_t faceSize, EdgeFixup fixup, float *output )
+{
+	for( uint16_t y = 0; y < faceSize; ++y ) {
+		for( uint16_t x = 0; x < faceSize; ++x ) {
+			vec3 color = panorama.sample( directionToEquirectangular( EnvironmentFilterBase::texelToDirection( face, x, y, faceSize, fixup ) ) );
+			float *dst = &output[( (size_t) y * faceSize + x ) * 3];
+			dst[0] = color.r;
+			dst[1] = color.g;
+			dst[2] = color.b;
+		}
+	}
+}
+
+} // anonymous namespace
+
+void EquirectangularConverter::convert( const ci::ImageSourceRef &source, uint16_t faceSize, const FaceFn &faceFn, EdgeFixup fixup )
+{
+	auto panorama = make_shared<StreamingPanorama>( source->getWidth(), source->getHeight(), faceSize );
+
+	// every face waits on its own worker for the rows it covers, the top and bottom faces start while the rest is still decoding
+	vector<thread> workers;
+	for( uint8_t face = 0; face < 6; ++face ) {
+		workers.emplace_back( [panorama, face, faceSize, fixup, &faceFn] {
+			ivec2 rows = calcFaceRows( face, faceSize, fixup, panorama->getReducedHeight() );
+			panorama->waitForRows( rows.x, rows.y );
+			vector<float> pixels( (size_t) faceSize * faceSize * 3 );
+			resampleFace( *panorama, face, faceSize, fixup, pixels.data() );
+			if( faceFn ) {
+				faceFn( face, faceSize, pixels.data() );
+			}
+		} );
+	}
+
+	exception_ptr error;
+	try {
+		source->load( panorama );
+	}
+	catch( ... ) {
+		error = current_exception();
+	}
+	panorama->finalize();
+
+	for( auto &worker : workers ) {
+		worker.join();
+	}
+	if( error ) {
+		rethrow_exception( error );
+	}
+}
+
+ci::gl::TextureCubeMapRef EquirectangularConverter::convert( const ci::DataSourceRef &source, const Format &format )
+{
+	auto image		= isRadiance( source ) ? ImageSourceRef( make_shared<RadianceScanlineSource>( source ) ) : loadImage( source );
+	uint16_t size	= format.getFaceSize();
+
+	auto textureFormat = gl::TextureCubeMap::Format().internalFormat( format.getInternalFormat() ).magFilter( GL_LINEAR ).wrap( GL_CLAMP_TO_EDGE ).immutableStorage();
+	if( format.isMipmap() ) {
+		textureFormat.mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR );
+	}
+	else {
+		textureFormat.minFilter( GL_LINEAR );
+	}
+	auto cubeMap = gl::TextureCubeMap::create( size, size, textureFormat );
+
+	// decoding and resampling run on worker threads while this thread uploads the faces as they complete
+	mutex faceMutex;
+	condition_variable faceCondition;
+	deque<pair<uint8_t, vector<float>>> faces;
+	exception_ptr error;
+	bool done = false;
+
+	thread producer( [&] {
+		try {
+			convert( image, size, [&]( uint8_t face, uint16_t faceSize, const float *data ) {
+				vector<float> pixels( data, data + (size_t) faceSize * faceSize * 3 );
+				lock_guard<mutex> lock( faceMutex );
+				faces.emplace_back( face, move( pixels ) );
+				faceCondition.notify_one();
+			}, format.getEdgeFixup() );
+		}
+		catch( ... ) {
+			error = current_exception();
+		}
+		lock_guard<mutex> lock( faceMutex );
+		done = true;
+		faceCondition.notify_one();
+	} );
+
+	gl::ScopedTextureBind scopedTex( cubeMap );
+	while( true ) {
+		unique_lock<mutex> lock( faceMutex );
+		faceCondition.wait( lock, [&] { return ! faces.empty() || done; } );
+		if( faces.empty() ) {
+			break;
+		}
+		auto face = move( faces.front() );
+		faces.pop_front();
+		lock.unlock();
+
+		glTexSubImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face.first, 0, 0, 0, size, size, GL_RGB, GL_FLOAT, face.second.data() );
+	}
+	producer.join();
+
+	if( error ) {
+		rethrow_exception( error );
+	}
+	if( format.isMipmap() ) {
+		glGenerateMipmap( GL_TEXTURE_CUBE_MAP );
+	}
+
+	return cubeMap;
+}
+
+} // namespace renderkit
@@ -0,0 +1,91 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <functional>
+
+#include "cinder/DataSource.h"
+#include "cinder/ImageIo.h"
+#include "cinder/gl/platform.h"
+
+#include "EnvironmentFilter.h"
+
+// Cinder's forward declarations
+namespace cinder { namespace gl {
+typedef std::shared_ptr<class TextureCubeMap>	TextureCubeMapRef;
+} } // namespace cinder::gl
+
+namespace renderkit {
+
+//! Converts equirectangular ( latitude / longitude ) panoramas to cubemaps.
+// The panorama is streamed row by row from the decoder and box-filtered down to the resolution needed by the faces. Radiance .hdr files are read one scanline at a time,
+// so their full resolution float image is never held in memory. Other formats, .exr included, are decoded whole by their Cinder ImageSource before being streamed.
+// Each face is resampled on its own worker thread as soon as the rows it covers have been decoded, and is uploaded as soon as it is ready.
+class EquirectangularConverter {
+public:
+	// forward declaration
+	class Format;
+
+	//! Called from a worker thread with the \a size * \a size RGB float pixels of \a face ( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face order ).
+	using FaceFn = std::function<void( uint8_t face, uint16_t size, const float *data )>;
+
+	class Format {
+	public:
+		//! Constructs a new default EquirectangularConverter Format object
+		Format() : mFaceSize( 512 ), mInternalFormat( GL_RGB16F ), mMipmap( true ), mEdgeFixup( EdgeFixup::NONE ) {}
+
+		//! Sets the output face resolution in pixels. Default to 512.
+		Format& faceSize( uint16_t size ) { mFaceSize = size; return *this; }
+		//! Sets the internal format of the output cubemap. Default to GL_RGB16F.
+		Format& internalFormat( GLenum internalFormat ) { mInternalFormat = internalFormat; return *this; }
+		//! Specifies whether the output cubemap mipmap chain is generated. Enabled by default.
+		Format& mipmap( bool enabled = true ) { mMipmap = enabled; return *this; }
+		//! Sets the edge fixup method applied to the face texel directions. Useful when the cubemap is used as is without rk::EnvironmentFilter. Default to EdgeFixup::NONE.
+		Format& edgeFixup( EdgeFixup fixup ) { mEdgeFixup = fixup; return *this; }
+
+		//! Returns the output face resolution in pixels.
+		uint16_t	getFaceSize() const { return mFaceSize; }
+		//! Returns the internal format of the output cubemap.
+		GLenum		getInternalFormat() const { return mInternalFormat; }
+		//! Returns whether the output cubemap mipmap chain is generated.
+		bool		isMipmap() const { return mMipmap; }
+		//! Returns the edge fixup method.
+		EdgeFixup	getEdgeFixup() const { return mEdgeFixup; }
+
+	protected:
+		uint16_t	mFaceSize;
+		GLenum		mInternalFormat;
+		bool		mMipmap;
+		EdgeFixup	mEdgeFixup;
+	};
+
+	//! Decodes the equirectangular .hdr / .exr image in \a source and returns a cubemap. .hdr files are decoded scanline by scanline. Faces are uploaded on the calling thread, which needs a GL context.
+	static ci::gl::TextureCubeMapRef convert( const ci::DataSourceRef &source, const Format &format = Format() );
+	//! Decodes the equirectangular image in \a source and calls \a faceFn as soon as each face is resampled. Only bounds memory if \a source decodes its rows in load(). Blocks until every face is done. Doesn't require a GL context.
+	static void convert( const ci::ImageSourceRef &source, uint16_t faceSize, const FaceFn &faceFn, EdgeFixup fixup = EdgeFixup::NONE );
+};
+
+} // namespace renderkit
@@ -23,30 +23,521 @@
  */
 
 #include "EnvironmentFilter.h"
+#include "Compute.h"
+#include "Assets.h"
+#include "Profiler.h"
 
 #include "cinder/FileWatcher.h"
+#include "cinder/Noncopyable.h"
 
 #include "cinder/Log.h"
 #include "cinder/app/App.h"
 #include "cinder/gl/Texture.h"
-#include "cinder/gl/Fbo.h"
+#include "cinder/gl/BufferObj.h"
 #include "cinder/gl/GlslProg.h"
 #include "cinder/gl/scoped.h"
 #include "cinder/gl/draw.h"
+#include "cinder/gl/wrapper.h"
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
 
 using namespace ci;
 using namespace std;
 
 namespace renderkit {
 
+// bare framebuffer object the filtered faces are attached to, gl::Fbo refuses to be created without any attachment
+class FilterFramebuffer : private ci::Noncopyable {
+public:
+	FilterFramebuffer()
+	{
+		glGenFramebuffers( 1, &mId );
+		gl::ScopedFramebuffer scopedFramebuffer( GL_FRAMEBUFFER, mId );
+		GLenum drawBuffer = GL_COLOR_ATTACHMENT0;
+		glDrawBuffers( 1, &drawBuffer );
+	}
+	~FilterFramebuffer()
+	{
+		glDeleteFramebuffers( 1, &mId );
+	}
+	GLuint getId() const { return mId; }
+protected:
+	GLuint mId;
+};
+
+namespace {
+	const int		sDirtyGridSize	= 8;
+	const uint64_t	sAllCells		= ~0ull;
+
+	// directions of the centers of the dirty cells and the largest angle between a cell center and its corners
+	struct DirtyGrid {
+		DirtyGrid() : mCellRadius( 0.0f )
+		{
+			for( uint8_t face = 0; face < 6; ++face ) {
+				for( int y = 0; y < sDirtyGridSize; ++y ) {
+					for( int x = 0; x < sDirtyGridSize; ++x ) {
+						vec3 center = EnvironmentFilterBase::texelToDirection( face, x, y, sDirtyGridSize );
+						mCenters[face][y * sDirtyGridSize + x] = center;
+						for( int corner = 0; corner < 4; ++corner ) {
+							vec3 dir = EnvironmentFilterBase::texelToDirection( face, x + ( corner & 1 ) - 0.5f, y + ( corner >> 1 ) - 0.5f, sDirtyGridSize );
+							mCellRadius = std::max( mCellRadius, acos( glm::clamp( glm::dot( center, dir ), -1.0f, 1.0f ) ) );
+						}
+					}
+				}
+			}
+		}
+
+		vec3	mCenters[6][sDirtyGridSize * sDirtyGridSize];
+		float	mCellRadius;
+	};
+
+	const DirtyGrid& getDirtyGrid()
+	{
+		static DirtyGrid sGrid;
+		return sGrid;
+	}
+
+	// Render targets and programs shared by every filter. The pools only keep weak references, resources are released with the last filter using them
+	std::weak_ptr<FilterFramebuffer>												sFilterFramebuffer;
+	std::map<size_t, std::weak_ptr<gl::BufferObj>>									sTransferBuffers;
+	std::weak_ptr<ComputeShader>													sComputeShader;
+
+	template<typename Key, typename T, typename CreateFn>
+	std::shared_ptr<T> acquire( std::map<Key, std::weak_ptr<T>> &pool, const Key &key, const CreateFn &create )
+	{
+		auto resource = pool[key].lock();
+		if( ! resource ) {
+			resource = create();
+			pool[key] = resource;
+		}
+		return resource;
+	}
+
+	gl::TextureCubeMapRef createRadianceMap( GLint size, GLenum internalFormat, uint8_t numMips )
+	{
+		auto textureFormat = gl::TextureCubeMap::Format().internalFormat( internalFormat ).mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR ).immutableStorage().wrap( GL_CLAMP_TO_EDGE );
+		textureFormat.setMaxMipmapLevel( numMips - 1 );
+		return gl::TextureCubeMap::create( size, size, textureFormat );
+	}
+
+	// the faces are attached when filtering, the framebuffer itself doesn't own any texture and can be shared by every filter
+	FilterFramebufferRef acquireFilterFramebuffer()
+	{
+		auto framebuffer = sFilterFramebuffer.lock();
+		if( ! framebuffer ) {
+			framebuffer = make_shared<FilterFramebuffer>();
+			sFilterFramebuffer = framebuffer;
+		}
+		return framebuffer;
+	}
+
+	float radicalInverse( uint32_t bits )
+	{
+		bits = ( bits << 16u ) | ( bits >> 16u );
+		bits = ( ( bits & 0x55555555u ) << 1u ) | ( ( bits & 0xAAAAAAAAu ) >> 1u );
+		bits = ( ( bits & 0x33333333u ) << 2u ) | ( ( bits & 0xCCCCCCCCu ) >> 2u );
+		bits = ( ( bits & 0x0F0F0F0Fu ) << 4u ) | ( ( bits & 0xF0F0F0F0u ) >> 4u );
+		bits = ( ( bits & 0x00FF00FFu ) << 8u ) | ( ( bits & 0xFF00FF00u ) >> 8u );
+		return float( bits ) * 2.3283064365386963e-10f;
+	}
+
+	// Returns the angle from the normal under which \a coverage of the \a numSamples hammersley / GGX samples of \a roughness lie. Same sampling as the filter shaders
+	float calcGgxLobeAngle( float roughness, uint32_t numSamples, float coverage )
+	{
+		if( roughness <= 0.0f || ! numSamples ) {
+			return 0.0f;
+		}
+
+		// L = reflect( -N, H ) is 2 * thetaH away from the normal
+		float a = roughness * roughness;
+		vector<float> angles;
+		angles.reserve( numSamples );
+		for( uint32_t i = 0; i < numSamples; ++i ) {
+			float xi		= radicalInverse( i );
+			float cosTheta	= sqrt( ( 1.0f - xi ) / ( 1.0f + ( a * a - 1.0f ) * xi ) );
+			float angle		= 2.0f * acos( glm::clamp( cosTheta, 0.0f, 1.0f ) );
+			// samples under the horizon are discarded by the filter
+			if( angle < float( M_PI ) * 0.5f ) {
+				angles.push_back( angle );
+			}
+		}
+		if( angles.empty() ) {
+			return 0.0f;
+		}
+
+		size_t index = (size_t) ceil( glm::clamp( coverage, 0.0f, 1.0f ) * float( angles.size() ) );
+		index = glm::clamp<size_t>( index, 1, angles.size() ) - 1;
+		nth_element( angles.begin(), angles.begin() + index, angles.end() );
+		return angles[index];
+	}
+
+	// Binary searches the number of samples of each mip, in order since a mip only depends on the previous ones. The error is assumed to decrease with the number of samples.
+	template<typename FilterT>
+	vector<uint16_t> calibrateSampleCounts( const gl::TextureCubeMapRef &envMap, float maxRmse, const typename FilterT::Format &format, uint16_t referenceSamples )
+	{
+		auto reference		= FilterT::create( envMap, typename FilterT::Format( format ).samples( vector<uint16_t>{ 1, referenceSamples } ) );
+		auto referenceMap	= reference->getPmRadianceEnvMap();
+		uint8_t numMips		= reference->getNumMips();
+		if( ! numMips ) {
+			return {};
+		}
+		// every count would give the same error, the search would settle on a single sample everywhere
+		if( ! reference->hasSampleCounts() ) {
+			CI_LOG_W( "EnvironmentFilter: The filter program ignores the per mip sample counts, can't calibrate" );
+			return {};
+		}
+
+		// the mips that aren't calibrated yet use the reference count
+		vector<uint16_t> schedule( numMips, referenceSamples );
+		schedule[0] = 1;
+		for( uint8_t level = 1; level < numMips; ++level ) {
+			uint16_t low = 1, high = std::max<uint16_t>( 1, format.getNumSamples() );
+			while( low < high ) {
+				uint16_t count	= low + ( high - low ) / 2;
+				schedule[level]	= count;
+				auto filter		= FilterT::create( envMap, typename FilterT::Format( format ).samples( schedule ) );
+				auto rmse		= EnvironmentFilterBase::calcRmse( filter->getPmRadianceEnvMap(), referenceMap, level + 1 );
+				if( rmse.size() > level && rmse[level] <= maxRmse ) {
+					high = count;
+				}
+				else {
+					low = count + 1;
+				}
+			}
+			schedule[level] = low;
+		}
+		return schedule;
+	}
+} // anonymous namespace
+
 EnvironmentFilterBase::EnvironmentFilterBase( const Format &format )
 : mFaceSize( format.getFaceSize() ),
+mNumSamples( format.getNumSamples() ),
+mSampleSchedule( format.getSampleSchedule() ),
+mAutoSamplesQuality( format.getAutoSamplesQuality() ),
+mFilteredSampling( format.isFilteredSampling() || format.getEdgeFixup() == EdgeFixup::WARP ),
 mNumMips( format.getNumMips() ),
+mEdgeFixup( format.getEdgeFixup() ),
+mInternalFormat( format.getInternalFormat() ),
+mRelightCoverage( format.getRelightCoverage() ),
 mGammaInput( format.getGammaInput() ),
 mGammaOutput( format.getGammaOutput() ),
-mEdgeFixup( format.getEdgeFixup() )
+mIsFiltered( false )
+{
+}
+
+std::vector<EnvironmentFilterBase::DirtyCells> EnvironmentFilterBase::calcDirtyCells( uint8_t dirtyFaces, int faceSize ) const
+{
+	vector<DirtyCells> cells( mNumMips );
+
+	// the first mip is a straight copy of the input
+	for( uint8_t face = 0; face < 6; ++face ) {
+		cells[0][face] = ( dirtyFaces & ( 1 << face ) ) ? sAllCells : 0;
+	}
+
+	// every other mip samples the previous one, a texel is dirty if its lobe reaches a dirty texel
+	for( uint8_t level = 1; level < mNumMips; ++level ) {
+		if( mFilteredSampling ) {
+			// the mips sample the input directly, the prefiltered texels read by the samples are bounded by about twice the texels of the mip
+			float footprint	= 4.0f * float( M_SQRT2 ) / float( std::max( 1, faceSize >> level ) );
+			cells[level]	= propagateDirtyCells( cells[0], calcLobeAngle( level ) + footprint );
+			continue;
+		}
+		int sourceSize		= std::max( 1, faceSize >> ( level - 1 ) );
+		// bilinear footprint of a source texel, a texel spans about 2 / size radians at the center of a face
+		float footprint		= 2.0f * float( M_SQRT2 ) / float( sourceSize );
+		cells[level]		= propagateDirtyCells( cells[level - 1], calcLobeAngle( level ) + footprint );
+	}
+	return cells;
+}
+
+float EnvironmentFilterBase::calcLobeAngle( uint8_t level ) const
+{
+	float roughness = mNumMips > 1 ? float( level ) / float( mNumMips - 1 ) : 0.0f;
+	return calcGgxLobeAngle( roughness, getNumSamples( level ), mRelightCoverage );
+}
+
+void EnvironmentFilterBase::checkFilteredSampling()
+{
+	if( ! mFilteredSampling || mEnvMap->hasMipmapping() ) {
+		return;
+	}
+	// warped mips can't be sampled with the unwarped lookup directions, the warp always reads the input even without a chain to pick levels from
+	if( mEdgeFixup == EdgeFixup::WARP ) {
+		CI_LOG_W( "EnvironmentFilter: EdgeFixup::WARP samples the input for every mip and the input isn't mipmapped, rough mips need more samples" );
+	}
+	else {
+		CI_LOG_W( "EnvironmentFilter: Filtered sampling requires a mipmapped input, sampling the previous mips instead" );
+		mFilteredSampling = false;
+	}
+}
+
+void EnvironmentFilterBase::initializeSampleCounts( uint16_t faceSize )
 {
+	if( ! mSampleSchedule.empty() ) {
+		mSampleCounts.resize( mNumMips );
+		for( uint8_t level = 0; level < mNumMips; ++level ) {
+			mSampleCounts[level] = std::max<uint16_t>( 1, mSampleSchedule[std::min<size_t>( level, mSampleSchedule.size() - 1 )] );
+		}
+	}
+	else if( mAutoSamplesQuality > 0.0f ) {
+		mSampleCounts = calcAutoSamples( faceSize, mNumMips, mNumSamples, mAutoSamplesQuality, mFilteredSampling );
+	}
+	else {
+		mSampleCounts.assign( mNumMips, mNumSamples );
+	}
+
+	// the first mip is a straight copy of the input
+	if( ! mSampleCounts.empty() ) {
+		mSampleCounts[0] = 1;
+	}
+}
+
+uint64_t EnvironmentFilterBase::calcFilterCost() const
+{
+	uint64_t cost = 0;
+	int faceSize = mRadianceMap ? mRadianceMap->getWidth() : ( mSharedExponentMap ? mSharedExponentMap->getWidth() : mFaceSize );
+	for( uint8_t level = 0; level < mNumMips; ++level ) {
+		uint64_t size = std::max( 1, faceSize >> level );
+		cost += size * size * 6 * getNumSamples( level );
+	}
+	return cost;
+}
+
+std::vector<uint16_t> EnvironmentFilterBase::calcAutoSamples( uint16_t faceSize, uint8_t numMips, uint16_t maxSamples, float quality, bool filteredSampling )
+{
+	vector<uint16_t> counts( std::max<uint8_t>( numMips, 1 ), 1 );
+	for( uint8_t level = 1; level < numMips; ++level ) {
+		float roughness		= float( level ) / float( numMips - 1 );
+		float lobeAngle		= calcGgxLobeAngle( roughness, 256, 0.9f );
+		float lobeSolidAngle	= 2.0f * float( M_PI ) * ( 1.0f - cos( lobeAngle ) );
+		int sourceSize		= std::max( 1, faceSize >> ( level - 1 ) );
+		float texelSolidAngle	= 4.0f * float( M_PI ) / ( 6.0f * sourceSize * sourceSize );
+
+		// a bilinear tap covers about 2x2 source texels, the lobe needs enough of them not to skip any texel.
+		// Glossy mips have a narrow lobe, rough mips sample a small source, both need far fewer samples than the middle of the chain
+		float numSamples	= quality * lobeSolidAngle / ( 4.0f * texelSolidAngle );
+		// with filtered sampling every sample already integrates its share of the lobe, only the noise of the estimate is left
+		if( filteredSampling ) {
+			numSamples		= std::min( numSamples, quality * 64.0f );
+		}
+		counts[level]		= (uint16_t) glm::clamp( ceil( numSamples ), 1.0f, (float) std::max<uint16_t>( 1, maxSamples ) );
+	}
+	return counts;
+}
+
+std::vector<float> EnvironmentFilterBase::calcRmse( const ci::gl::TextureCubeMapRef &radianceMap, const ci::gl::TextureCubeMapRef &reference, uint8_t numMips )
+{
+	vector<float> rmse;
+	if( ! radianceMap || ! reference || radianceMap->getWidth() != reference->getWidth() ) {
+		CI_LOG_W( "EnvironmentFilterBase: Can't compare cubemaps of different sizes" );
+		return rmse;
+	}
+
+	// images written by a compute shader need to be visible to the pixel transfer
+	gl::memoryBarrier( GL_TEXTURE_UPDATE_BARRIER_BIT );
+	vector<float> pixels, referencePixels;
+	for( uint8_t level = 0; level < numMips; ++level ) {
+		GLint size = std::max( 1, radianceMap->getWidth() >> level );
+		pixels.resize( (size_t) size * size * 4 );
+		referencePixels.resize( pixels.size() );
+
+		double sum = 0.0;
+		for( GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X; face < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++face ) {
+			{
+				gl::ScopedTextureBind scopedTex( radianceMap );
+				glGetTexImage( face, level, GL_RGBA, GL_FLOAT, pixels.data() );
+			}
+			{
+				gl::ScopedTextureBind scopedTex( reference );
+				glGetTexImage( face, level, GL_RGBA, GL_FLOAT, referencePixels.data() );
+			}
+			for( size_t i = 0; i < pixels.size(); i += 4 ) {
+				for( size_t c = 0; c < 3; ++c ) {
+					double diff = pixels[i + c] - referencePixels[i + c];
+					sum += diff * diff;
+				}
+			}
+		}
+		rmse.push_back( (float) sqrt( sum / ( 6.0 * size * size * 3.0 ) ) );
+	}
+	return rmse;
+}
+
+EnvironmentFilterBase::DirtyCells EnvironmentFilterBase::propagateDirtyCells( const DirtyCells &cells, float angle )
+{
+	const auto &grid = getDirtyGrid();
+	const int numCells = sDirtyGridSize * sDirtyGridSize;
+	// both cells are bounded by their radius, compare the centers with the sum of the three angles
+	float maxAngle = angle + 2.0f * grid.mCellRadius;
+	if( maxAngle >= float( M_PI ) ) {
+		bool anyDirty = false;
+		for( auto faceCells : cells ) anyDirty |= faceCells != 0;
+		DirtyCells result;
+		result.fill( anyDirty ? sAllCells : 0 );
+		return result;
+	}
+
+	float cosMaxAngle = cos( maxAngle );
+	DirtyCells result = {};
+	for( uint8_t face = 0; face < 6; ++face ) {
+		if( ! cells[face] ) {
+			continue;
+		}
+		for( int cell = 0; cell < numCells; ++cell ) {
+			if( ! ( cells[face] & ( 1ull << cell ) ) ) {
+				continue;
+			}
+			const vec3 &center = grid.mCenters[face][cell];
+			for( uint8_t target = 0; target < 6; ++target ) {
+				if( result[target] == sAllCells ) {
+					continue;
+				}
+				for( int targetCell = 0; targetCell < numCells; ++targetCell ) {
+					if( glm::dot( center, grid.mCenters[target][targetCell] ) >= cosMaxAngle ) {
+						result[target] |= 1ull << targetCell;
+					}
+				}
+			}
+		}
+	}
+	return result;
+}
+
+ci::Area EnvironmentFilterBase::calcDirtyArea( uint64_t cells, int faceSize )
+{
+	int minX = sDirtyGridSize, minY = sDirtyGridSize, maxX = -1, maxY = -1;
+	for( int cell = 0; cell < sDirtyGridSize * sDirtyGridSize; ++cell ) {
+		if( cells & ( 1ull << cell ) ) {
+			int x = cell % sDirtyGridSize, y = cell / sDirtyGridSize;
+			minX = std::min( minX, x );
+			minY = std::min( minY, y );
+			maxX = std::max( maxX, x );
+			maxY = std::max( maxY, y );
+		}
+	}
+	if( maxX < 0 ) {
+		return Area( 0, 0, 0, 0 );
+	}
+	// cells don't align with the texels of the small mips, round outward
+	return Area( minX * faceSize / sDirtyGridSize, minY * faceSize / sDirtyGridSize,
+				( ( maxX + 1 ) * faceSize + sDirtyGridSize - 1 ) / sDirtyGridSize, ( ( maxY + 1 ) * faceSize + sDirtyGridSize - 1 ) / sDirtyGridSize );
+}
+
+uint8_t EnvironmentFilterBase::getBytesPerTexel( GLenum internalFormat )
+{
+	switch( internalFormat ) {
+		case GL_RGBA32F:			return 16;
+		case GL_RGB32F:				return 12;
+		case GL_RGBA16F:			return 8;
+		case GL_RGB16F:				return 6;
+		case GL_R11F_G11F_B10F:
+		case GL_RGB9_E5:
+		case GL_RGBA8:
+		case GL_SRGB8_ALPHA8:
+		case GL_RG16F:
+		case GL_DEPTH_COMPONENT24:
+		case GL_DEPTH_COMPONENT32F:	return 4;
+		default:					return 0;
+	}
+}
+
+size_t EnvironmentFilterBase::calcCubeMapBytes( uint16_t faceSize, uint8_t numMips, GLenum internalFormat )
+{
+	size_t bytes = 0;
+	for( uint8_t level = 0; level < std::max<uint8_t>( numMips, 1 ); ++level ) {
+		size_t size = std::max( 1, faceSize >> level );
+		bytes += size * size * 6;
+	}
+	return bytes * getBytesPerTexel( internalFormat );
+}
+
+void EnvironmentFilterBase::convertToSharedExponent( const ci::gl::TextureCubeMapRef &source )
+{
+	const GLint size = source->getWidth();
+	if( ! mSharedExponentMap || mSharedExponentMap->getWidth() != size ) {
+		auto textureFormat = gl::TextureCubeMap::Format().internalFormat( GL_RGB9_E5 ).mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR ).immutableStorage().wrap( GL_CLAMP_TO_EDGE );
+		textureFormat.setMaxMipmapLevel( mNumMips - 1 );
+		mSharedExponentMap = gl::TextureCubeMap::create( size, size, textureFormat );
+	}
+
+	ScopedGpuTimer scopedTimer( "EnvironmentFilter::convertToSharedExponent" );
+
+	// the whole chain is packed in a single buffer, tightly, one face after the other. The pack does the conversion,
+	// the buffer holds the final 5_9_9_9 texels and is no bigger than the shared exponent map itself
+	size_t bytes = calcCubeMapBytes( size, mNumMips, GL_RGB9_E5 );
+	if( ! mTransferBuffer || (size_t) mTransferBuffer->getSize() < bytes ) {
+		mTransferBuffer = acquire( sTransferBuffers, bytes, [bytes] { return gl::BufferObj::create( GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_COPY ); } );
+	}
+
+	// images written by a compute shader need to be visible to the pixel transfer
+	gl::memoryBarrier( GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT );
+	{
+		gl::ScopedBuffer scopedBuffer( GL_PIXEL_PACK_BUFFER, mTransferBuffer->getId() );
+		gl::ScopedTextureBind scopedTex( source );
+		size_t offset = 0;
+		for( int level = 0; level < mNumMips; level++ ) {
+			GLint levelSize = std::max( 1, size >> level );
+			for( GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X; face < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++face ) {
+				glGetTexImage( face, level, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, reinterpret_cast<void*>( offset ) );
+				offset += (size_t) levelSize * levelSize * sizeof( uint32_t );
+			}
+		}
+	}
+	{
+		gl::ScopedBuffer scopedBuffer( GL_PIXEL_UNPACK_BUFFER, mTransferBuffer->getId() );
+		gl::ScopedTextureBind scopedTex( mSharedExponentMap );
+		size_t offset = 0;
+		for( int level = 0; level < mNumMips; level++ ) {
+			GLint levelSize = std::max( 1, size >> level );
+			for( GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X; face < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++face ) {
+				glTexSubImage2D( face, level, 0, 0, levelSize, levelSize, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, reinterpret_cast<const void*>( offset ) );
+				offset += (size_t) levelSize * levelSize * sizeof( uint32_t );
+			}
+		}
+	}
+
+	// the half float chain and the transfer buffer are only needed while filtering, the chain is released with the conversion
+	// and the transfer buffer once every filter of the same size is done. acquireWorkingMap allocates a new chain for the next refresh
+	if( source == mRadianceMap ) {
+		mRadianceMap.reset();
+	}
+	mTransferBuffer.reset();
+}
+
+void EnvironmentFilterBase::acquireWorkingMap()
+{
+	// the shared exponent map keeps the size and mip count of the chain it was converted from. The chain belongs to this filter
+	// until its last mip is converted, a filter spread over several frames reads the mips of the previous calls
+	mRadianceMap = createRadianceMap( mSharedExponentMap->getWidth(), GL_RGBA16F, mNumMips );
+}
+
+ci::vec3 EnvironmentFilterBase::texelToDirection( uint8_t face, float x, float y, uint16_t faceSize, EdgeFixup fixup )
+{
+	float u = 2.0f * ( x + 0.5f ) / float( faceSize ) - 1.0f;
+	float v = 2.0f * ( y + 0.5f ) / float( faceSize ) - 1.0f;
+	if( fixup == EdgeFixup::STRETCH ) {
+		float stretch = calcStretchFactor( faceSize );
+		u *= stretch;
+		v *= stretch;
+	}
+	else if( fixup == EdgeFixup::WARP ) {
+		float warp = calcWarpFactor( faceSize );
+		u += warp * u * u * u;
+		v += warp * v * v * v;
+	}
+
+	switch( face ) {
+		case 0: return glm::normalize( vec3( 1.0f, -v, -u ) );
+		case 1: return glm::normalize( vec3( -1.0f, -v, u ) );
+		case 2: return glm::normalize( vec3( u, 1.0f, v ) );
+		case 3: return glm::normalize( vec3( u, -1.0f, -v ) );
+		case 4: return glm::normalize( vec3( u, -v, 1.0f ) );
+		default: return glm::normalize( vec3( -u, -v, -1.0f ) );
+	}
 }
 
 EnvironmentFilterRef EnvironmentFilter::create( const Format &format )
@@ -79,15 +570,18 @@ EnvironmentFilter::EnvironmentFilter( const ci::gl::TextureCubeMapRef &envMap, c
 
 ci::gl::TextureCubeMapRef EnvironmentFilter::getPmRadianceEnvMap() const
 {
-	if( mFilterFbo ) {
-		return static_pointer_cast<gl::TextureCubeMap>( mFilterFbo->getTextureBase( GL_COLOR_ATTACHMENT0 ) );
+	if( mSharedExponentMap ) {
+		return mSharedExponentMap;
+	}
+	else if( mRadianceMap ) {
+		return mRadianceMap;
 	}
 	else {
 		return nullptr;
 	}
 }
 
-void EnvironmentFilter::filter()
+void EnvironmentFilter::filterLevels( uint8_t dirtyFaces, uint8_t firstLevel, uint8_t numLevels )
 {
 	// skip if no env map
 	if( ! mEnvMap ) {
@@ -95,19 +589,47 @@ void EnvironmentFilter::filter()
 		return;
 	}
 
-	// create the radiance texture and framebuffer
-	if( ! mFilterFbo ) {
+	if( ! mGlslProg ) {
+		CI_LOG_W( "EnvironmentFilter: No filter program" );
+		return;
+	}
+
+	// create the radiance texture and framebuffer. A new half float chain has undefined contents, the mips before firstLevel are filtered again
+	if( ! mFilterFramebuffer ) {
 		initializeRenderTargets();
 	}
+	else if( ! mRadianceMap ) {
+		acquireWorkingMap();
+		numLevels	= (uint8_t) std::min( 0xFF, firstLevel + numLevels );
+		firstLevel	= 0;
+	}
 
+	// the whole chain has to be valid before it can be partially updated, the half float chain of GL_RGB9_E5 maps is reallocated by every refresh and never is
+	if( ! mIsFiltered || mInternalFormat == GL_RGB9_E5 ) {
+		dirtyFaces = 0x3F;
+	}
+	auto dirtyCells = calcDirtyCells( dirtyFaces, mRadianceMap->getWidth() );
+	int lastLevel	= std::min<int>( mNumMips, firstLevel + numLevels );
+
+	ScopedGpuTimer scopedTimer( "EnvironmentFilter::filterLevels" );
 	gl::ScopedMatrices scopedMatrices;
 	gl::ScopedGlslProg shaderScp( mGlslProg );
-	gl::ScopedFramebuffer framebufferScp( mFilterFbo );
+	gl::ScopedFramebuffer framebufferScp( GL_FRAMEBUFFER, mFilterFramebuffer->getId() );
 	gl::ScopedDepth scopedDepth( false );
 	gl::ScopedBlend scopedBlend( false );
+	gl::ScopedState scopedSeamless( GL_TEXTURE_CUBE_MAP_SEAMLESS, true );
 	
-	auto filterTexture = mFilterFbo->getTextureBase( GL_COLOR_ATTACHMENT0 );
+	const auto &filterTexture = mRadianceMap;
 	mGlslProg->uniform( "uMaxMip", (float) mNumMips - 1 );
+	mGlslProg->uniform( "uFilteredSampling", (int) mFilteredSampling );
+	mGlslProg->uniform( "uSourceSize", (float) mEnvMap->getWidth() );
+	bool hasNumSamples = hasSampleCounts();
+
+	// filtered sampling reads the input chain, which has to match the faces captured since the last filter
+	if( mFilteredSampling && mEnvMap->hasMipmapping() ) {
+		gl::ScopedTextureBind scopedTex( mEnvMap );
+		glGenerateMipmap( GL_TEXTURE_CUBE_MAP );
+	}
 	//mGlslProg->uniform( "uGammaIn", vec3( mGammaInput ) );
 	//mGlslProg->uniform( "uGammaOut", vec3( mGammaOutput ) );
 
@@ -115,17 +637,33 @@ void EnvironmentFilter::filter()
 	auto eyePos = vec3( 0 );
 	CameraPersp cam;
 	static const vec3 viewDirs[6] = { vec3( 1, 0, 0 ), vec3( -1, 0, 0 ), vec3( 0, 1, 0 ), vec3( 0, -1, 0 ), vec3( 0, 0, 1 ), vec3( 0, 0, -1 ) };
-	for( int level = 0; level < mNumMips; level++ ){
-		gl::ScopedTextureBind texScp( level > 0 ? filterTexture : mEnvMap, 0 );
-		if( level > 0 ) {
+	for( int level = firstLevel; level < lastLevel; level++ ){
+		ScopedGpuTimer mipTimer( "EnvironmentFilter mip", level );
+		bool sampleInput	= level == 0 || mFilteredSampling;
+		gl::ScopedTextureBind texScp( sampleInput ? mEnvMap : filterTexture, 0 );
+		if( ! sampleInput ) {
 			glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, level - 1 );
 			glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, level - 1 );
 		}
-		vec2 size			= gl::Texture2d::calcMipLevelSize( level, mFilterFbo->getWidth(), mFilterFbo->getHeight() );
-		auto proj = ci::CameraPersp( (int)size.x, (int)size.y, 90.0f, 0.1f, 100.0f ).getProjectionMatrix();
+		vec2 size			= gl::Texture2d::calcMipLevelSize( level, mRadianceMap->getWidth(), mRadianceMap->getHeight() );
+		// the warp isn't a projective transform and is applied by the fragment shader, stretch is done with the projection
+		float fov			= mEdgeFixup == EdgeFixup::STRETCH ? glm::degrees( 2.0f * atan( calcStretchFactor( (uint16_t) size.x ) ) ) : 90.0f;
+		auto proj = ci::CameraPersp( (int)size.x, (int)size.y, fov, 0.1f, 100.0f ).getProjectionMatrix();
+		mGlslProg->uniform( "uWarpFactor", mEdgeFixup == EdgeFixup::WARP ? calcWarpFactor( (uint16_t) size.x ) : 0.0f );
+		mGlslProg->uniform( "uSourceLod", 0.0f );
 		mGlslProg->uniform( "uMip", (float) level );
+		if( hasNumSamples ) {
+			mGlslProg->uniform( "uNumSamples", (int) getNumSamples( level ) );
+		}
 		gl::ScopedViewport viewport( vec2( 0 ), vec2( size ) );
 		for( GLenum dir = GL_TEXTURE_CUBE_MAP_POSITIVE_X; dir < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++dir ) {
+			uint64_t cells = dirtyCells[level][dir - GL_TEXTURE_CUBE_MAP_POSITIVE_X];
+			if( ! cells ) {
+				continue;
+			}
+			// texture rows match the framebuffer rows, the dirty area can be used as is
+			Area area = calcDirtyArea( cells, (int) size.x );
+			gl::ScopedScissor scopedScissor( area.getUL(), area.getSize() );
 			glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dir, filterTexture->getId(), level );
 			mat4 view = mat4();
 			cam.lookAt( eyePos, eyePos + viewDirs[dir - GL_TEXTURE_CUBE_MAP_POSITIVE_X] );
@@ -138,31 +676,221 @@ void EnvironmentFilter::filter()
 		}
 	}
 
-	gl::ScopedTextureBind scopedTex( filterTexture );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0 );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mNumMips - 1 );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	// the framebuffer is shared, don't keep a reference to this filter's texture
+	glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, 0 );
+
+	{
+		gl::ScopedTextureBind scopedTex( filterTexture );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0 );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mNumMips - 1 );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	}
+
+	// the chain is complete once its last mip is filtered
+	if( lastLevel == mNumMips ) {
+		if( mInternalFormat == GL_RGB9_E5 ) {
+			convertToSharedExponent( filterTexture );
+		}
+		mIsFiltered = true;
+	}
+}
+
+bool EnvironmentFilter::hasSampleCounts() const
+{
+	return mGlslProg && mGlslProg->getUniformLocation( "uNumSamples" ) >= 0;
+}
+
+std::vector<uint16_t> EnvironmentFilter::calibrateSamples( const ci::gl::TextureCubeMapRef &envMap, float maxRmse, const Format &format, uint16_t referenceSamples )
+{
+	return calibrateSampleCounts<EnvironmentFilter>( envMap, maxRmse, format, referenceSamples );
 }
 
 void EnvironmentFilter::initializeGlslProg( const Format &format )
 {
-	try {
-		mGlslProg = gl::GlslProg::create( app::loadAsset( "glsl/pbr/EnvFilter.vert" ), app::loadAsset( "glsl/pbr/EnvFilter.frag" ) );
+	// the AssetManager caches the program, every filter gets the same instance and the callback is called again when the files change
+	mConnGlsl = assets()->getShader( "glsl/pbr/EnvFilter.vert", "glsl/pbr/EnvFilter.frag", [this]( gl::GlslProgRef glsl ) {
+		if( ! glsl ) {
+			return;
+		}
+		mGlslProg = glsl;
 		mGlslProg->uniform( "uCubeMapTex", 0 );
-	}
-	catch( const gl::GlslProgCompileExc &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+		if( ( ! mSampleSchedule.empty() || mAutoSamplesQuality > 0.0f ) && ! hasSampleCounts() ) {
+			CI_LOG_W( "EnvironmentFilter: EnvFilter.frag doesn't declare uNumSamples, the sample schedule is ignored" );
+		}
+	} );
 }
 
 void EnvironmentFilter::initializeRenderTargets()
 {
+	// shared exponent isn't color renderable, the chain is filtered in half floats and converted once done
+	GLenum internalFormat = mInternalFormat ? mInternalFormat : mEnvMap->getInternalFormat();
+	if( internalFormat == GL_RGB9_E5 ) {
+		internalFormat = GL_RGBA16F;
+	}
+
 	auto textureResolution = min( (GLint) mFaceSize, mEnvMap->getWidth() );
-	auto textureFormat = gl::TextureCubeMap::Format().internalFormat( mEnvMap->getInternalFormat() ).mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR ).immutableStorage().wrap( GL_CLAMP_TO_EDGE );
 	mNumMips = mNumMips == 0 ? (uint8_t)floor( std::log2( textureResolution ) ) : mNumMips;
-	textureFormat.setMaxMipmapLevel( mNumMips - 1 );
-	
-	auto pmremMap = gl::TextureCubeMap::create( textureResolution, textureResolution, textureFormat );
-	mFilterFbo = gl::Fbo::create( textureResolution, textureResolution, gl::Fbo::Format().attachment( GL_COLOR_ATTACHMENT0, pmremMap ) );
+
+	mRadianceMap = createRadianceMap( textureResolution, internalFormat, mNumMips );
+	mFilterFramebuffer = acquireFilterFramebuffer();
+	checkFilteredSampling();
+	initializeSampleCounts( textureResolution );
+}
+
+EnvironmentFilterComputeRef EnvironmentFilterCompute::create( const Format &format )
+{
+	return make_shared<EnvironmentFilterCompute>( format );
+}
+
+EnvironmentFilterComputeRef EnvironmentFilterCompute::create( const ci::gl::TextureCubeMapRef &envMap, const Format &format )
+{
+	return make_shared<EnvironmentFilterCompute>( envMap, format );
+}
+
+EnvironmentFilterCompute::EnvironmentFilterCompute( const Format &format )
+: EnvironmentFilterBase( format )
+{
+	initializeComputeShader( format );
+}
+
+EnvironmentFilterCompute::EnvironmentFilterCompute( const ci::gl::TextureCubeMapRef &envMap, const Format &format )
+: EnvironmentFilterBase( format )
+{
+	mEnvMap = envMap;
+	initializeComputeShader( format );
+	initializeRenderTargets();
+	filter();
+}
+
+void EnvironmentFilterCompute::filterLevels( uint8_t dirtyFaces, uint8_t firstLevel, uint8_t numLevels )
+{
+	// skip if no env map
+	if( ! mEnvMap ) {
+		CI_LOG_W( "EnvironmentFilterCompute: No EnvMap Input texture" );
+		return;
+	}
+	if( ! mComputeShader || ! mComputeShader->getGlsl() ) {
+		CI_LOG_W( "EnvironmentFilterCompute: No compute program" );
+		return;
+	}
+
+	// create the radiance texture. A new half float chain has undefined contents, the mips before firstLevel are filtered again
+	if( ! mRadianceMap && mSharedExponentMap ) {
+		acquireWorkingMap();
+		numLevels	= (uint8_t) std::min( 0xFF, firstLevel + numLevels );
+		firstLevel	= 0;
+	}
+	else if( ! mRadianceMap ) {
+		initializeRenderTargets();
+	}
+
+	// the whole chain has to be valid before it can be partially updated, the half float chain of GL_RGB9_E5 maps is reallocated by every refresh and never is
+	if( ! mIsFiltered || mInternalFormat == GL_RGB9_E5 ) {
+		dirtyFaces = 0x3F;
+	}
+	auto dirtyCells = calcDirtyCells( dirtyFaces, mRadianceMap->getWidth() );
+	int lastLevel	= std::min<int>( mNumMips, firstLevel + numLevels );
+
+	ScopedGpuTimer scopedTimer( "EnvironmentFilterCompute::filterLevels" );
+	const auto &glsl			= mComputeShader->getGlsl();
+	const ivec3 &workGroupSize	= mComputeShader->getWorkGroupSize();
+	gl::ScopedGlslProg shaderScp( glsl );
+	gl::ScopedState scopedSeamless( GL_TEXTURE_CUBE_MAP_SEAMLESS, true );
+	glsl->uniform( "uCubeMapTex", 0 );
+	glsl->uniform( "uMaxMip", (float) mNumMips - 1 );
+	glsl->uniform( "uEdgeFixup", (int) mEdgeFixup );
+	glsl->uniform( "uFilteredSampling", (int) mFilteredSampling );
+	glsl->uniform( "uSourceSize", (float) mEnvMap->getWidth() );
+
+	// filtered sampling reads the input chain, which has to match the faces captured since the last filter
+	if( mFilteredSampling && mEnvMap->hasMipmapping() ) {
+		gl::ScopedTextureBind scopedTex( mEnvMap );
+		glGenerateMipmap( GL_TEXTURE_CUBE_MAP );
+	}
+
+	// every mip is dispatched in the same command stream, the only synchronization needed is
+	// between a mip and the next one that samples it
+	for( int level = firstLevel; level < lastLevel; level++ ) {
+		ScopedGpuTimer mipTimer( "EnvironmentFilterCompute mip", level );
+		gl::ScopedTextureBind texScp( level > 0 && ! mFilteredSampling ? mRadianceMap : mEnvMap, 0 );
+		int size = std::max( 1, mRadianceMap->getWidth() >> level );
+		glsl->uniform( "uMip", (float) level );
+		glsl->uniform( "uSourceLod", level > 0 && ! mFilteredSampling ? (float) ( level - 1 ) : 0.0f );
+		glsl->uniform( "uFaceSize", size );
+		glsl->uniform( "uEdgeFixupFactor", mEdgeFixup == EdgeFixup::WARP ? calcWarpFactor( size ) : calcStretchFactor( size ) );
+		glsl->uniform( "uNumSamples", (int) getNumSamples( level ) );
+		glBindImageTexture( 0, mRadianceMap->getId(), level, GL_TRUE, 0, GL_WRITE_ONLY, mRadianceMap->getInternalFormat() );
+
+		// a fully dirty mip is done in a single dispatch, otherwise only the dirty area of each face is dispatched
+		const auto &cells = dirtyCells[level];
+		if( all_of( cells.begin(), cells.end(), []( uint64_t faceCells ) { return faceCells == ~0ull; } ) ) {
+			glsl->uniform( "uOffset", ivec3( 0 ) );
+			gl::dispatchCompute( ( size + workGroupSize.x - 1 ) / workGroupSize.x, ( size + workGroupSize.y - 1 ) / workGroupSize.y, 6 );
+		}
+		else {
+			for( uint8_t face = 0; face < 6; ++face ) {
+				if( ! cells[face] ) {
+					continue;
+				}
+				Area area = calcDirtyArea( cells[face], size );
+				glsl->uniform( "uOffset", ivec3( area.x1, area.y1, face ) );
+				gl::dispatchCompute( ( area.getWidth() + workGroupSize.x - 1 ) / workGroupSize.x, ( area.getHeight() + workGroupSize.y - 1 ) / workGroupSize.y, 1 );
+			}
+		}
+		gl::memoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT );
+	}
+	glBindImageTexture( 0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, mRadianceMap->getInternalFormat() );
+	// the chain is then sampled, or copied by glCopyImageSubData in EnvironmentManager::pack and EnvironmentSky
+	gl::memoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT );
+
+	// the chain is complete once its last mip is filtered
+	if( lastLevel == mNumMips ) {
+		if( mInternalFormat == GL_RGB9_E5 ) {
+			convertToSharedExponent( mRadianceMap );
+		}
+		mIsFiltered = true;
+	}
+}
+
+std::vector<uint16_t> EnvironmentFilterCompute::calibrateSamples( const ci::gl::TextureCubeMapRef &envMap, float maxRmse, const Format &format, uint16_t referenceSamples )
+{
+	return calibrateSampleCounts<EnvironmentFilterCompute>( envMap, maxRmse, format, referenceSamples );
+}
+
+void EnvironmentFilterCompute::initializeComputeShader( const Format &format )
+{
+	mComputeShader = sComputeShader.lock();
+	if( mComputeShader ) {
+		return;
+	}
+
+	try {
+		mComputeShader = ComputeShader::create( "glsl/pbr/EnvFilter.comp", ivec3( 8, 8, 1 ) );
+		sComputeShader = mComputeShader;
+	}
+	catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+}
+
+void EnvironmentFilterCompute::initializeRenderTargets()
+{
+	// image load/store only supports a subset of the internal formats, fallback to half floats for anything else.
+	// GL_RGB9_E5 can't be written by image stores either, it is filtered in half floats and converted once done
+	GLenum internalFormat = mInternalFormat ? mInternalFormat : mEnvMap->getInternalFormat();
+	if( internalFormat != GL_RGBA32F && internalFormat != GL_RGBA16F && internalFormat != GL_R11F_G11F_B10F ) {
+		if( mInternalFormat && mInternalFormat != GL_RGB9_E5 ) {
+			CI_LOG_W( "EnvironmentFilterCompute: Unsupported internal format, falling back to GL_RGBA16F" );
+		}
+		internalFormat = GL_RGBA16F;
+	}
+
+	auto textureResolution = min( (GLint) mFaceSize, mEnvMap->getWidth() );
+	mNumMips = mNumMips == 0 ? (uint8_t)floor( std::log2( textureResolution ) ) : mNumMips;
+
+	mRadianceMap = createRadianceMap( textureResolution, internalFormat, mNumMips );
+
+	checkFilteredSampling();
+	initializeSampleCounts( textureResolution );
 }
 
 } // namespace renderkit
@@ -26,25 +26,35 @@
 
 #include "cinder/Signals.h"
 #include "cinder/Rect.h"
+#include "cinder/Area.h"
+#include "cinder/Vector.h"
+#include "cinder/gl/platform.h"
 #include <memory>
 #include <deque>
+#include <array>
+#include <vector>
 
 // Cinder's forward declarations
 namespace cinder { namespace gl { 
 typedef std::shared_ptr<class TextureCubeMap>	TextureCubeMapRef;
-typedef std::shared_ptr<class Fbo>				FboRef;
+typedef std::shared_ptr<class BufferObj>		BufferObjRef;
 class GlslProg;
 typedef std::shared_ptr<GlslProg>				GlslProgRef;
 } } // namespace cinder::gl
 
+typedef std::shared_ptr<class ComputeShader> ComputeShaderRef;
+
 namespace renderkit {
 
 // type aliases
 using EnvironmentFilterBaseRef = std::shared_ptr<class EnvironmentFilterBase>;
 using EnvironmentFilterRef = std::shared_ptr<class EnvironmentFilter>;
 using EnvironmentFilterProgressiveRef = std::shared_ptr<class EnvironmentFilterProgressive>;
+using EnvironmentFilterComputeRef = std::shared_ptr<class EnvironmentFilterCompute>;
+using FilterFramebufferRef = std::shared_ptr<class FilterFramebuffer>;
 
-//! Environment Map Edge fixup methods enum
+//! Environment Map Edge fixup methods enum. Both methods move the texels of the face borders so that adjacent faces sample the same directions along their shared edge.
+// STRETCH scales the face so that the border texel centers lie on the cube edges, WARP only pushes the texels close to the borders with a cubic ( see NVTT's CubeSurface ).
 enum class EdgeFixup { NONE, WARP, STRETCH };
 
 //! Environment Map Filter base class
@@ -53,19 +63,8 @@ public:
 
 	class Format {
 	public:
-		Format() : mFaceSize( 1024 ), mNumSamples( 1024 ), mNumMips( 7 ), mGammaInput( 1.0f ), mGammaOutput( 1.0f ), mEdgeFixup( EdgeFixup::WARP ) {}
+		Format() : mFaceSize( 1024 ), mNumSamples( 1024 ), mNumMips( 7 ), mGammaInput( 1.0f ), mGammaOutput( 1.0f ), mEdgeFixup( EdgeFixup::NONE ), mInternalFormat( 0 ), mRelightCoverage( 0.99f ), mAutoSamplesQuality( 0.0f ), mFilteredSampling( false ) {}
 
-		//! Sets the output face resolution in pixels
-		Format& faceSize( uint16_t size ) { mFaceSize = size; return *this; }
-		//! Sets the number of samples used by the filter
-		Format& samples( uint16_t numSamples ) { mNumSamples = numSamples; return *this; }
-		//! Sets the number of mips desired in the output texture mipmap chain. If not specified will used the usual floor( log2( size ) ) - 1
-		Format& mips( uint8_t numMips ) { mNumMips = numMips; return *this; }
-		//! Filter input should be in linear space; Sets whether the input and/or output needs gamma correction.
-		Format& gamma( float gammaIn, float gammaOut ) { mGammaInput = gammaIn; mGammaOutput = gammaOut; return *this; }
-		//! Sets the edge fixup method.
-		Format& edgeFixup( EdgeFixup fixup ) { mEdgeFixup = fixup; return *this; }
-		
 		//! Returns the output face resolution in pixels
 		uint16_t	getFaceSize() const { return mFaceSize; }
 		//! Returns the number of samples used by the filter
@@ -78,12 +77,53 @@ public:
 		float		getGammaOutput() const { return mGammaOutput; }
 		//! Returns the type of edge fixup method
 		EdgeFixup	getEdgeFixup() const { return mEdgeFixup; }
+		//! Returns the internal format of the output texture, 0 if it matches the input.
+		GLenum		getInternalFormat() const { return mInternalFormat; }
+		//! Returns the fraction of the GGX samples used to propagate dirty regions.
+		float		getRelightCoverage() const { return mRelightCoverage; }
+		//! Returns the explicit number of samples of each mip, empty if not set.
+		const std::vector<uint16_t>& getSampleSchedule() const { return mSampleSchedule; }
+		//! Returns the quality of the automatic sample counts, 0 if disabled.
+		float		getAutoSamplesQuality() const { return mAutoSamplesQuality; }
+		//! Returns whether the mips sample the mipmapped input.
+		bool		isFilteredSampling() const { return mFilteredSampling; }
 
 	protected:
-		EdgeFixup	mEdgeFixup;
 		uint16_t	mFaceSize, mNumSamples; 
 		uint8_t		mNumMips;
 		float		mGammaInput, mGammaOutput;
+		EdgeFixup	mEdgeFixup;
+		GLenum		mInternalFormat;
+		float		mRelightCoverage;
+		std::vector<uint16_t>	mSampleSchedule;
+		float		mAutoSamplesQuality;
+		bool		mFilteredSampling;
+	};
+
+	//! Setters of the Format options. They return the Format of the filter so that chained calls keep its type.
+	template<typename FormatT>
+	class FormatSetters : public Format {
+	public:
+		//! Sets the output face resolution in pixels
+		FormatT& faceSize( uint16_t size ) { mFaceSize = size; return static_cast<FormatT&>( *this ); }
+		//! Sets the number of samples used by the filter
+		FormatT& samples( uint16_t numSamples ) { mNumSamples = numSamples; return static_cast<FormatT&>( *this ); }
+		//! Sets the number of mips desired in the output texture mipmap chain. If not specified will used the usual floor( log2( size ) ) - 1
+		FormatT& mips( uint8_t numMips ) { mNumMips = numMips; return static_cast<FormatT&>( *this ); }
+		//! Filter input should be in linear space; Sets whether the input and/or output needs gamma correction.
+		FormatT& gamma( float gammaIn, float gammaOut ) { mGammaInput = gammaIn; mGammaOutput = gammaOut; return static_cast<FormatT&>( *this ); }
+		//! Sets the edge fixup method. EdgeFixup::WARP implies filteredSampling(), the previous mips being warped. Default to EdgeFixup::NONE.
+		FormatT& edgeFixup( EdgeFixup fixup ) { mEdgeFixup = fixup; return static_cast<FormatT&>( *this ); }
+		//! Sets the internal format of the output texture. GL_RGB9_E5 is filtered in a half float chain owned by the filter until its last mip is converted, which disables partial updates and makes the next filterLevels() start from the first mip. Default to 0, which uses the format of the input.
+		FormatT& internalFormat( GLenum internalFormat ) { mInternalFormat = internalFormat; return static_cast<FormatT&>( *this ); }
+		//! Sets the fraction of the GGX samples of each mip taken into account when propagating dirty regions with filterFaces(). 1.0 is exact, lower values ignore the tail of the lobe and keep the regions smaller. Default to 0.99.
+		FormatT& relightCoverage( float fraction ) { mRelightCoverage = fraction; return static_cast<FormatT&>( *this ); }
+		//! Sets the number of samples of each mip. The first entry is the first mip, which is a copy of the input, mips past the end use the last entry. Overrides samples( uint16_t ) and autoSamples().
+		FormatT& samples( const std::vector<uint16_t> &schedule ) { mSampleSchedule = schedule; return static_cast<FormatT&>( *this ); }
+		//! Derives the number of samples of each mip from its roughness and the resolution it samples, samples( uint16_t ) being the upper bound. A higher \a quality takes more samples, 0 disables it. Disabled by default.
+		FormatT& autoSamples( float quality = 1.0f ) { mAutoSamplesQuality = quality; return static_cast<FormatT&>( *this ); }
+		//! Specifies whether every mip samples the mipmapped input at the level matching the solid angle of each sample instead of the previous mip, which lets rough mips take fewer samples for the same error. samples/EnvironmentFilterBenchmark measures both. Default to false.
+		FormatT& filteredSampling( bool enabled = true ) { mFilteredSampling = enabled; return static_cast<FormatT&>( *this ); }
 	};
 
 	//! Returns the un-filtered environment map. Releases the shared_ptr if filtering is done.
@@ -92,12 +132,41 @@ public:
 	virtual ci::gl::TextureCubeMapRef getPmRadianceEnvMap() const = 0;
 	
 	//! Applies the filter. Called by the constructor if the input texture is specified at initialization.
-	virtual void filter() = 0;
+	virtual void filter() { filterFaces( 0x3F ); }
+	//! Only refilters what depends on the faces in the \a dirtyFaces bitmask ( 1 << face ). The dirty regions are propagated from mip to mip by the footprint of the GGX lobe, each mip only refilters the texels that sample a dirty region of the previous one.
+	void filterFaces( uint8_t dirtyFaces ) { filterLevels( dirtyFaces, 0, 0xFF ); }
+	//! Refilters what depends on the faces in the \a dirtyFaces bitmask in the \a numLevels mips starting at \a firstLevel. The previous mips have to be up to date, which allows spreading a filter over several frames.
+	virtual void filterLevels( uint8_t dirtyFaces, uint8_t firstLevel, uint8_t numLevels ) = 0;
 	//! Sets the input environment map texture
 	virtual void setEnvMap( const ci::gl::TextureCubeMapRef &envMap ) { mEnvMap = envMap; }
 
 	//! Returns the number of level in the output texture mipmap chain. 
 	uint8_t getNumMips() const { return mNumMips; }
+	//! Returns the number of samples taken by each texel of mip \a level. Only known once the output chain is allocated.
+	uint16_t getNumSamples( uint8_t level ) const { return level < mSampleCounts.size() ? mSampleCounts[level] : mNumSamples; }
+	//! Returns the number of texture fetches of a full filter, the sum of the texels of each mip times their number of samples.
+	uint64_t calcFilterCost() const;
+	//! Returns whether the mips sample the mipmapped input.
+	bool isFilteredSampling() const { return mFilteredSampling; }
+	//! Returns whether the filter program takes the number of samples of each mip. When it doesn't, every mip uses the count built in the program.
+	virtual bool hasSampleCounts() const { return true; }
+	//! Returns the edge fixup method.
+	EdgeFixup getEdgeFixup() const { return mEdgeFixup; }
+
+	//! Returns the normalized direction of the texel center ( \a x, \a y ) of \a face for a \a faceSize face. Matches the mapping used by the filter shaders.
+	static ci::vec3 texelToDirection( uint8_t face, float x, float y, uint16_t faceSize, EdgeFixup fixup = EdgeFixup::NONE );
+	//! Returns the scale applied to the face coordinates by EdgeFixup::STRETCH.
+	static float calcStretchFactor( uint16_t faceSize ) { return faceSize > 1 ? float( faceSize ) / float( faceSize - 1 ) : 1.0f; }
+	//! Returns the cubic coefficient applied to the face coordinates by EdgeFixup::WARP.
+	static float calcWarpFactor( uint16_t faceSize ) { return faceSize > 1 ? float( faceSize ) * float( faceSize ) / ( float( faceSize - 1 ) * float( faceSize - 1 ) * float( faceSize - 1 ) ) : 0.0f; }
+	//! Returns the size in bytes of a texel of \a internalFormat. Only covers the formats used for environment maps, returns 0 for anything else.
+	static uint8_t getBytesPerTexel( GLenum internalFormat );
+	//! Returns the size in bytes of a cubemap of \a numMips levels.
+	static size_t calcCubeMapBytes( uint16_t faceSize, uint8_t numMips, GLenum internalFormat );
+	//! Returns the number of samples of each mip derived from its roughness and the solid angle of the texels it samples, capped by \a maxSamples. See Format::autoSamples().
+	static std::vector<uint16_t> calcAutoSamples( uint16_t faceSize, uint8_t numMips, uint16_t maxSamples, float quality, bool filteredSampling = false );
+	//! Returns the RMSE of the RGB channels of each of the first \a numMips mips of \a radianceMap against \a reference. Reads both textures back synchronously, meant for offline measurements.
+	static std::vector<float> calcRmse( const ci::gl::TextureCubeMapRef &radianceMap, const ci::gl::TextureCubeMapRef &reference, uint8_t numMips );
 
     EnvironmentFilterBase( const EnvironmentFilterBase& ) = delete;
     ~EnvironmentFilterBase() = default;
@@ -106,16 +175,51 @@ public:
 protected:
 	EnvironmentFilterBase( const Format &format = Format() );
 
+	//! Dirty cells of each face of a mip, one bit per cell of an 8x8 grid.
+	typedef std::array<uint64_t, 6> DirtyCells;
+
+	//! Returns the dirty cells of every mip of the output chain when \a dirtyFaces of the input changed.
+	std::vector<DirtyCells> calcDirtyCells( uint8_t dirtyFaces, int faceSize ) const;
+	//! Returns the angle between the normal and the directions sampled by mip \a level, ignoring the tail of the lobe past the relight coverage.
+	float calcLobeAngle( uint8_t level ) const;
+	//! Disables filtered sampling when the input has no mip chain to sample, unless it is required by EdgeFixup::WARP.
+	void checkFilteredSampling();
+	//! Resolves the number of samples of every mip once mNumMips and the output size are known.
+	void initializeSampleCounts( uint16_t faceSize );
+	//! Returns the cells closer than \a angle to one of the dirty \a cells.
+	static DirtyCells propagateDirtyCells( const DirtyCells &cells, float angle );
+	//! Returns the texel bounds of the dirty \a cells of a \a faceSize face.
+	static ci::Area calcDirtyArea( uint64_t cells, int faceSize );
+
+	//! Copies the whole mip chain of \a source into mSharedExponentMap without leaving the GPU. The conversion to GL_RGB9_E5 is done by the pixel transfer. Releases the half float chain once converted.
+	void convertToSharedExponent( const ci::gl::TextureCubeMapRef &source );
+	//! Allocates a new half float chain for a GL_RGB9_E5 map before filtering it again. Its contents are undefined.
+	void acquireWorkingMap();
+
 	uint16_t					mFaceSize;
+	uint16_t					mNumSamples;
+	std::vector<uint16_t>		mSampleSchedule;
+	std::vector<uint16_t>		mSampleCounts;
+	float						mAutoSamplesQuality;
+	bool						mFilteredSampling;
 	uint8_t						mNumMips;
 	ci::gl::GlslProgRef			mGlslProg;
 	ci::gl::TextureCubeMapRef	mEnvMap;
-	ci::gl::FboRef				mFilterFbo;
+	ci::gl::TextureCubeMapRef	mRadianceMap;
+	FilterFramebufferRef		mFilterFramebuffer;
+	ci::gl::TextureCubeMapRef	mSharedExponentMap;
+	ci::gl::BufferObjRef		mTransferBuffer;
 	EdgeFixup					mEdgeFixup;
+	GLenum						mInternalFormat;
+	float						mRelightCoverage;
 	float						mGammaInput, mGammaOutput;
+	bool						mIsFiltered;
 };
 
 //! Filters the environment map in one pass. Will stall the GPU until filtered.
+// Every instance shares the same program, through AssetManager so that it live-reloads, and a single framebuffer without attachments the faces are attached to.
+// EdgeFixup::STRETCH is applied with the projection, EdgeFixup::WARP by EnvFilter.frag through "uniform float uWarpFactor".
+// Per mip sample counts are passed as "uniform int uNumSamples" when EnvFilter.frag declares it.
 class EnvironmentFilter : public EnvironmentFilterBase {
 public:
 	class Format;
@@ -125,30 +229,54 @@ public:
 	EnvironmentFilter( const Format &format = Format() );
 	EnvironmentFilter( const ci::gl::TextureCubeMapRef &envMap, const Format &format = Format() );
 
-	class Format : public EnvironmentFilterBase::Format {
-	public:
-		//! Sets the output face resolution in pixels
-		Format& faceSize( uint16_t size ) { mFaceSize = size; return *this; }
-		//! Sets the number of samples used by the filter
-		Format& samples( uint16_t numSamples ) { mNumSamples = numSamples; return *this; }
-		//! Sets the number of mips desired in the output texture. If not specified will used the usual floor( log2( size ) ) - 1
-		Format& mips( uint8_t numMips ) { mNumMips = numMips; return *this; }
-		//! Filter input should be in linear space; Sets whether the input and/or output needs gamma correction.
-		Format& gamma( float gammaIn, float gammaOut ) { mGammaInput = gammaIn; mGammaOutput = gammaOut; return *this; }
-		//! Sets the edge fixup method.
-		Format& edgeFixup( EdgeFixup fixup ) { mEdgeFixup = fixup; return *this; }
-	};
+	class Format : public EnvironmentFilterBase::FormatSetters<Format> {};
 	
 	//! Returns the prefiltered mipmapped radiance environment map. The first split of the EnvBRDF is store for each roughness level in the mipmap chain.
 	virtual ci::gl::TextureCubeMapRef getPmRadianceEnvMap() const;
 	
-	//! Applies the filter. Called by the constructor if the input texture is specified at initialization.
-	virtual void filter();
+	//! Refilters what depends on the faces in the \a dirtyFaces bitmask in the \a numLevels mips starting at \a firstLevel. Dirty regions are restricted with the scissor test.
+	virtual void filterLevels( uint8_t dirtyFaces, uint8_t firstLevel, uint8_t numLevels );
+
+	//! Returns whether EnvFilter.frag declares "uniform int uNumSamples".
+	virtual bool hasSampleCounts() const;
+
+	//! Returns the smallest number of samples of each mip keeping its RMSE against a \a referenceSamples filter of \a envMap under \a maxRmse. Filters \a envMap many times, meant to be run offline and the result passed to Format::samples(). Returns an empty schedule if EnvFilter.frag doesn't declare uNumSamples.
+	static std::vector<uint16_t> calibrateSamples( const ci::gl::TextureCubeMapRef &envMap, float maxRmse, const Format &format = Format(), uint16_t referenceSamples = 4096 );
 
 protected:
 	void initializeGlslProg( const Format &format );
 	void initializeRenderTargets();
-	
+
+	ci::signals::ScopedConnection	mConnGlsl;
+};
+
+//! Filters the environment map with compute shaders. All the faces of a mip are written by a single dispatch using image load/store and the whole mip chain is filtered in one command stream, without any framebuffer.
+// Every instance shares the same compute program.
+class EnvironmentFilterCompute : public EnvironmentFilterBase {
+public:
+	class Format;
+
+	static EnvironmentFilterComputeRef create( const Format &format = Format() );
+	static EnvironmentFilterComputeRef create( const ci::gl::TextureCubeMapRef &envMap, const Format &format = Format() );
+	EnvironmentFilterCompute( const Format &format = Format() );
+	EnvironmentFilterCompute( const ci::gl::TextureCubeMapRef &envMap, const Format &format = Format() );
+
+	class Format : public EnvironmentFilterBase::FormatSetters<Format> {};
+
+	//! Returns the prefiltered mipmapped radiance environment map. The first split of the EnvBRDF is store for each roughness level in the mipmap chain.
+	virtual ci::gl::TextureCubeMapRef getPmRadianceEnvMap() const { return mSharedExponentMap ? mSharedExponentMap : mRadianceMap; }
+
+	//! Refilters what depends on the faces in the \a dirtyFaces bitmask in the \a numLevels mips starting at \a firstLevel. Dirty regions are dispatched face by face.
+	virtual void filterLevels( uint8_t dirtyFaces, uint8_t firstLevel, uint8_t numLevels );
+
+	//! Returns the smallest number of samples of each mip keeping its RMSE against a \a referenceSamples filter of \a envMap under \a maxRmse. Filters \a envMap many times, meant to be run offline and the result passed to Format::samples().
+	static std::vector<uint16_t> calibrateSamples( const ci::gl::TextureCubeMapRef &envMap, float maxRmse, const Format &format = Format(), uint16_t referenceSamples = 4096 );
+
+protected:
+	void initializeComputeShader( const Format &format );
+	void initializeRenderTargets();
+
+	ComputeShaderRef			mComputeShader;
 };
 
 } // namespace renderkit
\ No newline at end of file
@@ -0,0 +1,511 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EnvironmentManager.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "cinder/Camera.h"
+#include "cinder/gl/Context.h"
+#include "cinder/gl/Fbo.h"
+#include "cinder/gl/Texture.h"
+#include "cinder/gl/GlslProg.h"
+#include "cinder/gl/Ssbo.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/gl/wrapper.h"
+#include "cinder/Log.h"
+
+#include "Profiler.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+EnvironmentManagerRef EnvironmentManager::create( const Format &format )
+{
+	return make_shared<EnvironmentManager>( format );
+}
+
+EnvironmentManager::EnvironmentManager( const Format &format )
+: mFormat( format ), mFrame( 0 ), mCubeMapArray( 0 ), mCubeMapArrayFormat( 0 ), mCubeMapArraySize( 0 ), mNumMips( 0 ), mIsBindless( false ), mProbeBufferDirty( true )
+{
+#if defined( GL_ARB_bindless_texture )
+	mIsBindless = mFormat.mBindless && gl::isExtensionAvailable( "GL_ARB_bindless_texture" );
+#endif
+	if( mFormat.mBindless && ! mIsBindless ) {
+		CI_LOG_W( "EnvironmentManager: ARB_bindless_texture isn't available, falling back to the cubemap array" );
+	}
+
+	// layers are popped from the back of the list, fill it in reverse order so that the first probe gets the first layer
+	for( int layer = (int) mFormat.mMaxProbes - 1; layer >= 0; --layer ) {
+		mFreeLayers.push_back( layer );
+	}
+}
+
+EnvironmentManager::~EnvironmentManager()
+{
+	for( auto &probe : mProbes ) {
+		makeNonResident( &probe );
+	}
+	if( mCubeMapArray ) {
+		glDeleteTextures( 1, &mCubeMapArray );
+	}
+}
+
+EnvironmentRef EnvironmentManager::add( const Environment::Format &format )
+{
+	if( mFreeLayers.empty() ) {
+		CI_LOG_W( "EnvironmentManager: Maximum number of probes reached (" << mFormat.mMaxProbes << ")" );
+		return nullptr;
+	}
+
+	Probe probe;
+	probe.mEnvironment		= Environment::create( (int16_t) mFormat.mFaceSize, (int16_t) mFormat.mFaceSize, format );
+	probe.mCapturedFaces	= 0;
+	probe.mNextFace			= 0;
+	probe.mDirty			= true;
+	probe.mNeedsFilter		= false;
+	probe.mLastUpdate		= mFrame;
+	probe.mLayer			= mFreeLayers.back();
+	probe.mIsPacked			= false;
+	probe.mPriority			= 0.0f;
+	probe.mView				= 0;
+	probe.mHandle			= 0;
+	mFreeLayers.pop_back();
+	mProbes.push_back( probe );
+	mProbeBufferDirty = true;
+
+	return probe.mEnvironment;
+}
+
+bool EnvironmentManager::add( const EnvironmentRef &environment )
+{
+	if( mFreeLayers.empty() ) {
+		CI_LOG_W( "EnvironmentManager: Maximum number of probes reached (" << mFormat.mMaxProbes << ")" );
+		return false;
+	}
+
+	Probe probe;
+	probe.mEnvironment		= environment;
+	probe.mCapturedFaces	= 0;
+	probe.mNextFace			= 0;
+	probe.mDirty			= false;
+	probe.mNeedsFilter		= false;
+	probe.mLastUpdate		= mFrame;
+	probe.mLayer			= mFreeLayers.back();
+	probe.mIsPacked			= false;
+	probe.mPriority			= 0.0f;
+	probe.mView				= 0;
+	probe.mHandle			= 0;
+	mFreeLayers.pop_back();
+	mProbes.push_back( probe );
+
+	// already filtered, it can be exposed right away
+	auto &added = mProbes.back();
+	if( mFormat.mPacked ) {
+		pack( &added );
+	}
+	makeResident( &added );
+	mProbeBufferDirty = true;
+	return true;
+}
+
+void EnvironmentManager::remove( const EnvironmentRef &probe )
+{
+	auto it = find_if( mProbes.begin(), mProbes.end(), [&probe]( const Probe &p ) { return p.mEnvironment == probe; } );
+	if( it != mProbes.end() ) {
+		makeNonResident( &( *it ) );
+		mFreeLayers.push_back( it->mLayer );
+		mProbes.erase( it );
+		mProbeBufferDirty = true;
+	}
+}
+
+void EnvironmentManager::markDirty( const EnvironmentRef &probe, uint8_t faces )
+{
+	if( auto p = findProbe( probe ) ) {
+		// faces that are still valid are flagged as already captured so that only the dirty ones get recaptured
+		bool inProgress		= p->mDirty || p->mCapturedFaces;
+		p->mCapturedFaces	= ( inProgress ? p->mCapturedFaces : 0x3F ) & ~faces & 0x3F;
+		p->mDirty			= true;
+	}
+}
+
+void EnvironmentManager::markAllDirty()
+{
+	for( auto &probe : mProbes ) {
+		probe.mDirty = true;
+		probe.mCapturedFaces = 0;
+	}
+}
+
+void EnvironmentManager::update( const ci::vec3 &cameraPosition, const DrawFn &drawFn )
+{
+	ScopedCpuTimer scopedTimer( "EnvironmentManager::update" );
+	++mFrame;
+
+	// gather the probes that need work and compute their priority
+	vector<Probe*> queue;
+	for( auto &probe : mProbes ) {
+		bool refresh = mFormat.mStalenessWeight > 0.0f;
+		if( ! probe.mDirty && ! probe.mNeedsFilter && ! probe.mCapturedFaces && ! refresh ) {
+			continue;
+		}
+		float distance	= glm::distance( cameraPosition, probe.mEnvironment->getPosition() );
+		float staleness	= (float) ( mFrame - probe.mLastUpdate );
+		probe.mPriority	= ( 1.0f + mFormat.mStalenessWeight * staleness ) / ( 1.0f + mFormat.mDistanceWeight * distance );
+		queue.push_back( &probe );
+	}
+
+	// probes already being captured come first so they get filtered as soon as possible, then dirty probes, then by priority
+	sort( queue.begin(), queue.end(), []( const Probe *a, const Probe *b ) {
+		bool inProgressA = a->mCapturedFaces != 0, inProgressB = b->mCapturedFaces != 0;
+		if( inProgressA != inProgressB ) return inProgressA;
+		if( a->mDirty != b->mDirty ) return a->mDirty;
+		return a->mPriority > b->mPriority;
+	} );
+
+	// capture faces round-robin within the frame budget
+	uint32_t faceBudget = mFormat.mFacesPerFrame;
+	for( auto probe : queue ) {
+		if( faceBudget == 0 ) {
+			break;
+		}
+		if( probe->mNeedsFilter ) {
+			continue;
+		}
+		while( faceBudget > 0 && probe->mCapturedFaces != 0x3F ) {
+			if( ! ( probe->mCapturedFaces & ( 1 << probe->mNextFace ) ) ) {
+				capture( probe, probe->mNextFace, drawFn );
+				probe->mCapturedFaces |= 1 << probe->mNextFace;
+				--faceBudget;
+			}
+			probe->mNextFace = ( probe->mNextFace + 1 ) % 6;
+		}
+		if( probe->mCapturedFaces == 0x3F ) {
+			probe->mCapturedFaces	= 0;
+			probe->mDirty			= false;
+			probe->mNeedsFilter		= true;
+		}
+	}
+
+	// filter the fully captured probes within the frame budget
+	uint32_t filterBudget = mFormat.mFiltersPerFrame;
+	for( auto probe : queue ) {
+		if( filterBudget == 0 ) {
+			break;
+		}
+		if( ! probe->mNeedsFilter ) {
+			continue;
+		}
+		probe->mEnvironment->update();
+		probe->mNeedsFilter	= false;
+		probe->mLastUpdate	= mFrame;
+		if( mFormat.mPacked ) {
+			pack( probe );
+		}
+		makeResident( probe );
+		--filterBudget;
+	}
+
+	if( mProbeBufferDirty ) {
+		updateProbeBuffer();
+	}
+}
+
+std::vector<EnvironmentRef> EnvironmentManager::getProbes() const
+{
+	vector<EnvironmentRef> probes;
+	for( const auto &probe : mProbes ) {
+		probes.push_back( probe.mEnvironment );
+	}
+	return probes;
+}
+
+int EnvironmentManager::getLayer( const EnvironmentRef &probe ) const
+{
+	auto p = findProbe( probe );
+	return p && p->mIsPacked ? p->mLayer : -1;
+}
+
+size_t EnvironmentManager::getMemoryUsage() const
+{
+	auto calcBytes = []( const gl::TextureCubeMapRef &cubeMap, uint8_t numMips ) -> size_t {
+		return cubeMap ? EnvironmentFilterBase::calcCubeMapBytes( cubeMap->getWidth(), numMips, cubeMap->getInternalFormat() ) : 0;
+	};
+	auto calcFullChain = []( const gl::TextureCubeMapRef &cubeMap ) -> uint8_t {
+		return cubeMap ? (uint8_t) floor( std::log2( cubeMap->getWidth() ) ) + 1 : 0;
+	};
+
+	size_t bytes = 0;
+	for( const auto &probe : mProbes ) {
+		const auto &environment	= probe.mEnvironment;
+		const auto &filter		= environment->getFilter();
+		auto environmentMap		= environment->getEnvironmentMap();
+		auto radianceMap		= environment->getRadianceMap();
+		bytes += calcBytes( environmentMap, calcFullChain( environmentMap ) );
+		bytes += calcBytes( environment->getDepthMap(), 1 );
+		if( radianceMap != environmentMap ) {
+			bytes += calcBytes( radianceMap, filter ? filter->getNumMips() : 1 );
+		}
+	}
+	if( mCubeMapArray ) {
+		bytes += EnvironmentFilterBase::calcCubeMapBytes( mCubeMapArraySize, mNumMips, mCubeMapArrayFormat ) * mFormat.mMaxProbes;
+	}
+	return bytes;
+}
+
+std::string EnvironmentManager::getMemoryReport( const std::vector<uint16_t> &probeCounts ) const
+{
+	static const pair<GLenum, const char*> sFormats[] = {
+		{ GL_RGBA32F, "GL_RGBA32F" }, { GL_RGBA16F, "GL_RGBA16F" }, { GL_R11F_G11F_B10F, "GL_R11F_G11F_B10F" }, { GL_RGB9_E5, "GL_RGB9_E5" }
+	};
+
+	const uint16_t faceSize		= mFormat.mFaceSize;
+	const uint8_t captureMips	= (uint8_t) floor( std::log2( std::max<uint16_t>( faceSize, 1 ) ) ) + 1;
+	const uint8_t radianceMips	= mNumMips ? mNumMips : std::min<uint8_t>( EnvironmentFilterBase::Format().getNumMips(), captureMips );
+	auto toMegabytes = []( size_t bytes ) { return double( bytes ) / ( 1024.0 * 1024.0 ); };
+
+	ostringstream report;
+	report << fixed << setprecision( 2 );
+	report << "EnvironmentManager memory report, " << faceSize << "px faces, " << (int) radianceMips << " radiance mips (MB)" << endl;
+	report << setw( 20 ) << left << "radiance format" << right << setw( 10 ) << "probe" << setw( 10 ) << "refresh";
+	for( auto count : probeCounts ) {
+		report << setw( 10 ) << ( to_string( count ) + "x" );
+	}
+	report << endl;
+
+	for( const auto &format : sFormats ) {
+		// shared exponent maps can't be rendered to, the capture stays in half floats
+		GLenum captureFormat	= format.first == GL_RGB9_E5 ? GL_RGBA16F : format.first;
+		size_t capture			= EnvironmentFilterBase::calcCubeMapBytes( faceSize, captureMips, captureFormat );
+		size_t radiance			= EnvironmentFilterBase::calcCubeMapBytes( faceSize, radianceMips, format.first );
+		size_t probe			= capture + radiance + ( mFormat.mPacked ? radiance : 0 );
+		// shared exponent maps are filtered in a half float chain and packed through a transfer buffer, both released once converted
+		size_t working			= format.first == GL_RGB9_E5 ? EnvironmentFilterBase::calcCubeMapBytes( faceSize, radianceMips, GL_RGBA16F ) + radiance : 0;
+		// bytes written by a full refresh: the six captured faces, the working chain, the filtered chain and the copy to the array layer
+		size_t refresh			= EnvironmentFilterBase::calcCubeMapBytes( faceSize, 1, captureFormat ) + working + radiance + ( mFormat.mPacked ? radiance : 0 );
+
+		report << setw( 20 ) << left << format.second << right << setw( 10 ) << toMegabytes( probe ) << setw( 10 ) << toMegabytes( refresh );
+		for( auto count : probeCounts ) {
+			report << setw( 10 ) << toMegabytes( probe * count );
+		}
+		report << endl;
+	}
+	report << "current usage: " << toMegabytes( getMemoryUsage() ) << " MB for " << mProbes.size() << " probes" << endl;
+	return report.str();
+}
+
+void EnvironmentManager::setGlslUniforms( const ci::gl::GlslProg *glsl, uint8_t textureUnit ) const
+{
+	glsl->uniform( "uEnvironmentMaps", (int) textureUnit );
+	glsl->uniform( "uEnvMapMaxMip", (float) ( mNumMips - 1 ) );
+	glsl->uniform( "uNumProbes", (int) mProbes.size() );
+}
+
+void EnvironmentManager::bindProbeBuffer( uint8_t bindingPoint )
+{
+	if( mProbeBufferDirty ) {
+		updateProbeBuffer();
+	}
+	mProbeBuffer->bindBase( bindingPoint );
+}
+
+void EnvironmentManager::setGlslUniforms( const ci::gl::GlslProgRef &glsl, uint8_t textureUnit ) const
+{
+	setGlslUniforms( glsl.get(), textureUnit );
+}
+
+EnvironmentManager::Probe* EnvironmentManager::findProbe( const EnvironmentRef &probe )
+{
+	auto it = find_if( mProbes.begin(), mProbes.end(), [&probe]( const Probe &p ) { return p.mEnvironment == probe; } );
+	return it != mProbes.end() ? &( *it ) : nullptr;
+}
+
+const EnvironmentManager::Probe* EnvironmentManager::findProbe( const EnvironmentRef &probe ) const
+{
+	auto it = find_if( mProbes.begin(), mProbes.end(), [&probe]( const Probe &p ) { return p.mEnvironment == probe; } );
+	return it != mProbes.end() ? &( *it ) : nullptr;
+}
+
+void EnvironmentManager::capture( Probe *probe, uint8_t face, const DrawFn &drawFn )
+{
+	const auto &environment = probe->mEnvironment;
+	// environments added already filtered don't have anything to capture into
+	if( ! environment->getFbo() ) {
+		return;
+	}
+	ivec2 size = environment->getFbo()->getSize();
+
+	ScopedEnvironmentWrite scopedWrite( environment );
+	gl::ScopedViewport scopedViewport( ivec2( 0 ), size );
+	scopedWrite.bindFace( face );
+	gl::setProjectionMatrix( CameraPersp( size.x, size.y, 90.0f, mFormat.mNearClip, mFormat.mFarClip ).getProjectionMatrix() );
+	scopedWrite.setViewMatrix( face, environment->getPosition() );
+	gl::clear();
+	if( drawFn ) {
+		drawFn( environment, face );
+	}
+}
+
+void EnvironmentManager::pack( Probe *probe )
+{
+	auto radianceMap = probe->mEnvironment->getRadianceMap();
+	if( ! radianceMap ) {
+		return;
+	}
+
+	if( ! mCubeMapArray ) {
+		const auto &filter = probe->mEnvironment->getFilter();
+		initializeCubeMapArray( radianceMap, filter ? filter->getNumMips() : 1 );
+	}
+
+	// every layer of the array shares the same size and format
+	if( radianceMap->getWidth() != mCubeMapArraySize || radianceMap->getInternalFormat() != mCubeMapArrayFormat ) {
+		CI_LOG_W( "EnvironmentManager: Radiance map doesn't match the cubemap array size or format, skipping" );
+		return;
+	}
+
+	for( uint8_t level = 0; level < mNumMips; ++level ) {
+		ivec2 size = gl::Texture2d::calcMipLevelSize( level, radianceMap->getWidth(), radianceMap->getHeight() );
+		glCopyImageSubData( radianceMap->getId(), GL_TEXTURE_CUBE_MAP, level, 0, 0, 0,
+							mCubeMapArray, GL_TEXTURE_CUBE_MAP_ARRAY, level, 0, 0, probe->mLayer * 6,
+							size.x, size.y, 6 );
+	}
+	probe->mIsPacked = true;
+	mProbeBufferDirty = true;
+}
+
+void EnvironmentManager::initializeCubeMapArray( const ci::gl::TextureCubeMapRef &radianceMap, uint8_t numMips )
+{
+	mCubeMapArraySize	= radianceMap->getWidth();
+	mCubeMapArrayFormat	= radianceMap->getInternalFormat();
+	mNumMips			= std::max<uint8_t>( 1, std::min<uint8_t>( numMips, (uint8_t) floor( std::log2( mCubeMapArraySize ) ) + 1 ) );
+
+	glGenTextures( 1, &mCubeMapArray );
+	gl::ScopedTextureBind scopedTex( GL_TEXTURE_CUBE_MAP_ARRAY, mCubeMapArray );
+	glTexStorage3D( GL_TEXTURE_CUBE_MAP_ARRAY, mNumMips, mCubeMapArrayFormat, mCubeMapArraySize, mCubeMapArraySize, mFormat.mMaxProbes * 6 );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_BASE_LEVEL, 0 );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAX_LEVEL, mNumMips - 1 );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+}
+
+void EnvironmentManager::makeResident( Probe *probe )
+{
+#if defined( GL_ARB_bindless_texture )
+	auto radianceMap = probe->mEnvironment->getRadianceMap();
+	if( ! mIsBindless || probe->mHandle || ! radianceMap ) {
+		return;
+	}
+
+	// a handle freezes the parameters of its texture while the filters keep changing the radiance map mip range, so the handle is taken on a view sharing its storage
+	GLuint texture = radianceMap->getId();
+	GLint immutable = 0, numLevels = 1;
+	{
+		gl::ScopedTextureBind scopedTex( radianceMap );
+		glGetTexParameteriv( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable );
+		glGetTexParameteriv( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_IMMUTABLE_LEVELS, &numLevels );
+	}
+	if( immutable ) {
+		glGenTextures( 1, &probe->mView );
+		glTextureView( probe->mView, GL_TEXTURE_CUBE_MAP, texture, radianceMap->getInternalFormat(), 0, numLevels, 0, 6 );
+		gl::ScopedTextureBind scopedView( GL_TEXTURE_CUBE_MAP, probe->mView );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, numLevels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+		texture = probe->mView;
+	}
+
+	probe->mHandle = glGetTextureHandleARB( texture );
+	glMakeTextureHandleResidentARB( probe->mHandle );
+	mProbeBufferDirty = true;
+#endif
+}
+
+void EnvironmentManager::makeNonResident( Probe *probe )
+{
+#if defined( GL_ARB_bindless_texture )
+	if( probe->mHandle ) {
+		glMakeTextureHandleNonResidentARB( probe->mHandle );
+		probe->mHandle = 0;
+	}
+#endif
+	if( probe->mView ) {
+		glDeleteTextures( 1, &probe->mView );
+		probe->mView = 0;
+	}
+}
+
+void EnvironmentManager::updateProbeBuffer()
+{
+	vector<ProbeData> data;
+	data.reserve( std::max<size_t>( 1, mProbes.size() ) );
+	for( const auto &probe : mProbes ) {
+		const auto &environment = probe.mEnvironment;
+		const auto &filter		= environment->getFilter();
+		uint8_t numMips			= filter ? filter->getNumMips() : 1;
+
+		ProbeData probeData;
+		probeData.mPosition	= vec4( environment->getPosition(), probe.mIsPacked ? (float) probe.mLayer : -1.0f );
+		probeData.mSize		= vec4( environment->getSize(), (float) ( numMips - 1 ) );
+		probeData.mHandle	= probe.mHandle;
+		probeData.mPadding	= 0;
+		data.push_back( probeData );
+	}
+	// an empty buffer can't be bound, keep at least one zeroed entry around
+	if( data.empty() ) {
+		data.push_back( ProbeData{ vec4( 0.0f, 0.0f, 0.0f, -1.0f ), vec4( 0.0f ), 0, 0 } );
+	}
+
+	GLsizeiptr bytes = (GLsizeiptr) ( data.size() * sizeof( ProbeData ) );
+	if( ! mProbeBuffer || mProbeBuffer->getSize() < bytes ) {
+		mProbeBuffer = gl::Ssbo::create( bytes, data.data(), GL_DYNAMIC_DRAW );
+	}
+	else {
+		mProbeBuffer->bufferSubData( 0, bytes, data.data() );
+	}
+	mProbeBufferDirty = false;
+}
+
+ScopedEnvironmentArrayRead::ScopedEnvironmentArrayRead( const EnvironmentManagerRef &manager, uint8_t textureUnit )
+: mGlContext( gl::Context::getCurrent() ), mTextureUnit{ textureUnit }
+{
+	mGlContext->pushBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS, true );
+	mGlContext->pushTextureBinding( GL_TEXTURE_CUBE_MAP_ARRAY, manager->getCubeMapArrayId(), mTextureUnit );
+}
+ScopedEnvironmentArrayRead::~ScopedEnvironmentArrayRead()
+{
+	mGlContext->popBoolState( GL_TEXTURE_CUBE_MAP_SEAMLESS );
+	mGlContext->popTextureBinding( GL_TEXTURE_CUBE_MAP_ARRAY, mTextureUnit );
+}
+
+} // namespace renderkit
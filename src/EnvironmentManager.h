@@ -0,0 +1,208 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "Environment.h"
+
+// Cinder's forward declarations
+namespace cinder { namespace gl {
+typedef std::shared_ptr<class Ssbo>				SsboRef;
+} } // namespace cinder::gl
+
+namespace renderkit {
+
+// type aliases
+using EnvironmentManagerRef = std::shared_ptr<class EnvironmentManager>;
+
+//! Owns a set of local probes and amortizes their capture and filtering over several frames.
+// Probes are scheduled round-robin by priority ( dirty flag, distance to the camera and staleness ) within a per-frame budget.
+// Filtered probes are packed into a single GL_TEXTURE_CUBE_MAP_ARRAY so that shaders can access all of them with a single bind.
+// The probes metadata is stored in a shader storage buffer so that a clustered or forward+ shader can blend them per pixel without any rebind:
+//   struct EnvironmentProbe { vec4 position; vec4 size; uvec2 handle; uvec2 padding; };
+//   layout (std430) buffer EnvironmentProbes { EnvironmentProbe uProbes[]; };
+// position.w is the cubemap array layer ( -1 until packed ), size.w the max mip and handle the bindless samplerCube handle ( zero if disabled ).
+class EnvironmentManager {
+public:
+	// forward declaration
+	class Format;
+
+	//! Draws the scene for the captured \a face of \a probe. The framebuffer, viewport and matrices are already set.
+	using DrawFn = std::function<void( const EnvironmentRef &probe, uint8_t face )>;
+
+	//! Returns a new refcounted EnvironmentManager object.
+	static EnvironmentManagerRef create( const Format &format = Format() );
+	//! Constructs a new EnvironmentManager object.
+	EnvironmentManager( const Format &format = Format() );
+	~EnvironmentManager();
+
+	class Format {
+	public:
+		//! Constructs a new default EnvironmentManager Format object
+		Format() : mFaceSize( 128 ), mMaxProbes( 64 ), mFacesPerFrame( 6 ), mFiltersPerFrame( 1 ), mDistanceWeight( 1.0f ), mStalenessWeight( 0.0f ), mNearClip( 0.1f ), mFarClip( 1000.0f ), mPacked( true ), mBindless( false ) {}
+
+		//! Sets the face size of every probe created by the manager. Default to 128.
+		Format& faceSize( uint16_t size ) { mFaceSize = size; return *this; }
+		//! Sets the maximum number of probes, which is also the number of layers of the cubemap array. Default to 64.
+		Format& maxProbes( uint16_t numProbes ) { mMaxProbes = numProbes; return *this; }
+		//! Sets the maximum number of faces captured each frame. Default to 6.
+		Format& facesPerFrame( uint16_t numFaces ) { mFacesPerFrame = numFaces; return *this; }
+		//! Sets the maximum number of probes filtered each frame. Default to 1.
+		Format& filtersPerFrame( uint16_t numFilters ) { mFiltersPerFrame = numFilters; return *this; }
+		//! Sets the weights used to prioritize probes. A non-zero \a staleness weight keeps refreshing clean probes, oldest and closest first.
+		Format& priority( float distance, float staleness ) { mDistanceWeight = distance; mStalenessWeight = staleness; return *this; }
+		//! Sets the near and far clipping planes used to capture the probes.
+		Format& clipping( float nearClip, float farClip ) { mNearClip = nearClip; mFarClip = farClip; return *this; }
+		//! Specifies whether filtered probes are packed into a cubemap array. Enabled by default.
+		Format& packed( bool enabled = true ) { mPacked = enabled; return *this; }
+		//! Specifies whether each radiance map is exposed as a resident ARB_bindless_texture handle. Ignored if the extension isn't available. Default to false.
+		Format& bindless( bool enabled = true ) { mBindless = enabled; return *this; }
+
+		//! Returns the face size of every probe created by the manager.
+		uint16_t	getFaceSize() const { return mFaceSize; }
+		//! Returns the maximum number of probes.
+		uint16_t	getMaxProbes() const { return mMaxProbes; }
+		//! Returns the maximum number of faces captured each frame.
+		uint16_t	getFacesPerFrame() const { return mFacesPerFrame; }
+		//! Returns the maximum number of probes filtered each frame.
+		uint16_t	getFiltersPerFrame() const { return mFiltersPerFrame; }
+		//! Returns whether filtered probes are packed into a cubemap array.
+		bool		isPacked() const { return mPacked; }
+		//! Returns whether bindless handles were requested.
+		bool		isBindless() const { return mBindless; }
+
+	protected:
+		uint16_t	mFaceSize, mMaxProbes, mFacesPerFrame, mFiltersPerFrame;
+		float		mDistanceWeight, mStalenessWeight, mNearClip, mFarClip;
+		bool		mPacked, mBindless;
+		friend class EnvironmentManager;
+	};
+
+	//! Creates a new probe owned by the manager. The probe is flagged dirty and will be captured during the next updates. Returns nullptr if the manager is full.
+	EnvironmentRef add( const Environment::Format &format = Environment::Format() );
+	//! Adds an already filtered \a environment ( ie. loaded from a file ) so that it is packed and exposed with the probes. Returns false if the manager is full.
+	bool add( const EnvironmentRef &environment );
+	//! Removes \a probe from the manager and releases its cubemap array layer.
+	void remove( const EnvironmentRef &probe );
+	//! Flags the faces in the \a faces bitmask ( 1 << face ) of \a probe to be recaptured. Only what depends on them is refiltered.
+	void markDirty( const EnvironmentRef &probe, uint8_t faces = 0x3F );
+	//! Flags every probe to be entirely recaptured and refiltered.
+	void markAllDirty();
+
+	//! Captures and filters the probes with the highest priority within the frame budget. \a drawFn is called once per captured face.
+	void update( const ci::vec3 &cameraPosition, const DrawFn &drawFn );
+
+	//! Returns the probes owned by the manager.
+	std::vector<EnvironmentRef> getProbes() const;
+	//! Returns the number of probes owned by the manager.
+	size_t getNumProbes() const { return mProbes.size(); }
+	//! Returns the cubemap array layer of \a probe, or -1 if the probe is not packed yet.
+	int getLayer( const EnvironmentRef &probe ) const;
+	//! Returns the number of mips of the packed cubemap array.
+	uint8_t getNumMips() const { return mNumMips; }
+	//! Returns the packed GL_TEXTURE_CUBE_MAP_ARRAY texture id or 0 if nothing has been packed yet.
+	GLuint getCubeMapArrayId() const { return mCubeMapArray; }
+	//! Returns the Format used to create the manager.
+	const Format& getFormat() const { return mFormat; }
+	//! Returns whether the radiance maps are exposed as bindless handles.
+	bool isBindless() const { return mIsBindless; }
+	//! Returns the shader storage buffer holding the EnvironmentProbe array, one entry per probe in getProbes() order.
+	const ci::gl::SsboRef& getProbeBuffer() const { return mProbeBuffer; }
+	//! Binds the EnvironmentProbe array to the shader storage \a bindingPoint.
+	void bindProbeBuffer( uint8_t bindingPoint = 0 );
+
+	//! Returns the GPU memory used by the probes and the packed cubemap array in bytes.
+	size_t getMemoryUsage() const;
+	//! Returns a table comparing the memory and the bytes written per probe refresh of the storage formats for each of \a probeCounts, at the face size of the manager.
+	std::string getMemoryReport( const std::vector<uint16_t> &probeCounts = { 8, 16, 32, 64 } ) const;
+
+	//! Sets the GlslProg's cubemap array related uniforms.
+	void setGlslUniforms( const ci::gl::GlslProg *glsl, uint8_t textureUnit = 0 ) const;
+	//! Sets the GlslProg's cubemap array related uniforms.
+	void setGlslUniforms( const ci::gl::GlslProgRef &glsl, uint8_t textureUnit = 0 ) const;
+
+protected:
+	struct Probe {
+		EnvironmentRef	mEnvironment;
+		uint8_t			mCapturedFaces;
+		uint8_t			mNextFace;
+		bool			mDirty;
+		bool			mNeedsFilter;
+		uint32_t		mLastUpdate;
+		int				mLayer;
+		bool			mIsPacked;
+		float			mPriority;
+		GLuint			mView;
+		GLuint64		mHandle;
+	};
+
+	//! std430 layout of the EnvironmentProbe struct
+	struct ProbeData {
+		ci::vec4		mPosition;
+		ci::vec4		mSize;
+		uint64_t		mHandle;
+		uint64_t		mPadding;
+	};
+
+	Probe* findProbe( const EnvironmentRef &probe );
+	const Probe* findProbe( const EnvironmentRef &probe ) const;
+	void capture( Probe *probe, uint8_t face, const DrawFn &drawFn );
+	void pack( Probe *probe );
+	void initializeCubeMapArray( const ci::gl::TextureCubeMapRef &radianceMap, uint8_t numMips );
+	void makeResident( Probe *probe );
+	void makeNonResident( Probe *probe );
+	void updateProbeBuffer();
+
+	Format					mFormat;
+	std::vector<Probe>		mProbes;
+	std::vector<int>		mFreeLayers;
+	uint32_t				mFrame;
+
+	GLuint					mCubeMapArray;
+	GLenum					mCubeMapArrayFormat;
+	GLint					mCubeMapArraySize;
+	uint8_t					mNumMips;
+
+	bool					mIsBindless;
+	bool					mProbeBufferDirty;
+	ci::gl::SsboRef			mProbeBuffer;
+};
+
+//! Similar to rk::ScopedEnvironmentRead. Binds the packed cubemap array of an EnvironmentManager.
+class ScopedEnvironmentArrayRead : private ci::Noncopyable {
+public:
+	ScopedEnvironmentArrayRead( const EnvironmentManagerRef &manager, uint8_t textureUnit = 0 );
+	~ScopedEnvironmentArrayRead();
+
+protected:
+	ci::gl::Context*		mGlContext;
+	uint8_t					mTextureUnit;
+};
+
+} // namespace renderkit
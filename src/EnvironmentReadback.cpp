@@ -0,0 +1,172 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EnvironmentReadback.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "cinder/gl/BufferObj.h"
+#include "cinder/gl/Texture.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/gl/wrapper.h"
+#include "cinder/Log.h"
+
+#include "Environment.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+namespace {
+	// Returns the number of levels that can be read from \a cubeMap
+	uint8_t getNumLevels( const gl::TextureCubeMapRef &cubeMap )
+	{
+		GLint fullChain = (GLint) floor( std::log2( std::max( 1, cubeMap->getWidth() ) ) ) + 1;
+		GLint immutable = 0, numLevels = 1;
+		gl::ScopedTextureBind scopedTex( cubeMap );
+		glGetTexParameteriv( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable );
+		if( immutable ) {
+			glGetTexParameteriv( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_IMMUTABLE_LEVELS, &numLevels );
+		}
+		else if( cubeMap->hasMipmapping() ) {
+			GLint maxLevel = 0;
+			glGetTexParameteriv( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, &maxLevel );
+			numLevels = std::min( maxLevel + 1, fullChain );
+		}
+		return (uint8_t) glm::clamp( numLevels, 1, fullChain );
+	}
+}
+
+const float* EnvironmentReadback::Data::getFace( uint8_t level, uint8_t face ) const
+{
+	size_t offset = 0;
+	for( uint8_t i = 0; i < level; ++i ) {
+		size_t size = std::max( 1, mFaceSize >> i );
+		offset += size * size * 6;
+	}
+	size_t size = std::max( 1, mFaceSize >> level );
+	return mData + ( offset + size * size * face ) * 4;
+}
+
+EnvironmentReadbackRef EnvironmentReadback::create()
+{
+	return make_shared<EnvironmentReadback>();
+}
+
+EnvironmentReadback::EnvironmentReadback()
+{
+}
+
+EnvironmentReadback::~EnvironmentReadback()
+{
+	for( auto &pending : mPending ) {
+		glDeleteSync( pending.mFence );
+	}
+}
+
+void EnvironmentReadback::read( const EnvironmentRef &environment, const ReadbackFn &readbackFn )
+{
+	const auto &filter = environment->getFilter();
+	read( environment->getRadianceMap(), readbackFn, filter ? filter->getNumMips() : 0 );
+}
+
+void EnvironmentReadback::read( const ci::gl::TextureCubeMapRef &cubeMap, const ReadbackFn &readbackFn, uint8_t numMips )
+{
+	if( ! cubeMap ) {
+		CI_LOG_W( "EnvironmentReadback: Nothing to read back" );
+		return;
+	}
+
+	Pending pending;
+	pending.mReadbackFn	= readbackFn;
+	pending.mFaceSize	= (uint16_t) cubeMap->getWidth();
+	pending.mNumMips	= std::min( numMips ? numMips : (uint8_t) 255, getNumLevels( cubeMap ) );
+	pending.mBytes		= EnvironmentFilterBase::calcCubeMapBytes( pending.mFaceSize, pending.mNumMips, GL_RGBA32F );
+
+	// recycles the first free buffer large enough
+	auto it = find_if( mFreeBuffers.begin(), mFreeBuffers.end(), [&]( const gl::BufferObjRef &buffer ) { return (size_t) buffer->getSize() >= pending.mBytes; } );
+	if( it != mFreeBuffers.end() ) {
+		pending.mBuffer = *it;
+		mFreeBuffers.erase( it );
+	}
+	else {
+		pending.mBuffer = gl::BufferObj::create( GL_PIXEL_PACK_BUFFER, pending.mBytes, nullptr, GL_STREAM_READ );
+	}
+
+	// images written by a compute shader need to be visible to the pixel transfer
+	gl::memoryBarrier( GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT );
+	{
+		gl::ScopedBuffer scopedBuffer( GL_PIXEL_PACK_BUFFER, pending.mBuffer->getId() );
+		gl::ScopedTextureBind scopedTex( cubeMap );
+		size_t offset = 0;
+		for( int level = 0; level < pending.mNumMips; level++ ) {
+			GLint levelSize = std::max( 1, pending.mFaceSize >> level );
+			for( GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X; face < GL_TEXTURE_CUBE_MAP_POSITIVE_X + 6; ++face ) {
+				glGetTexImage( face, level, GL_RGBA, GL_FLOAT, reinterpret_cast<void*>( offset ) );
+				offset += (size_t) levelSize * levelSize * 4 * sizeof( float );
+			}
+		}
+	}
+	pending.mFence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	mPending.push_back( pending );
+}
+
+size_t EnvironmentReadback::update( bool wait )
+{
+	size_t numDelivered = 0;
+	while( ! mPending.empty() ) {
+		auto &pending = mPending.front();
+
+		// the fences complete in order, the first one still pending blocks the following ones
+		GLenum status = glClientWaitSync( pending.mFence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? GL_TIMEOUT_IGNORED : 0 );
+		if( status == GL_TIMEOUT_EXPIRED ) {
+			break;
+		}
+		glDeleteSync( pending.mFence );
+
+		if( status == GL_WAIT_FAILED ) {
+			CI_LOG_W( "EnvironmentReadback: Waiting on the readback fence failed, dropping the read" );
+		}
+		else if( auto mapped = pending.mBuffer->mapBufferRange( 0, pending.mBytes, GL_MAP_READ_BIT ) ) {
+			Data data;
+			data.mFaceSize	= pending.mFaceSize;
+			data.mNumMips	= pending.mNumMips;
+			data.mBytes		= pending.mBytes;
+			data.mData		= static_cast<const float*>( mapped );
+			if( pending.mReadbackFn ) {
+				pending.mReadbackFn( data );
+			}
+			pending.mBuffer->unmap();
+			++numDelivered;
+		}
+
+		mFreeBuffers.push_back( pending.mBuffer );
+		mPending.pop_front();
+	}
+	return numDelivered;
+}
+
+} // namespace renderkit
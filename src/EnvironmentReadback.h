@@ -0,0 +1,109 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <deque>
+#include <vector>
+#include <functional>
+
+#include "cinder/gl/platform.h"
+
+// Cinder's forward declarations
+namespace cinder { namespace gl {
+typedef std::shared_ptr<class TextureCubeMap>	TextureCubeMapRef;
+typedef std::shared_ptr<class BufferObj>		BufferObjRef;
+} } // namespace cinder::gl
+
+namespace renderkit {
+
+// type aliases
+using EnvironmentReadbackRef	= std::shared_ptr<class EnvironmentReadback>;
+using EnvironmentRef			= std::shared_ptr<class Environment>;
+
+//! Reads cubemaps back to the CPU without stalling the pipeline.
+// Each read queues the copy of the mip chain into a pixel pack buffer followed by a fence. update() polls the fences
+// and hands the mapped data to the callbacks once the GPU is done, usually one or two frames later. Buffers are recycled between reads.
+class EnvironmentReadback {
+public:
+	//! Mapped RGBA float data of a cubemap, mip after mip and face after face ( GL_TEXTURE_CUBE_MAP_POSITIVE_X + face order ). Only valid during the callback.
+	class Data {
+	public:
+		//! Returns the face size of the first mip.
+		uint16_t		getFaceSize() const { return mFaceSize; }
+		//! Returns the number of mips read back.
+		uint8_t			getNumMips() const { return mNumMips; }
+		//! Returns the size of the whole chain in bytes.
+		size_t			getBytes() const { return mBytes; }
+		//! Returns the whole chain.
+		const float*	getData() const { return mData; }
+		//! Returns the RGBA pixels of \a face at \a level.
+		const float*	getFace( uint8_t level, uint8_t face ) const;
+
+	protected:
+		uint16_t		mFaceSize;
+		uint8_t			mNumMips;
+		size_t			mBytes;
+		const float*	mData;
+		friend class EnvironmentReadback;
+	};
+
+	//! Called from update() with the data of a completed read.
+	using ReadbackFn = std::function<void( const Data &data )>;
+
+	//! Returns a new refcounted EnvironmentReadback object.
+	static EnvironmentReadbackRef create();
+	//! Constructs a new EnvironmentReadback object.
+	EnvironmentReadback();
+	~EnvironmentReadback();
+
+	//! Queues the copy of the first \a numMips levels of \a cubeMap, all of them if 0. \a readbackFn is called by a later update().
+	void read( const ci::gl::TextureCubeMapRef &cubeMap, const ReadbackFn &readbackFn, uint8_t numMips = 0 );
+	//! Queues the copy of the radiance map of \a environment, with as many levels as its filter outputs.
+	void read( const EnvironmentRef &environment, const ReadbackFn &readbackFn );
+
+	//! Delivers the completed reads in the order they were queued. Never blocks unless \a wait is true, in which case every pending read is delivered. Returns the number of reads delivered.
+	size_t update( bool wait = false );
+	//! Returns the number of reads still in flight.
+	size_t getNumPending() const { return mPending.size(); }
+
+	EnvironmentReadback( const EnvironmentReadback& ) = delete;
+	EnvironmentReadback& operator=( const EnvironmentReadback& ) = delete;
+
+protected:
+	struct Pending {
+		ci::gl::BufferObjRef	mBuffer;
+		GLsync					mFence;
+		ReadbackFn				mReadbackFn;
+		uint16_t				mFaceSize;
+		uint8_t					mNumMips;
+		size_t					mBytes;
+	};
+
+	std::deque<Pending>					mPending;
+	std::vector<ci::gl::BufferObjRef>	mFreeBuffers;
+};
+
+} // namespace renderkit
@@ -0,0 +1,211 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EnvironmentSky.h"
+#include "Environment.h"
+#include "Compute.h"
+#include "Profiler.h"
+
+#include "cinder/Log.h"
+#include "cinder/app/App.h"
+#include "cinder/gl/Texture.h"
+#include "cinder/gl/GlslProg.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/gl/wrapper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+namespace {
+	// programs shared by every sky, only weak references are kept
+	std::map<std::string, std::weak_ptr<ComputeShader>>	sSkyShaders;
+	std::weak_ptr<ComputeShader>						sBlendShader;
+
+	ComputeShaderRef acquireComputeShader( std::weak_ptr<ComputeShader> &shared, const fs::path &path )
+	{
+		auto shader = shared.lock();
+		if( ! shader ) {
+			try {
+				shader = ComputeShader::create( path, ivec3( 8, 8, 1 ) );
+				shared = shader;
+			}
+			catch( const std::exception &exc ) { CI_LOG_EXCEPTION( exc.what(), exc ); }
+		}
+		return shader;
+	}
+
+	gl::TextureCubeMapRef createCubeMap( GLint size, uint8_t numMips )
+	{
+		auto textureFormat = gl::TextureCubeMap::Format().internalFormat( GL_RGBA16F ).mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR ).immutableStorage().wrap( GL_CLAMP_TO_EDGE );
+		textureFormat.setMaxMipmapLevel( numMips - 1 );
+		return gl::TextureCubeMap::create( size, size, textureFormat );
+	}
+
+	void copyCubeMap( const gl::TextureCubeMapRef &source, const gl::TextureCubeMapRef &destination, uint8_t numMips )
+	{
+		for( int level = 0; level < numMips; level++ ) {
+			GLsizei size = std::max( 1, source->getWidth() >> level );
+			glCopyImageSubData( source->getId(), GL_TEXTURE_CUBE_MAP, level, 0, 0, 0, destination->getId(), GL_TEXTURE_CUBE_MAP, level, 0, 0, 0, size, size, 6 );
+		}
+	}
+}
+
+EnvironmentSkyRef EnvironmentSky::create( const Format &format )
+{
+	return make_shared<EnvironmentSky>( format );
+}
+
+EnvironmentSky::EnvironmentSky( const Format &format )
+: mStep( 0 ), mStepsPerFrame( std::max<uint8_t>( 1, format.getStepsPerFrame() ) ), mNumMips( 0 )
+{
+	mSkyShader		= acquireComputeShader( sSkyShaders[format.getShaderPath().string()], format.getShaderPath() );
+	mBlendShader	= acquireComputeShader( sBlendShader, "glsl/pbr/EnvBlend.comp" );
+
+	// the sky is mipmapped for the filtered sampling of the filter
+	uint8_t numLevels = (uint8_t) floor( std::log2( std::max<uint16_t>( 1, format.getFaceSize() ) ) ) + 1;
+	mSkyMap = createCubeMap( format.getFaceSize(), numLevels );
+	mCycleParams = mParams;
+	for( uint8_t face = 0; face < 6; ++face ) {
+		renderFace( face );
+	}
+
+	// the filter always writes half floats so that its chain can be copied to the blended ones
+	auto filterFormat = EnvironmentFilterCompute::Format( format.getFilterFormat() ).faceSize( format.getFaceSize() ).internalFormat( GL_RGBA16F );
+	mFilter			= EnvironmentFilterCompute::create( mSkyMap, filterFormat );
+	mNumMips		= mFilter->getNumMips();
+	mPrevious		= createCubeMap( format.getFaceSize(), mNumMips );
+	mNext			= createCubeMap( format.getFaceSize(), mNumMips );
+	mRadianceMap	= createCubeMap( format.getFaceSize(), mNumMips );
+	copyCubeMap( mFilter->getPmRadianceEnvMap(), mPrevious, mNumMips );
+	copyCubeMap( mFilter->getPmRadianceEnvMap(), mNext, mNumMips );
+	blend( 0.0f );
+
+	mEnvironment	= Environment::create( mRadianceMap, mRadianceMap, mRadianceMap );
+}
+
+void EnvironmentSky::update()
+{
+	ScopedCpuTimer scopedTimer( "EnvironmentSky::update" );
+	for( uint8_t i = 0; i < mStepsPerFrame; ++i ) {
+		if( mStep < 6 ) {
+			renderFace( mStep );
+		}
+		else {
+			mFilter->filterLevels( 0x3F, mStep - 6, 1 );
+		}
+
+		if( ++mStep == getNumSteps() ) {
+			completeCycle();
+		}
+	}
+	// the last step before the chains rotate shows the next chain as is, the rotation then starts again from the same radiance
+	blend( (float) mStep / (float) ( getNumSteps() - 1 ) );
+}
+
+void EnvironmentSky::regenerate()
+{
+	mCycleParams = mParams;
+	for( uint8_t face = 0; face < 6; ++face ) {
+		renderFace( face );
+	}
+	mFilter->filter();
+	copyCubeMap( mFilter->getPmRadianceEnvMap(), mPrevious, mNumMips );
+	copyCubeMap( mFilter->getPmRadianceEnvMap(), mNext, mNumMips );
+	blend( 0.0f );
+	mStep = 0;
+}
+
+void EnvironmentSky::completeCycle()
+{
+	// the oldest chain receives the new result and the blend restarts from the one that was fully shown
+	std::swap( mPrevious, mNext );
+	copyCubeMap( mFilter->getPmRadianceEnvMap(), mNext, mNumMips );
+	mCycleParams	= mParams;
+	mStep			= 0;
+}
+
+void EnvironmentSky::renderFace( uint8_t face )
+{
+	if( ! mSkyShader || ! mSkyShader->getGlsl() ) {
+		CI_LOG_W( "EnvironmentSky: No sky program" );
+		return;
+	}
+
+	ScopedGpuTimer scopedTimer( "EnvironmentSky face", face );
+	const auto &glsl			= mSkyShader->getGlsl();
+	const ivec3 &workGroupSize	= mSkyShader->getWorkGroupSize();
+	gl::ScopedGlslProg shaderScp( glsl );
+	glsl->uniform( "uFace", (int) face );
+	glsl->uniform( "uFaceSize", mSkyMap->getWidth() );
+	glsl->uniform( "uSunDirection", mCycleParams.mSunDirection );
+	glsl->uniform( "uSunColor", vec3( mCycleParams.mSunColor ) );
+	glsl->uniform( "uSunSize", mCycleParams.mSunSize );
+	glsl->uniform( "uZenithColor", vec3( mCycleParams.mZenithColor ) );
+	glsl->uniform( "uHorizonColor", vec3( mCycleParams.mHorizonColor ) );
+	glsl->uniform( "uGroundColor", vec3( mCycleParams.mGroundColor ) );
+	if( mSetUniformsFn ) {
+		mSetUniformsFn( glsl );
+	}
+
+	int size = mSkyMap->getWidth();
+	glBindImageTexture( 0, mSkyMap->getId(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F );
+	gl::dispatchCompute( ( size + workGroupSize.x - 1 ) / workGroupSize.x, ( size + workGroupSize.y - 1 ) / workGroupSize.y, 1 );
+	glBindImageTexture( 0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F );
+	gl::memoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT );
+}
+
+void EnvironmentSky::blend( float t )
+{
+	if( ! mBlendShader || ! mBlendShader->getGlsl() ) {
+		CI_LOG_W( "EnvironmentSky: No blend program, using the last complete radiance" );
+		copyCubeMap( mNext, mRadianceMap, mNumMips );
+		return;
+	}
+
+	ScopedGpuTimer scopedTimer( "EnvironmentSky blend" );
+	const auto &glsl			= mBlendShader->getGlsl();
+	const ivec3 &workGroupSize	= mBlendShader->getWorkGroupSize();
+	gl::ScopedGlslProg shaderScp( glsl );
+	glsl->uniform( "uBlend", glm::clamp( t, 0.0f, 1.0f ) );
+	for( int level = 0; level < mNumMips; level++ ) {
+		int size = std::max( 1, mRadianceMap->getWidth() >> level );
+		glsl->uniform( "uFaceSize", size );
+		glBindImageTexture( 0, mPrevious->getId(), level, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA16F );
+		glBindImageTexture( 1, mNext->getId(), level, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA16F );
+		glBindImageTexture( 2, mRadianceMap->getId(), level, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F );
+		gl::dispatchCompute( ( size + workGroupSize.x - 1 ) / workGroupSize.x, ( size + workGroupSize.y - 1 ) / workGroupSize.y, 6 );
+	}
+	for( GLuint unit = 0; unit < 3; ++unit ) {
+		glBindImageTexture( unit, 0, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA16F );
+	}
+	gl::memoryBarrier( GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT );
+}
+
+} // namespace renderkit
@@ -0,0 +1,157 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <string>
+
+#include "EnvironmentFilter.h"
+
+#include "cinder/Color.h"
+#include "cinder/Filesystem.h"
+#include "cinder/Vector.h"
+
+// Cinder's forward declarations
+namespace cinder { namespace gl {
+typedef std::shared_ptr<class TextureCubeMap>	TextureCubeMapRef;
+typedef std::shared_ptr<class GlslProg>			GlslProgRef;
+} } // namespace cinder::gl
+
+typedef std::shared_ptr<class ComputeShader> ComputeShaderRef;
+
+namespace renderkit {
+
+// type aliases
+using EnvironmentSkyRef	= std::shared_ptr<class EnvironmentSky>;
+using EnvironmentRef	= std::shared_ptr<class Environment>;
+
+//! Environment rendered from a procedural sky that can change every frame, without recapturing a probe and refiltering it as a whole.
+// The sky is rendered by a compute shader straight into a cubemap and regenerated on a staggered schedule: one face per step, then one mip
+// of rk::EnvironmentFilterCompute per step. A complete regeneration takes 6 + numMips steps, during which the radiance map blends from the
+// previous complete chain to the last one, so lighting changes smoothly and lags the sky parameters by one regeneration.
+// The sky parameters are snapshotted at the beginning of each regeneration, every face of a chain sees the same sky.
+class EnvironmentSky {
+public:
+	class Format;
+
+	//! Called with the bound sky program before rendering each face, to set the uniforms of a custom sky shader.
+	using SetUniformsFn = std::function<void( const ci::gl::GlslProgRef &glsl )>;
+
+	//! Returns a new refcounted EnvironmentSky object. The sky is fully generated once before returning.
+	static EnvironmentSkyRef create( const Format &format = Format() );
+	//! Constructs a new EnvironmentSky object. The sky is fully generated once before returning.
+	EnvironmentSky( const Format &format = Format() );
+
+	class Format {
+	public:
+		Format() : mFaceSize( 128 ), mStepsPerFrame( 1 ), mShaderPath( "glsl/pbr/Sky.comp" ), mFilterFormat( EnvironmentFilterCompute::Format().samples( 512 ).filteredSampling() ) {}
+
+		//! Sets the face resolution of the sky and of the radiance map in pixels. Default to 128.
+		Format& faceSize( uint16_t size ) { mFaceSize = size; return *this; }
+		//! Sets the number of regeneration steps taken by each update(), a step being a face or a mip. Default to 1.
+		Format& stepsPerFrame( uint8_t numSteps ) { mStepsPerFrame = numSteps; return *this; }
+		//! Sets the compute shader rendering the sky. It writes the face uFace of the imageCube bound to unit 0 and is dispatched with 8x8 work groups. Default to "glsl/pbr/Sky.comp".
+		Format& shader( const ci::fs::path &path ) { mShaderPath = path; return *this; }
+		//! Sets the format of the filter. The face size is overridden and the output is always GL_RGBA16F.
+		Format& filter( const EnvironmentFilterCompute::Format &format ) { mFilterFormat = format; return *this; }
+
+		//! Returns the face resolution in pixels.
+		uint16_t	getFaceSize() const { return mFaceSize; }
+		//! Returns the number of regeneration steps taken by each update().
+		uint8_t		getStepsPerFrame() const { return mStepsPerFrame; }
+		//! Returns the path of the sky compute shader.
+		const ci::fs::path& getShaderPath() const { return mShaderPath; }
+		//! Returns the format of the filter.
+		const EnvironmentFilterCompute::Format& getFilterFormat() const { return mFilterFormat; }
+
+	protected:
+		uint16_t							mFaceSize;
+		uint8_t								mStepsPerFrame;
+		ci::fs::path						mShaderPath;
+		EnvironmentFilterCompute::Format	mFilterFormat;
+	};
+
+	//! Takes the next regeneration steps and blends the radiance map. Should be called once per frame.
+	void update();
+	//! Regenerates and filters the sky at once with the current parameters and stops blending, ie. after a jump in time.
+	void regenerate();
+
+	//! Sets the normalized direction towards the sun. Default to vec3( 0.0f, 0.5f, 0.866f ).
+	void setSunDirection( const ci::vec3 &direction ) { mParams.mSunDirection = glm::normalize( direction ); }
+	//! Sets the radiance of the sun disk. Default to Color( 50.0f, 45.0f, 40.0f ).
+	void setSunColor( const ci::Color &color ) { mParams.mSunColor = color; }
+	//! Sets the angular radius of the sun disk in radians. Default to 0.02f.
+	void setSunSize( float radius ) { mParams.mSunSize = radius; }
+	//! Sets the radiance of the sky at the zenith. Default to Color( 0.15f, 0.3f, 0.8f ).
+	void setZenithColor( const ci::Color &color ) { mParams.mZenithColor = color; }
+	//! Sets the radiance of the sky at the horizon. Default to Color( 0.7f, 0.8f, 1.0f ).
+	void setHorizonColor( const ci::Color &color ) { mParams.mHorizonColor = color; }
+	//! Sets the radiance of the ground. Default to Color( 0.2f, 0.18f, 0.15f ).
+	void setGroundColor( const ci::Color &color ) { mParams.mGroundColor = color; }
+	//! Sets the function setting the uniforms of a custom sky shader. Unlike the built-in parameters, it is called when each face is rendered.
+	void setUniformsFn( const SetUniformsFn &setUniformsFn ) { mSetUniformsFn = setUniformsFn; }
+
+	//! Returns the direction towards the sun.
+	const ci::vec3& getSunDirection() const { return mParams.mSunDirection; }
+
+	//! Returns the environment to read from. Its skybox, radiance and irradiance maps are all the blended radiance map.
+	const EnvironmentRef& getEnvironment() const { return mEnvironment; }
+	//! Returns the blended radiance map.
+	const ci::gl::TextureCubeMapRef& getRadianceMap() const { return mRadianceMap; }
+	//! Returns the sky cubemap, which is partially updated during a regeneration.
+	const ci::gl::TextureCubeMapRef& getSkyMap() const { return mSkyMap; }
+	//! Returns the number of steps of a complete regeneration.
+	uint8_t getNumSteps() const { return 6 + mNumMips; }
+	//! Returns the current step of the regeneration.
+	uint8_t getStep() const { return mStep; }
+
+	EnvironmentSky( const EnvironmentSky& ) = delete;
+	EnvironmentSky& operator=( const EnvironmentSky& ) = delete;
+
+protected:
+	struct SkyParams {
+		SkyParams() : mSunDirection( 0.0f, 0.5f, 0.866f ), mSunColor( 50.0f, 45.0f, 40.0f ), mSunSize( 0.02f ), mZenithColor( 0.15f, 0.3f, 0.8f ), mHorizonColor( 0.7f, 0.8f, 1.0f ), mGroundColor( 0.2f, 0.18f, 0.15f ) {}
+		ci::vec3	mSunDirection;
+		ci::Color	mSunColor;
+		float		mSunSize;
+		ci::Color	mZenithColor, mHorizonColor, mGroundColor;
+	};
+
+	void renderFace( uint8_t face );
+	void completeCycle();
+	void blend( float t );
+
+	uint8_t						mStep, mStepsPerFrame, mNumMips;
+	SkyParams					mParams, mCycleParams;
+	SetUniformsFn				mSetUniformsFn;
+
+	ComputeShaderRef			mSkyShader, mBlendShader;
+	EnvironmentFilterComputeRef	mFilter;
+	ci::gl::TextureCubeMapRef	mSkyMap, mPrevious, mNext, mRadianceMap;
+	EnvironmentRef				mEnvironment;
+};
+
+} // namespace renderkit
@@ -0,0 +1,280 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Profiler.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "cinder/Log.h"
+
+using namespace ci;
+using namespace std;
+
+namespace renderkit {
+
+namespace {
+	const size_t sQueryBatchSize = 32;
+
+	string formatName( const char *name, int index )
+	{
+		return index < 0 ? string( name ) : string( name ) + " " + to_string( index );
+	}
+
+	string escapeJson( const string &text )
+	{
+		string escaped;
+		escaped.reserve( text.size() );
+		for( char c : text ) {
+			if( c == '"' || c == '\\' ) {
+				escaped += '\\';
+			}
+			escaped += c;
+		}
+		return escaped;
+	}
+}
+
+// static
+Profiler* Profiler::instance()
+{
+	static Profiler sInstance;
+	return &sInstance;
+}
+
+Profiler::Profiler()
+: mEnabled( false ), mWindowSize( 120 ), mTraceCapacity( 65536 ), mEpoch( Clock::now() ), mGpuOffset( 0 )
+{
+}
+
+Profiler::~Profiler()
+{
+	// the queries aren't deleted, the GL context is usually gone by the time static objects are destroyed
+}
+
+GLuint Profiler::acquireQuery()
+{
+	if( mFreeQueries.empty() ) {
+		mFreeQueries.resize( sQueryBatchSize );
+		glGenQueries( (GLsizei) sQueryBatchSize, mFreeQueries.data() );
+	}
+	GLuint query = mFreeQueries.back();
+	mFreeQueries.pop_back();
+	return query;
+}
+
+int64_t Profiler::getCpuTime() const
+{
+	return chrono::duration_cast<chrono::microseconds>( Clock::now() - mEpoch ).count();
+}
+
+void Profiler::beginGpu( const std::string &name )
+{
+	GpuScope scope;
+	scope.mName		= name;
+	scope.mBegin	= acquireQuery();
+	scope.mEnd		= 0;
+	glQueryCounter( scope.mBegin, GL_TIMESTAMP );
+	mGpuStack.push_back( scope );
+}
+
+void Profiler::endGpu()
+{
+	if( mGpuStack.empty() ) {
+		CI_LOG_W( "Profiler: endGpu() without a matching beginGpu()" );
+		return;
+	}
+	GpuScope scope = mGpuStack.back();
+	mGpuStack.pop_back();
+	scope.mEnd = acquireQuery();
+	glQueryCounter( scope.mEnd, GL_TIMESTAMP );
+	mPendingGpu.push_back( scope );
+}
+
+void Profiler::beginCpu( const std::string &name )
+{
+	mCpuStack.push_back( { name, Clock::now() } );
+}
+
+void Profiler::endCpu()
+{
+	if( mCpuStack.empty() ) {
+		CI_LOG_W( "Profiler: endCpu() without a matching beginCpu()" );
+		return;
+	}
+	CpuScope scope = mCpuStack.back();
+	mCpuStack.pop_back();
+
+	auto end = Clock::now();
+	addSample( mCpuSamples, scope.mName, chrono::duration<double, milli>( end - scope.mBegin ).count() );
+	addTraceEvent( scope.mName, chrono::duration_cast<chrono::microseconds>( scope.mBegin - mEpoch ).count(), chrono::duration_cast<chrono::microseconds>( end - scope.mBegin ).count(), false );
+}
+
+void Profiler::update()
+{
+	if( ! mPendingGpu.empty() ) {
+		// maps the GPU clock to the CPU one, the current timestamp is returned without waiting for the queued commands
+		GLint64 gpuTime = 0;
+		glGetInteger64v( GL_TIMESTAMP, &gpuTime );
+		mGpuOffset = getCpuTime() - gpuTime / 1000;
+	}
+
+	// the queries complete in order, stop at the first one that isn't available
+	while( ! mPendingGpu.empty() ) {
+		const auto &scope = mPendingGpu.front();
+		GLint available = 0;
+		glGetQueryObjectiv( scope.mEnd, GL_QUERY_RESULT_AVAILABLE, &available );
+		if( ! available ) {
+			break;
+		}
+
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v( scope.mBegin, GL_QUERY_RESULT, &begin );
+		glGetQueryObjectui64v( scope.mEnd, GL_QUERY_RESULT, &end );
+		addSample( mGpuSamples, scope.mName, double( end - begin ) * 1e-6 );
+		addTraceEvent( scope.mName, (int64_t) ( begin / 1000 ) + mGpuOffset, (int64_t) ( ( end - begin ) / 1000 ), true );
+
+		mFreeQueries.push_back( scope.mBegin );
+		mFreeQueries.push_back( scope.mEnd );
+		mPendingGpu.pop_front();
+	}
+
+	updateStats( mGpuSamples, &mGpuStats );
+	updateStats( mCpuSamples, &mCpuStats );
+}
+
+void Profiler::addSample( std::map<std::string, std::deque<double>> &samples, const std::string &name, double milliseconds )
+{
+	auto &window = samples[name];
+	window.push_back( milliseconds );
+	while( window.size() > mWindowSize ) {
+		window.pop_front();
+	}
+}
+
+void Profiler::addTraceEvent( const std::string &name, int64_t timestamp, int64_t duration, bool isGpu )
+{
+	if( ! mTraceCapacity ) {
+		return;
+	}
+	mTrace.push_back( { name, timestamp, duration, isGpu } );
+	while( mTrace.size() > mTraceCapacity ) {
+		mTrace.pop_front();
+	}
+}
+
+void Profiler::updateStats( const std::map<std::string, std::deque<double>> &samples, std::map<std::string, Stats> *stats )
+{
+	for( const auto &window : samples ) {
+		if( window.second.empty() ) {
+			continue;
+		}
+		Stats windowStats;
+		windowStats.mLast		= window.second.back();
+		windowStats.mMin		= window.second.front();
+		windowStats.mMax		= window.second.front();
+		windowStats.mCount		= window.second.size();
+		double sum = 0.0;
+		for( double sample : window.second ) {
+			sum					+= sample;
+			windowStats.mMin	= std::min( windowStats.mMin, sample );
+			windowStats.mMax	= std::max( windowStats.mMax, sample );
+		}
+		windowStats.mAverage	= sum / double( window.second.size() );
+		( *stats )[window.first] = windowStats;
+	}
+}
+
+std::string Profiler::getReport() const
+{
+	ostringstream report;
+	report << fixed << setprecision( 3 );
+	report << left << setw( 48 ) << "scope" << right << setw( 10 ) << "last" << setw( 10 ) << "avg" << setw( 10 ) << "min" << setw( 10 ) << "max" << " (ms)" << endl;
+	auto printStats = [&report]( const char *prefix, const std::map<std::string, Stats> &stats ) {
+		for( const auto &scope : stats ) {
+			report << left << setw( 48 ) << ( string( prefix ) + scope.first ) << right
+				<< setw( 10 ) << scope.second.mLast << setw( 10 ) << scope.second.mAverage
+				<< setw( 10 ) << scope.second.mMin << setw( 10 ) << scope.second.mMax << endl;
+		}
+	};
+	printStats( "gpu ", mGpuStats );
+	printStats( "cpu ", mCpuStats );
+	return report.str();
+}
+
+std::string Profiler::getTrace() const
+{
+	ostringstream trace;
+	trace << "{\"traceEvents\":[";
+	bool first = true;
+	for( const auto &event : mTrace ) {
+		trace << ( first ? "" : "," ) << endl
+			<< "{\"name\":\"" << escapeJson( event.mName ) << "\",\"cat\":\"" << ( event.mIsGpu ? "gpu" : "cpu" ) << "\",\"ph\":\"X\""
+			<< ",\"ts\":" << event.mTimestamp << ",\"dur\":" << event.mDuration << ",\"pid\":0,\"tid\":" << ( event.mIsGpu ? 1 : 0 ) << "}";
+		first = false;
+	}
+	trace << endl << "],\"displayTimeUnit\":\"ms\"}" << endl;
+	return trace.str();
+}
+
+void Profiler::writeTrace( const ci::fs::path &path ) const
+{
+	ofstream file( path.string() );
+	if( ! file ) {
+		CI_LOG_W( "Profiler: Can't open " << path << " for writing" );
+		return;
+	}
+	file << getTrace();
+}
+
+ScopedGpuTimer::ScopedGpuTimer( const char *name, int index )
+: mActive( profiler()->isEnabled() )
+{
+	if( mActive ) {
+		profiler()->beginGpu( formatName( name, index ) );
+	}
+}
+ScopedGpuTimer::~ScopedGpuTimer()
+{
+	if( mActive ) {
+		profiler()->endGpu();
+	}
+}
+
+ScopedCpuTimer::ScopedCpuTimer( const char *name, int index )
+: mActive( profiler()->isEnabled() )
+{
+	if( mActive ) {
+		profiler()->beginCpu( formatName( name, index ) );
+	}
+}
+ScopedCpuTimer::~ScopedCpuTimer()
+{
+	if( mActive ) {
+		profiler()->endCpu();
+	}
+}
+
+} // namespace renderkit
@@ -0,0 +1,157 @@
+/*
+ RenderKit
+ 
+ Copyright (c) 2016, Simon Geilfus, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+ 
+ Redistribution and use in source and binary forms, with or without modification, are permitted provided that
+ the following conditions are met:
+ 
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and
+	the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+	the following disclaimer in the documentation and/or other materials provided with the distribution.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cinder/Filesystem.h"
+#include "cinder/Noncopyable.h"
+#include "cinder/gl/platform.h"
+
+namespace renderkit {
+
+//! Collects CPU and GPU timings of named scopes, aggregates them into rolling statistics and records them in the Chrome trace event format ( chrome://tracing, Perfetto ).
+// GPU scopes are bracketed by GL_TIMESTAMP queries, which unlike GL_TIME_ELAPSED queries can nest and place the events on the same timeline as the CPU ones.
+// Results are only read once available, usually a few frames later, so the profiler never stalls the pipeline. Disabled by default, scopes are free until enabled.
+// Scopes have to be opened and closed on the thread owning the GL context.
+class Profiler {
+public:
+	//! Rolling statistics of a scope in milliseconds.
+	struct Stats {
+		double	mLast, mAverage, mMin, mMax;
+		size_t	mCount;
+	};
+
+	static Profiler* instance();
+	~Profiler();
+
+	//! Enables or disables the profiler. Disabled by default.
+	void setEnabled( bool enabled = true ) { mEnabled = enabled; }
+	//! Returns whether the profiler is enabled.
+	bool isEnabled() const { return mEnabled; }
+	//! Sets the number of samples of the rolling statistics. Default to 120.
+	void setWindowSize( size_t numSamples ) { mWindowSize = std::max<size_t>( 1, numSamples ); }
+	//! Sets the maximum number of events kept for the trace, the oldest are dropped first. 0 disables the trace. Default to 65536.
+	void setTraceCapacity( size_t numEvents ) { mTraceCapacity = numEvents; }
+
+	//! Begins a GPU scope. Scopes can nest and must be ended in reverse order.
+	void beginGpu( const std::string &name );
+	//! Ends the last GPU scope.
+	void endGpu();
+	//! Begins a CPU scope. Scopes can nest and must be ended in reverse order.
+	void beginCpu( const std::string &name );
+	//! Ends the last CPU scope.
+	void endCpu();
+
+	//! Collects the GPU timings that are available without waiting and updates the statistics. Should be called once per frame.
+	void update();
+
+	//! Returns the statistics of every GPU scope.
+	const std::map<std::string, Stats>& getGpuStats() const { return mGpuStats; }
+	//! Returns the statistics of every CPU scope.
+	const std::map<std::string, Stats>& getCpuStats() const { return mCpuStats; }
+	//! Returns a table of the GPU and CPU statistics.
+	std::string getReport() const;
+	//! Returns the number of GPU scopes whose results aren't available yet.
+	size_t getNumPending() const { return mPendingGpu.size(); }
+
+	//! Returns the recorded events as a Chrome trace event JSON document. CPU events are on thread 0, GPU events on thread 1.
+	std::string getTrace() const;
+	//! Writes the recorded events to \a path as a Chrome trace event JSON document.
+	void writeTrace( const ci::fs::path &path ) const;
+	//! Clears the recorded events.
+	void clearTrace() { mTrace.clear(); }
+
+	Profiler( const Profiler& ) = delete;
+	Profiler& operator=( const Profiler& ) = delete;
+
+protected:
+	Profiler();
+
+	using Clock = std::chrono::steady_clock;
+
+	struct GpuScope {
+		std::string		mName;
+		GLuint			mBegin, mEnd;
+	};
+	struct CpuScope {
+		std::string			mName;
+		Clock::time_point	mBegin;
+	};
+	struct TraceEvent {
+		std::string		mName;
+		int64_t			mTimestamp, mDuration; // microseconds
+		bool			mIsGpu;
+	};
+
+	GLuint acquireQuery();
+	int64_t getCpuTime() const;
+	void addSample( std::map<std::string, std::deque<double>> &samples, const std::string &name, double milliseconds );
+	void addTraceEvent( const std::string &name, int64_t timestamp, int64_t duration, bool isGpu );
+	static void updateStats( const std::map<std::string, std::deque<double>> &samples, std::map<std::string, Stats> *stats );
+
+	bool										mEnabled;
+	size_t										mWindowSize, mTraceCapacity;
+	Clock::time_point							mEpoch;
+	int64_t										mGpuOffset; // microseconds from the GPU clock to the CPU one
+
+	std::vector<GpuScope>						mGpuStack;
+	std::deque<GpuScope>						mPendingGpu;
+	std::vector<GLuint>							mFreeQueries;
+	std::vector<CpuScope>						mCpuStack;
+
+	std::map<std::string, std::deque<double>>	mGpuSamples, mCpuSamples;
+	std::map<std::string, Stats>				mGpuStats, mCpuStats;
+	std::deque<TraceEvent>						mTrace;
+};
+
+static inline Profiler* profiler() { return Profiler::instance(); }
+
+//! Times the GPU commands issued during its lifetime. \a index is appended to \a name, ie. a mip level or a face, and only formatted when the profiler is enabled.
+class ScopedGpuTimer : private ci::Noncopyable {
+public:
+	ScopedGpuTimer( const char *name, int index = -1 );
+	~ScopedGpuTimer();
+
+protected:
+	bool	mActive;
+};
+
+//! Times the CPU work done during its lifetime. \a index is appended to \a name and only formatted when the profiler is enabled.
+class ScopedCpuTimer : private ci::Noncopyable {
+public:
+	ScopedCpuTimer( const char *name, int index = -1 );
+	~ScopedCpuTimer();
+
+protected:
+	bool	mActive;
+};
+
+} // namespace renderkit
@@ -0,0 +1,114 @@
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+WorkStealingPoolRef WorkStealingPool::create( int numThreads )
+{
+	return make_shared<WorkStealingPool>( numThreads ? numThreads : (int) std::max( 1u, thread::hardware_concurrency() ) );
+}
+
+WorkStealingPool::WorkStealingPool( int numThreads )
+	: mQueues( std::max( 1, numThreads ) ), mRemaining( 0 ), mGeneration( 0 ), mQuit( false )
+{
+	for( auto &queue : mQueues ) {
+		queue.reset( new Queue() );
+	}
+	for( int i = 0; i < (int) mQueues.size() - 1; ++i ) {
+		mThreads.emplace_back( [this, i] { workerLoop( i ); } );
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		lock_guard<mutex> lock( mMutex );
+		mQuit = true;
+	}
+	mWake.notify_all();
+	for( auto &thread : mThreads ) {
+		thread.join();
+	}
+}
+
+void WorkStealingPool::run( uint32_t count, uint32_t grain, const RangeFn &rangeFn )
+{
+	if( ! count ) {
+		return;
+	}
+
+	// the calling thread owns the last queue, a single run at a time
+	lock_guard<mutex> runLock( mRunMutex );
+	grain = std::max<uint32_t>( 1, grain );
+	uint32_t numRanges = ( count + grain - 1 ) / grain;
+	{
+		lock_guard<mutex> lock( mMutex );
+		mRangeFn	= rangeFn;
+		mRemaining	= numRanges;
+		++mGeneration;
+	}
+	// the ranges are published after the function, a thread popping one always sees the function it belongs to
+	for( uint32_t range = 0; range < numRanges; ++range ) {
+		auto &queue = *mQueues[range % mQueues.size()];
+		lock_guard<mutex> lock( queue.mMutex );
+		queue.mRanges.push_back( { range * grain, std::min( count, ( range + 1 ) * grain ) } );
+	}
+	mWake.notify_all();
+
+	work( (int) mQueues.size() - 1 );
+	while( mRemaining.load() > 0 ) {
+		this_thread::yield();
+	}
+}
+
+bool WorkStealingPool::pop( int index, Range *range )
+{
+	auto &queue = *mQueues[index];
+	lock_guard<mutex> lock( queue.mMutex );
+	if( queue.mRanges.empty() ) {
+		return false;
+	}
+	*range = queue.mRanges.back();
+	queue.mRanges.pop_back();
+	return true;
+}
+
+bool WorkStealingPool::steal( int thief, Range *range )
+{
+	for( size_t i = 1; i < mQueues.size(); ++i ) {
+		auto &queue = *mQueues[( thief + i ) % mQueues.size()];
+		lock_guard<mutex> lock( queue.mMutex );
+		if( ! queue.mRanges.empty() ) {
+			*range = queue.mRanges.front();
+			queue.mRanges.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::work( int index )
+{
+	Range range;
+	while( pop( index, &range ) || steal( index, &range ) ) {
+		mRangeFn( range.mFirst, range.mLast );
+		mRemaining.fetch_sub( 1 );
+	}
+}
+
+void WorkStealingPool::workerLoop( int index )
+{
+	uint64_t generation = 0;
+	while( true ) {
+		{
+			unique_lock<mutex> lock( mMutex );
+			mWake.wait( lock, [&] { return mQuit || mGeneration != generation; } );
+			if( mQuit ) {
+				return;
+			}
+			generation = mGeneration;
+		}
+		work( index );
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! Runs ranges of items on persistent threads. Every thread owns a queue, pops its own ranges from the back and steals from the front
+// of the other queues once empty, so uneven ranges balance themselves. The calling thread takes part and owns the last queue.
+// run() can be called from any thread, concurrent calls are serialized.
+typedef std::shared_ptr<class WorkStealingPool> WorkStealingPoolRef;
+class WorkStealingPool {
+public:
+	using RangeFn = std::function<void( uint32_t first, uint32_t last )>;
+
+	//! Returns a pool of \a numThreads threads, the calling thread included. 0 uses the number of hardware threads.
+	static WorkStealingPoolRef	create( int numThreads = 0 );
+	~WorkStealingPool();
+
+	//! Splits [ 0, count ) in ranges of \a grain items and blocks until \a rangeFn has run on every range.
+	void						run( uint32_t count, uint32_t grain, const RangeFn &rangeFn );
+	//! Returns the number of threads running the ranges, the calling thread included.
+	int							getNumThreads() const { return (int) mQueues.size(); }
+
+	WorkStealingPool( int numThreads );
+	WorkStealingPool( const WorkStealingPool& ) = delete;
+	WorkStealingPool& operator=( const WorkStealingPool& ) = delete;
+
+protected:
+	struct Range { uint32_t mFirst, mLast; };
+	struct Queue {
+		std::mutex			mMutex;
+		std::deque<Range>	mRanges;
+	};
+
+	bool pop( int index, Range *range );
+	bool steal( int thief, Range *range );
+	void work( int index );
+	void workerLoop( int index );
+
+	std::vector<std::unique_ptr<Queue>>	mQueues;
+	std::vector<std::thread>			mThreads;
+	std::mutex							mRunMutex;
+	std::mutex							mMutex;
+	std::condition_variable				mWake;
+	RangeFn								mRangeFn;
+	std::atomic<uint32_t>				mRemaining;
+	uint64_t							mGeneration;
+	bool								mQuit;
+};